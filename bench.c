@@ -0,0 +1,844 @@
+//mini-FileSystem benchmark: drives the library directly, or replays a recorded trace, and reports throughput and latency
+// Build: gcc -O2 -o fsbench bench.c filesystem.c -pthread
+
+#include "filesystem.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+
+
+//define MACROS
+
+#define BENCH_DEFAULT_FILES 10000
+#define BENCH_DEFAULT_DIRS 100
+#define BENCH_DEFAULT_SIZES "64,4096,65536,1048576"
+#define BENCH_MAX_SIZES 16
+#define BENCH_DATA_FILES 200 // files written, read and copied at each size...
+#define BENCH_DATA_BUDGET (16 * 1024 * 1024) // ...fewer when they would hold more than this
+#define BENCH_FIND_ROUNDS 20 // exact-name searches; glob searches run a quarter as many
+#define BENCH_LIST_PAGE 256 // entries per fsListDirectory call
+#define REPLAY_MAX_LENGTH (64 * 1024 * 1024) // longer reads and writes in a trace are cut to this
+#define REPLAY_OUTPUT_LIMIT (64 * 1024 * 1024) // a replay thread's output is discarded past this
+
+
+//Timed operation
+// Latencies of one kind of operation, in nanoseconds
+struct Measure {
+    const char *name;
+    long count;
+    long capacity;
+    uint64_t *latencies;
+    uint64_t bytes; // data moved, for the MB/s column
+    struct timespec start;
+    int failures;
+};
+
+static uint64_t nanosSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ull + (uint64_t)(now.tv_nsec - start->tv_nsec);
+}
+
+// Start a new kind of operation; the output file is emptied so it does not grow without end
+static void measureInit(struct Measure *m, const char *name, long capacity) {
+    FILE *out = fsOutput();
+    fflush(out);
+    if (ftruncate(fileno(out), 0) == 0) {
+        rewind(out);
+    }
+    memset(m, 0, sizeof(*m));
+    m->name = name;
+    m->capacity = capacity > 0 ? capacity : 1;
+    m->latencies = malloc(m->capacity * sizeof(uint64_t));
+}
+
+static void measureBegin(struct Measure *m) {
+    clock_gettime(CLOCK_MONOTONIC, &m->start);
+}
+
+// Record the operation started by measureBegin; `status` is its return value
+static void measureEnd(struct Measure *m, int status) {
+    uint64_t elapsed = nanosSince(&m->start);
+    if (m->count < m->capacity) {
+        m->latencies[m->count++] = elapsed;
+    }
+    if (status != 0) {
+        m->failures++;
+    }
+}
+
+static int compareLatencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentileMicros(const struct Measure *m, double p) {
+    long k = (long)(p * (m->count - 1) + 0.5);
+    return m->latencies[k] / 1000.0;
+}
+
+//PRINT ONE RESULT LINE
+// ops/s is computed from the summed latencies, so setup between operations is not counted
+static void measureReport(struct Measure *m) {
+    if (m->count == 0) {
+        free(m->latencies);
+        return;
+    }
+    uint64_t total = 0;
+    for (long k = 0; k < m->count; k++) {
+        total += m->latencies[k];
+    }
+    qsort(m->latencies, m->count, sizeof(uint64_t), compareLatencies);
+    double seconds = total / 1e9;
+    printf("%-16s %8ld %12.0f %9.1f %9.1f %9.1f %9.1f", m->name, m->count,
+           seconds > 0 ? m->count / seconds : 0.0, percentileMicros(m, 0.50), percentileMicros(m, 0.90),
+           percentileMicros(m, 0.99), m->latencies[m->count - 1] / 1000.0);
+    if (m->bytes > 0) {
+        printf(" %9.1f", seconds > 0 ? m->bytes / seconds / (1024 * 1024) : 0.0);
+    }
+    if (m->failures > 0) {
+        printf("  (%d failed)", m->failures);
+    }
+    printf("\n");
+    free(m->latencies);
+}
+
+static long gcd(long a, long b) {
+    while (b != 0) {
+        long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Position k of a fixed permutation of 0 .. n-1 that jumps around, so lookups do not
+// simply follow creation order
+static long shuffled(long k, long n) {
+    long stride = 7919;
+    while (gcd(stride, n) != 1) {
+        stride++;
+    }
+    return (k * stride + n / 3) % n;
+}
+
+//METADATA BENCHMARK
+// Creates, looks up, lists, searches, renames and removes `numFiles` files spread over
+// `numDirs` directories
+static void benchMetadata(struct Superblock *sb, long numFiles, long numDirs) {
+    char dirName[MAX_PATH_LENGTH], fileName[MAX_FILE_NAME_LENGTH], newName[MAX_FILE_NAME_LENGTH];
+    struct Measure m;
+
+    measureInit(&m, "mkdir", numDirs);
+    for (long d = 0; d < numDirs; d++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", d);
+        measureBegin(&m);
+        measureEnd(&m, makeDirectory(sb, dirName));
+    }
+    measureReport(&m);
+
+    measureInit(&m, "create", numFiles);
+    for (long f = 0; f < numFiles; f++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", f % numDirs);
+        snprintf(fileName, sizeof(fileName), "f%ld", f);
+        measureBegin(&m);
+        measureEnd(&m, createFile(sb, dirName, fileName));
+    }
+    measureReport(&m);
+
+    // A lookup: resolve the path, find the name and hand out a handle
+    measureInit(&m, "open+close", numFiles);
+    for (long k = 0; k < numFiles; k++) {
+        long f = shuffled(k, numFiles);
+        snprintf(dirName, sizeof(dirName), "/d%ld", f % numDirs);
+        snprintf(fileName, sizeof(fileName), "f%ld", f);
+        measureBegin(&m);
+        int fd = fsOpen(sb, dirName, fileName, 0);
+        measureEnd(&m, fd < 0 ? -1 : fsClose(sb, fd));
+    }
+    measureReport(&m);
+
+    measureInit(&m, "ls", numDirs);
+    for (long d = 0; d < numDirs; d++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", d);
+        measureBegin(&m);
+        measureEnd(&m, listFiles(sb, dirName));
+    }
+    measureReport(&m);
+
+    // The whole directory in name order, with sizes and times, a page at a time
+    static struct FsDirEntry entries[BENCH_LIST_PAGE];
+    measureInit(&m, "ls -l", numDirs);
+    for (long d = 0; d < numDirs; d++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", d);
+        struct FsDirCursor cursor;
+        memset(&cursor, 0, sizeof(cursor));
+        cursor.flags = FS_LIST_SORTED;
+        int got;
+        measureBegin(&m);
+        while ((got = fsListDirectory(sb, dirName, &cursor, entries, BENCH_LIST_PAGE)) > 0) {
+        }
+        measureEnd(&m, got);
+    }
+    measureReport(&m);
+
+    measureInit(&m, "find exact", BENCH_FIND_ROUNDS);
+    for (long k = 0; k < BENCH_FIND_ROUNDS; k++) {
+        snprintf(fileName, sizeof(fileName), "f%ld", shuffled(k, numFiles));
+        measureBegin(&m);
+        measureEnd(&m, findFile(sb, "*", fileName));
+    }
+    measureReport(&m);
+
+    measureInit(&m, "find glob", BENCH_FIND_ROUNDS / 4);
+    for (long k = 0; k < BENCH_FIND_ROUNDS / 4; k++) {
+        snprintf(fileName, sizeof(fileName), "f%ld*", k + 1);
+        measureBegin(&m);
+        measureEnd(&m, findFile(sb, "*", fileName));
+    }
+    measureReport(&m);
+
+    measureInit(&m, "rename", numFiles);
+    for (long f = 0; f < numFiles; f++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", f % numDirs);
+        snprintf(fileName, sizeof(fileName), "f%ld", f);
+        snprintf(newName, sizeof(newName), "g%ld", f);
+        measureBegin(&m);
+        measureEnd(&m, renameFile(sb, dirName, fileName, newName));
+    }
+    measureReport(&m);
+
+    measureInit(&m, "remove", numFiles);
+    for (long f = 0; f < numFiles; f++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", f % numDirs);
+        snprintf(fileName, sizeof(fileName), "g%ld", f);
+        measureBegin(&m);
+        measureEnd(&m, removeFile(sb, dirName, fileName));
+    }
+    measureReport(&m);
+
+    measureInit(&m, "rmdir", numDirs);
+    for (long d = 0; d < numDirs; d++) {
+        snprintf(dirName, sizeof(dirName), "/d%ld", d);
+        measureBegin(&m);
+        measureEnd(&m, removeDirectory(sb, dirName));
+    }
+    measureReport(&m);
+}
+
+//DATA BENCHMARK
+// Writes (echo), reads (cat) and copies files of `size` bytes
+static void benchData(struct Superblock *sb, size_t size) {
+    char fileName[MAX_FILE_NAME_LENGTH], label[32];
+    long numFiles = BENCH_DATA_BUDGET / (long)size;
+    if (numFiles > BENCH_DATA_FILES) {
+        numFiles = BENCH_DATA_FILES;
+    }
+    if (numFiles < 1) {
+        numFiles = 1;
+    }
+    char *content = malloc(size + 1);
+    if (content == NULL || makeDirectory(sb, "/data") != 0 || makeDirectory(sb, "/copies") != 0) {
+        printf("Failed to set up the %zu-byte data benchmark.\n", size);
+        free(content);
+        return;
+    }
+    for (size_t k = 0; k < size; k++) {
+        content[k] = 'a' + k % 26;
+    }
+    content[size] = '\0';
+
+    struct Measure m;
+    snprintf(label, sizeof(label), "echo %zu", size);
+    measureInit(&m, label, numFiles);
+    for (long f = 0; f < numFiles; f++) {
+        snprintf(fileName, sizeof(fileName), "f%ld", f);
+        createFile(sb, "/data", fileName);
+        measureBegin(&m);
+        measureEnd(&m, echo(sb, "/data", fileName, content));
+    }
+    m.bytes = (uint64_t)m.count * size;
+    measureReport(&m);
+
+    snprintf(label, sizeof(label), "cat %zu", size);
+    measureInit(&m, label, numFiles);
+    for (long f = 0; f < numFiles; f++) {
+        snprintf(fileName, sizeof(fileName), "f%ld", shuffled(f, numFiles));
+        measureBegin(&m);
+        measureEnd(&m, readFile(sb, "/data", fileName));
+    }
+    m.bytes = (uint64_t)m.count * size;
+    measureReport(&m);
+
+    snprintf(label, sizeof(label), "cp %zu", size);
+    measureInit(&m, label, numFiles);
+    for (long f = 0; f < numFiles; f++) {
+        snprintf(fileName, sizeof(fileName), "f%ld", f);
+        measureBegin(&m);
+        measureEnd(&m, copyFile(sb, "/data", "/copies", fileName));
+    }
+    m.bytes = (uint64_t)m.count * size;
+    measureReport(&m);
+
+    removeDirectory(sb, "/data");
+    removeDirectory(sb, "/copies");
+    free(content);
+}
+
+// Trace replay
+//
+// A trace recorded with fsTraceStart (the -T option of the command line tool) is loaded
+// into memory and run again against the fresh instance. With -t N, N threads each replay
+// their own copy of the trace, with absolute paths moved under /replay0 .. /replayN-1 and
+// each copy's relative paths starting there. Inside a copy, calls run in the order they
+// were recorded, and every recorded thread (server client) gets its own session, so each
+// keeps its own current directory. Handles are mapped from the recorded ones to those the
+// replay gets. Writes send filler bytes of the recorded length.
+
+//Operation of a loaded trace
+struct ReplayOp {
+    int op; // FS_OP_*
+    uint32_t thread;
+    uint64_t time; // nanoseconds after the trace started
+    long result; // what the recorded call returned
+    int numNumbers;
+    int64_t numbers[FS_TRACE_MAX_NUMBERS];
+    int numStrings;
+    char **strings; // in the same allocation as the pointers; NULL where the call had NULL
+};
+
+//Replay thread
+struct Replayer {
+    struct Superblock *sb;
+    const struct ReplayOp *ops;
+    long numOps;
+    char root[MAX_PATH_LENGTH]; // prefix for absolute paths, "" without fan-out
+    double speed; // 0 replays as fast as possible
+    const struct timespec *begin;
+    size_t maxLength; // longest read or write in the trace
+    struct Measure measures[FS_NUM_OPS];
+    long mismatches; // calls whose result differs from the recorded one
+    pthread_t thread;
+};
+
+// Numbers and strings each operation's records carry (see FS_OP_* in filesystem.h)
+static const int replayShapes[FS_NUM_OPS][2] = {
+    {0, 2}, {0, 1}, {0, 3}, {2, 2}, {0, 1}, {0, 1}, {0, 1}, {0, 2}, {0, 3}, {0, 2}, {0, 2}, {0, 1},
+    {0, 1}, {1, 2}, {2, 0}, {3, 0}, {2, 0}, {3, 0}, {2, 0}, {3, 0}, {2, 0}, {1, 0}, {0, 0}, {4, 2}
+};
+
+// Load every record of a trace; a damaged tail (a recording cut short) is left out
+static struct ReplayOp *loadTrace(const char *path, long *numOps) {
+    struct FsTrace *trace = fsTraceOpen(path);
+    if (trace == NULL) {
+        return NULL;
+    }
+    long count = 0, capacity = 1024;
+    struct ReplayOp *ops = malloc(capacity * sizeof(struct ReplayOp));
+    struct FsTraceRecord record;
+    int status = 0;
+    while (ops != NULL && (status = fsTraceNext(trace, &record)) > 0) {
+        if (record.numNumbers != replayShapes[record.op][0] || record.numStrings < replayShapes[record.op][1]) {
+            continue; // not something this build records
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            struct ReplayOp *grown = realloc(ops, capacity * sizeof(struct ReplayOp));
+            if (grown == NULL) {
+                break;
+            }
+            ops = grown;
+        }
+        size_t size = record.numStrings * sizeof(char *);
+        for (int k = 0; k < record.numStrings; k++) {
+            size += record.strings[k] != NULL ? strlen(record.strings[k]) + 1 : 0;
+        }
+        struct ReplayOp *op = &ops[count];
+        op->strings = malloc(size > 0 ? size : 1);
+        if (op->strings == NULL) {
+            break;
+        }
+        char *next = (char *)(op->strings + record.numStrings);
+        for (int k = 0; k < record.numStrings; k++) {
+            op->strings[k] = NULL;
+            if (record.strings[k] != NULL) {
+                op->strings[k] = strcpy(next, record.strings[k]);
+                next += strlen(next) + 1;
+            }
+        }
+        op->op = record.op;
+        op->thread = record.thread;
+        op->time = record.time;
+        op->result = record.result;
+        op->numNumbers = record.numNumbers;
+        memcpy(op->numbers, record.numbers, sizeof(op->numbers));
+        op->numStrings = record.numStrings;
+        count++;
+    }
+    fsTraceClose(trace);
+    if (status < 0) {
+        printf("Trace '%s' is damaged after %ld operations; replaying those.\n", path, count);
+    }
+    *numOps = count;
+    return ops;
+}
+
+// An absolute path moved under the replay's root
+static const char *replayPath(const struct Replayer *r, const char *path, char *buf, size_t size) {
+    if (r->root[0] == '\0' || path == NULL || path[0] != '/') {
+        return path;
+    }
+    if (path[1] == '\0') {
+        return r->root;
+    }
+    snprintf(buf, size, "%s%s", r->root, path);
+    return buf;
+}
+
+// The replay's handle for a recorded one
+static int replayFd(const int *fds, int64_t recorded) {
+    return recorded >= 0 && recorded < MAX_OPEN_FILES ? fds[recorded] : -1;
+}
+
+static long replayOne(struct Replayer *r, const struct ReplayOp *op, int *fds, char *buffer, struct FsDirEntry **entries, int *capEntries) {
+    struct Superblock *sb = r->sb;
+    char paths[2][HOST_PATH_LENGTH];
+    const char *dir = op->numStrings > 0 ? replayPath(r, op->strings[0], paths[0], sizeof(paths[0])) : NULL;
+    const char *second = op->numStrings > 1 ? op->strings[1] : NULL;
+    const char *const *names = (const char *const *)op->strings;
+    const int64_t *n = op->numbers;
+    size_t length = n[1] < 0 ? 0 : (size_t)n[1] > r->maxLength ? r->maxLength : (size_t)n[1];
+    switch (op->op) {
+    case FS_OP_CREATE:
+        return createFile(sb, dir, second);
+    case FS_OP_MKDIR:
+        return makeDirectory(sb, dir);
+    case FS_OP_ECHO:
+        return echo(sb, dir, second, op->strings[2]);
+    case FS_OP_READ_FILE:
+        return readFileRange(sb, dir, second, (long)n[0], (long)n[1]);
+    case FS_OP_PREFETCH:
+        return prefetchFiles(sb, dir, (const char **)names + 1, op->numStrings - 1);
+    case FS_OP_LIST:
+        return listFiles(sb, dir);
+    case FS_OP_CD:
+        return changeDirectory(sb, dir);
+    case FS_OP_COPY:
+        return copyFiles(sb, dir, replayPath(r, second, paths[1], sizeof(paths[1])), (const char **)names + 2, op->numStrings - 2);
+    case FS_OP_RENAME:
+        return renameFile(sb, dir, second, op->strings[2]);
+    case FS_OP_RENAME_DIR:
+        return renameDirectory(sb, dir, replayPath(r, second, paths[1], sizeof(paths[1])));
+    case FS_OP_FIND:
+        return findFile(sb, dir, second);
+    case FS_OP_REMOVE:
+        return removeFiles(sb, dir, (const char **)names + 1, op->numStrings - 1);
+    case FS_OP_RMDIR:
+        return removeDirectory(sb, dir);
+    case FS_OP_OPEN:
+        return fsOpen(sb, dir, second, (int)n[0]);
+    case FS_OP_READ:
+        return fsRead(sb, replayFd(fds, n[0]), buffer, length);
+    case FS_OP_PREAD:
+        return fsPread(sb, replayFd(fds, n[0]), buffer, length, (long)n[2]);
+    case FS_OP_WRITE:
+        return fsWrite(sb, replayFd(fds, n[0]), buffer, length);
+    case FS_OP_PWRITE:
+        return fsPwrite(sb, replayFd(fds, n[0]), buffer, length, (long)n[2]);
+    case FS_OP_APPEND:
+        return fsAppend(sb, replayFd(fds, n[0]), buffer, length);
+    case FS_OP_SEEK:
+        return fsSeek(sb, replayFd(fds, n[0]), (long)n[1], (int)n[2]);
+    case FS_OP_TRUNCATE:
+        return fsTruncate(sb, replayFd(fds, n[0]), (long)n[1]);
+    case FS_OP_CLOSE:
+        return fsClose(sb, replayFd(fds, n[0]));
+    case FS_OP_SYNC:
+        return fsSync(sb);
+    case FS_OP_LIST_PAGE: {
+        struct FsDirCursor cursor;
+        memset(&cursor, 0, sizeof(cursor));
+        cursor.flags = (int)n[0];
+        cursor.next = (uint64_t)n[2];
+        cursor.lastType = (int)n[3];
+        snprintf(cursor.lastName, sizeof(cursor.lastName), "%s", second);
+        int max = n[1] > 0 && n[1] <= BENCH_LIST_PAGE * 64 ? (int)n[1] : BENCH_LIST_PAGE;
+        if (max > *capEntries) {
+            struct FsDirEntry *grown = realloc(*entries, max * sizeof(struct FsDirEntry));
+            if (grown == NULL) {
+                return -1;
+            }
+            *entries = grown;
+            *capEntries = max;
+        }
+        return fsListDirectory(sb, dir, &cursor, *entries, max);
+    }
+    }
+    return -1;
+}
+
+// Run one copy of the trace
+static void *replayThread(void *arg) {
+    struct Replayer *r = arg;
+    FILE *out = tmpfile();
+    char *buffer = malloc(r->maxLength > 0 ? r->maxLength : 1);
+    struct FsSession **sessions = NULL;
+    uint32_t numSessions = 0;
+    struct FsDirEntry *entries = NULL;
+    int capEntries = 0;
+    int fds[MAX_OPEN_FILES];
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        fds[fd] = -1;
+    }
+    if (out == NULL || buffer == NULL) {
+        printf("Failed to set up a replay thread.\n");
+        r->numOps = 0;
+    } else {
+        memset(buffer, 'x', r->maxLength);
+    }
+
+    for (long k = 0; k < r->numOps; k++) {
+        const struct ReplayOp *op = &r->ops[k];
+        if (r->speed > 0) {
+            uint64_t due = (uint64_t)(op->time / r->speed), elapsed = nanosSince(r->begin);
+            if (due > elapsed) {
+                struct timespec pause = {(time_t)((due - elapsed) / 1000000000u), (long)((due - elapsed) % 1000000000u)};
+                nanosleep(&pause, NULL);
+            }
+        }
+
+        // Each recorded thread replays in its own session
+        if (op->thread >= numSessions) {
+            uint32_t count = op->thread + 1;
+            struct FsSession **grown = realloc(sessions, count * sizeof(struct FsSession *));
+            if (grown == NULL) {
+                continue;
+            }
+            sessions = grown;
+            for (; numSessions < count; numSessions++) {
+                sessions[numSessions] = NULL;
+            }
+        }
+        if (sessions[op->thread] == NULL) {
+            sessions[op->thread] = malloc(sizeof(struct FsSession));
+            if (sessions[op->thread] == NULL) {
+                continue;
+            }
+            sessions[op->thread]->out = out;
+            strcpy(sessions[op->thread]->cwd, r->root[0] != '\0' ? r->root : "/");
+        }
+        fsAttachSession(sessions[op->thread]);
+
+        struct Measure *m = &r->measures[op->op];
+        measureBegin(m);
+        long result = replayOne(r, op, fds, buffer, &entries, &capEntries);
+        measureEnd(m, result < 0 ? -1 : 0);
+        int moved = op->op == FS_OP_READ || op->op == FS_OP_PREAD || op->op == FS_OP_WRITE
+                 || op->op == FS_OP_PWRITE || op->op == FS_OP_APPEND;
+        if (moved && result > 0) {
+            m->bytes += (uint64_t)result;
+        }
+
+        // Handle numbers differ between runs; only whether the open worked must match
+        if (op->op == FS_OP_OPEN) {
+            if (result >= 0 && op->result >= 0 && op->result < MAX_OPEN_FILES) {
+                fds[op->result] = (int)result;
+            }
+            r->mismatches += (result < 0) != (op->result < 0);
+        } else {
+            r->mismatches += result != op->result;
+        }
+        if (op->op == FS_OP_CLOSE && result == 0 && op->numbers[0] >= 0 && op->numbers[0] < MAX_OPEN_FILES) {
+            fds[op->numbers[0]] = -1;
+        }
+
+        // Messages and file contents are thrown away now and then
+        if (ftell(out) > REPLAY_OUTPUT_LIMIT) {
+            fflush(out);
+            if (ftruncate(fileno(out), 0) == 0) {
+                rewind(out);
+            }
+        }
+    }
+
+    fsAttachSession(NULL);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (fds[fd] >= 0) {
+            fsClose(r->sb, fds[fd]);
+        }
+    }
+    for (uint32_t s = 0; s < numSessions; s++) {
+        free(sessions[s]);
+    }
+    free(sessions);
+    free(entries);
+    free(buffer);
+    if (out != NULL) {
+        fclose(out);
+    }
+    return NULL;
+}
+
+//REPLAY A TRACE
+// Runs `numThreads` copies of the trace at `speed` times the recorded pace (0 for as fast
+// as possible) and reports each operation's latency and the overall throughput
+static int replayTrace(struct Superblock *sb, const char *path, int numThreads, double speed) {
+    long numOps = 0;
+    struct ReplayOp *ops = loadTrace(path, &numOps);
+    if (ops == NULL) {
+        printf("Failed to load trace '%s'.\n", path);
+        return -1;
+    }
+    long perOp[FS_NUM_OPS] = {0};
+    size_t maxLength = 0;
+    for (long k = 0; k < numOps; k++) {
+        perOp[ops[k].op]++;
+        int op = ops[k].op;
+        if ((op == FS_OP_READ || op == FS_OP_PREAD || op == FS_OP_WRITE || op == FS_OP_PWRITE || op == FS_OP_APPEND)
+                && ops[k].numbers[1] > 0 && (size_t)ops[k].numbers[1] > maxLength) {
+            maxLength = (size_t)ops[k].numbers[1];
+        }
+    }
+    if (maxLength > REPLAY_MAX_LENGTH) {
+        maxLength = REPLAY_MAX_LENGTH;
+    }
+    char pace[64];
+    if (speed > 0) {
+        snprintf(pace, sizeof(pace), "%g times the recorded pace", speed);
+    } else {
+        strcpy(pace, "full speed");
+    }
+    printf("Replaying %ld operations from '%s' on %d thread%s at %s\n", numOps, path, numThreads,
+           numThreads > 1 ? "s, one copy of the trace each," : "", pace);
+
+    struct Replayer *replayers = calloc(numThreads, sizeof(struct Replayer));
+    if (replayers == NULL) {
+        free(ops);
+        return -1;
+    }
+    struct timespec begin;
+    for (int t = 0; t < numThreads; t++) {
+        struct Replayer *r = &replayers[t];
+        r->sb = sb;
+        r->ops = ops;
+        r->numOps = numOps;
+        r->speed = speed;
+        r->begin = &begin;
+        r->maxLength = maxLength;
+        if (numThreads > 1) {
+            snprintf(r->root, sizeof(r->root), "/replay%d", t);
+            makeDirectory(sb, r->root);
+        }
+        for (int op = 0; op < FS_NUM_OPS; op++) {
+            measureInit(&r->measures[op], fsTraceOpName(op), perOp[op]);
+        }
+    }
+
+    printf("%-16s %8s %12s %9s %9s %9s %9s %9s\n", "operation", "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us", "MB/s");
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int started = 0;
+    for (; started < numThreads; started++) {
+        if (pthread_create(&replayers[started].thread, NULL, replayThread, &replayers[started]) != 0) {
+            break;
+        }
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(replayers[t].thread, NULL);
+    }
+    double seconds = nanosSince(&begin) / 1e9;
+
+    // Every thread's latencies go into the first thread's measures
+    long mismatches = 0, total = 0;
+    for (int op = 0; op < FS_NUM_OPS; op++) {
+        struct Measure *all = &replayers[0].measures[op];
+        long count = all->count;
+        for (int t = 1; t < started; t++) {
+            count += replayers[t].measures[op].count;
+        }
+        uint64_t *latencies = count > all->capacity ? realloc(all->latencies, count * sizeof(uint64_t)) : all->latencies;
+        if (latencies != NULL) {
+            all->latencies = latencies;
+            for (int t = 1; t < started; t++) {
+                struct Measure *m = &replayers[t].measures[op];
+                memcpy(all->latencies + all->count, m->latencies, m->count * sizeof(uint64_t));
+                all->count += m->count;
+                all->bytes += m->bytes;
+                all->failures += m->failures;
+            }
+        }
+        for (int t = 1; t < numThreads; t++) {
+            free(replayers[t].measures[op].latencies);
+        }
+        total += all->count;
+        measureReport(all);
+    }
+    for (int t = 0; t < started; t++) {
+        mismatches += replayers[t].mismatches;
+    }
+    printf("%ld operations in %.3f s: %.0f ops/s; %ld results differ from the recording\n",
+           total, seconds, seconds > 0 ? total / seconds : 0.0, mismatches);
+
+    for (int t = 0; t < numThreads; t++) {
+        if (replayers[t].root[0] != '\0') {
+            removeDirectory(sb, replayers[t].root);
+        }
+    }
+    for (long k = 0; k < numOps; k++) {
+        free(ops[k].strings);
+    }
+    free(ops);
+    free(replayers);
+    return started == numThreads ? 0 : -1;
+}
+
+//MAIN PROGRAM
+int main(int argc, char *argv[]) {
+    // -n <files> and -d <dirs> size the metadata benchmark; -s <sizes> lists the file sizes of
+    // the data benchmark (comma separated bytes); -i <image> benchmarks the image backend
+    // (-z compresses the files it writes, -D deduplicates their blocks), -m <catalog> host
+    // mode with a catalog (the default keeps none); -c <MiB> sizes the buffer cache; -w <dir>
+    // is where the benchmark works (a fresh directory is made inside, which is also where a
+    // relative image or catalog goes); -r <trace> replays a recorded trace instead of the
+    // benchmarks, on -t <threads> threads at -x <speed> times the recorded pace (0, the
+    // default, for as fast as possible)
+    long numFiles = BENCH_DEFAULT_FILES, numDirs = BENCH_DEFAULT_DIRS;
+    const char *sizeList = BENCH_DEFAULT_SIZES;
+    const char *imagePath = NULL, *catalogPath = NULL, *workDir = ".";
+    long cacheMiB = CACHE_DEFAULT_MIB;
+    int compress = false, dedup = false;
+    const char *tracePath = NULL;
+    int numThreads = 1;
+    double speed = 0;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-n") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) {
+            numFiles = atol(argv[++a]);
+        } else if (strcmp(argv[a], "-d") == 0 && a + 1 < argc && atol(argv[a + 1]) > 0) {
+            numDirs = atol(argv[++a]);
+        } else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc) {
+            sizeList = argv[++a];
+        } else if (strcmp(argv[a], "-i") == 0 && a + 1 < argc) {
+            imagePath = argv[++a];
+        } else if (strcmp(argv[a], "-m") == 0 && a + 1 < argc) {
+            catalogPath = argv[++a];
+        } else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc) {
+            cacheMiB = atol(argv[++a]);
+        } else if (strcmp(argv[a], "-z") == 0) {
+            compress = true;
+        } else if (strcmp(argv[a], "-D") == 0) {
+            dedup = true;
+        } else if (strcmp(argv[a], "-w") == 0 && a + 1 < argc) {
+            workDir = argv[++a];
+        } else if (strcmp(argv[a], "-r") == 0 && a + 1 < argc) {
+            tracePath = argv[++a];
+        } else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            numThreads = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-x") == 0 && a + 1 < argc && atof(argv[a + 1]) >= 0) {
+            speed = atof(argv[++a]);
+        } else {
+            printf("Usage: %s [-n files] [-d dirs] [-s size,...] [-i image [-z] [-D] | -m catalog] [-c cacheMiB] [-w dir]\n"
+                   "       [-r trace [-t threads] [-x speed]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t sizes[BENCH_MAX_SIZES];
+    int numSizes = 0;
+    for (const char *p = sizeList; *p != '\0' && numSizes < BENCH_MAX_SIZES; ) {
+        char *end;
+        long size = strtol(p, &end, 10);
+        if (end == p || size <= 0) {
+            printf("Invalid size list '%s'.\n", sizeList);
+            return 1;
+        }
+        sizes[numSizes++] = (size_t)size;
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    // The trace is read after moving into the work directory
+    char traceFull[PATH_MAX];
+    if (tracePath != NULL) {
+        if (realpath(tracePath, traceFull) == NULL) {
+            printf("Failed to find trace '%s'.\n", tracePath);
+            return 1;
+        }
+        tracePath = traceFull;
+    }
+
+    // Host-mode files are created under the current directory, so work in a fresh one,
+    // remembered as an absolute path so that it can be removed from its parent at the end
+    char scratch[PATH_MAX];
+    snprintf(scratch, sizeof(scratch), "%s/fsbench.XXXXXX", workDir);
+    if (mkdtemp(scratch) == NULL || chdir(scratch) != 0 || getcwd(scratch, sizeof(scratch)) == NULL) {
+        printf("Failed to create a work directory in '%s'.\n", workDir);
+        return 1;
+    }
+
+    struct Superblock sb;
+    int initialized = initSuperblock(&sb) == 0;
+    int status = initialized ? 0 : -1;
+    const char *backend = "host";
+    if (status == 0 && imagePath != NULL) {
+        static const char *imageBackends[] = {"image", "image+compression", "image+dedup", "image+compression+dedup"};
+        backend = imageBackends[compress + 2 * dedup];
+        if (mountImage(&sb, imagePath) != 0 || (compress && fsSetCompression(&sb, true) != 0)
+                || (dedup && fsSetDedup(&sb, true) != 0)) {
+            status = -1;
+        }
+    } else if (status == 0) {
+        if (catalogPath != NULL) {
+            backend = "host+catalog";
+            status = mountCatalog(&sb, catalogPath);
+        }
+        if (status == 0 && cacheMiB > 0) {
+            sb.cache = cacheCreate((size_t)cacheMiB * 1024 * 1024);
+        }
+    }
+
+    // Messages and file contents go to an unlinked file rather than the terminal; not to
+    // /dev/null, which would let cat skip copying the data at all
+    struct FsSession session;
+    session.out = status == 0 ? fopen("fsbench.out", "w+") : NULL;
+    strcpy(session.cwd, "/");
+    if (session.out == NULL) {
+        status = -1;
+    } else {
+        unlink("fsbench.out");
+        fsAttachSession(&session);
+    }
+
+    if (status == 0 && tracePath != NULL) {
+        printf("Backend %s, working in '%s'\n", backend, scratch);
+        status = replayTrace(&sb, tracePath, numThreads, speed);
+    } else if (status == 0) {
+        printf("Backend %s, %ld files in %ld directories, working in '%s'\n", backend, numFiles, numDirs, scratch);
+        printf("%-16s %8s %12s %9s %9s %9s %9s %9s\n", "operation", "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us", "MB/s");
+        benchMetadata(&sb, numFiles, numDirs);
+        for (int k = 0; k < numSizes; k++) {
+            benchData(&sb, sizes[k]);
+        }
+    }
+
+    if (session.out != NULL) {
+        fsAttachSession(NULL);
+        fclose(session.out);
+    }
+    if (initialized) {
+        closeFileSystem(&sb);
+    }
+
+    // Everything the benchmark created has been removed again, except a relative image or
+    // catalog (and its journal), which lives in the work directory
+    const char *metaPath = imagePath != NULL ? imagePath : catalogPath;
+    if (metaPath != NULL && strchr(metaPath, '/') == NULL) {
+        char journalPath[PATH_MAX];
+        snprintf(journalPath, sizeof(journalPath), "%s.journal", metaPath);
+        unlink(metaPath);
+        unlink(journalPath);
+    }
+    if (chdir("..") == 0) {
+        rmdir(scratch);
+    }
+    return status == 0 ? 0 : 1;
+}
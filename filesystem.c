@@ -1,626 +1,7447 @@
 //include the header files
 
-#include <stdio.h>
-#include <stdbool.h>
+#define _GNU_SOURCE // copy_file_range
+#include "filesystem.h"
 #include <string.h>
 #include <stdlib.h> // Include the <stdlib.h> header for memory allocation functions
-#include <stddef.h> // Include the <stddef.h> header for NULL pointer constant
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 
 //define MACROS
 
-#define MAX_FILE_NAME_LENGTH 50
-#define MAX_FILE_CONTENT_LENGTH 1000
-#define MAX_DIR_NAME_LENGTH 50
-#define MAX_FILES 100
-#define MAX_DIRS 100
+#define HASH_EMPTY -1
+#define HASH_DELETED -2
+#define NAME_INDEX_MIN_SIZE 16 // per-directory and directory name tables start this small
+#define NAME_BUCKETS_MIN 4096 // global file name index
+#define DENTRY_BUCKETS_MIN 256 // (parent, name) -> directory
+#define DIR_UNLOADED -2 // findDirectory: the path reaches a directory not loaded yet
 
-#define true 1
-#define false 0
+// Inode slabs: a directory's first slab holds INODE_SLAB_MIN inodes, each later one twice as many
+#define INODE_SLAB_MIN 16
+#define INODE_SLAB_MAX 4096
 
-// Forward declaration of struct Inode
-struct Inode;
+// find: pattern scans below this many files stay on the calling thread
+#define FIND_PARALLEL_MIN_FILES 1024
+#define FIND_MAX_THREADS 8
 
-//Directory
-struct Directory {
-    char name[MAX_DIR_NAME_LENGTH];
-    int numFiles;
-    struct Inode *files[MAX_FILES]; // Now an array of pointers to Inode
+// Disk image backend
+#define IMAGE_MAGIC 0x4D465331u // "MFS1"
+#define IMAGE_VERSION 7
+#define IMAGE_VERSION_MIN 4 // oldest format still mounted: 4 has no compressed files, 4 and 5 no share counts, 4 to 6 no inline files
+#define IMAGE_BLOCK_SIZE 4096
+#define IMAGE_DEFAULT_BLOCKS 16384 // 64 MiB
+#define IMAGE_DISK_INODE_SIZE 128
+#define IMAGE_INODE_EXTENTS 4 // extents stored in the inode before spilling to its overflow block
+#define IMAGE_EXTENTS_PER_BLOCK (IMAGE_BLOCK_SIZE / 8)
+#define IMAGE_SIZE_CLASSES 3 // single block, under 16 blocks, larger
+#define IMAGE_INODE_USED 1
+#define IMAGE_INODE_DIR 2
+#define IMAGE_INODE_DATA 4 // holds data shared by copies; has no name of its own
+#define IMAGE_INODE_COMPRESSED 8 // data stored as compressed chunks (see compressed files)
+#define IMAGE_INODE_INLINE 16 // data stored in the inode itself instead of its extents
+#define IMAGE_INODE_LAYOUT (IMAGE_INODE_COMPRESSED | IMAGE_INODE_INLINE) // how the data is stored, moved along with it
+#define IMAGE_INLINE_SIZE (8 * IMAGE_INODE_EXTENTS) // largest file kept inline
+#define IMAGE_COMPRESS_CHUNK 65536 // bytes of a compressed file that are decompressed together
+#define IMAGE_CHUNK_RAW 0x80000000u // chunk table: this chunk did not shrink and is stored as is
+#define IMAGE_MAX_SHARES 65535 // a block is referenced by at most this many extents besides the first
+#define DEDUP_BUCKETS_PER_BLOCK 2 // fingerprint index buckets per image block
+#define IMAGE_CATALOG 1 // DiskSuperblock flag: metadata only, file data lives on the host
+#define IMAGE_CATALOG_MIN_INODES 1024 // a new catalog's inode table, doubled as it fills
+
+// Metadata journal
+#define JOURNAL_MAGIC 0x4D46534Au // "MFSJ"
+#define JOURNAL_VERSION 1
+#define JOURNAL_GROUP_OPS 256 // operations committed together with one fdatasync
+#define JOURNAL_GROUP_MS 100 // a group whose first change is older than this is committed
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024) // empty the journal once it grows past this
+
+// Snapshots
+#define SNAPSHOT_MAGIC 0x4D465353u // "MFSS"
+#define SNAPSHOT_VERSION 1
+#define MAX_SNAPSHOTS 16 // per image
+
+// LZ codec
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // a stream always ends with at least this many literals
+
+// Buffer cache (host mode)
+#define CACHE_BLOCK_SIZE 4096
+#define CACHE_HASH_BUCKETS 4096
+#define CACHE_WRITEBACK_INTERVAL_MS 500
+
+// Read path
+#define READ_BUFFER_SIZE (1024 * 1024) // staging buffer for cached host reads
+#define READ_MAX_IOVECS 64 // extents handed to one writev
+
+// Batched host I/O
+#define IO_RING_ENTRIES 64 // io_uring submission queue; larger batches are fed through it
+#define IO_BATCH_MIN 4 // smaller batches run on the calling thread
+#define IO_BATCH_MAX 1024 // requests built at a time by bulk removals
+#define IO_MAX_THREADS 8 // pool for what io_uring cannot do here
+#define IO_UNLINK 0
+#define IO_RMDIR 1
+#define IO_COPY 2
+#define IO_PREFETCH 3 // start reading a whole file into the page cache
+
+// Deferred deletion
+#define RECLAIM_BATCH 256 // entries the reclaimer frees before it pauses
+#define RECLAIM_PAUSE_US 1000 // between batches, leaving the locks to foreground operations
+#define HOST_TRASH_DIR ".minifs.trash" // host mode: removed directories wait here to be deleted
+
+// Operation statistics: latencies go into log-linear buckets, STATS_SUB_BUCKETS per power
+// of two, so a reported latency is within 1/16 of the measured one
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS) // up to 2^64 ns
+#define STATS_CREATE 0
+#define STATS_MKDIR 1
+#define STATS_ECHO 2
+#define STATS_READ 3
+#define STATS_PREFETCH 4
+#define STATS_LIST 5
+#define STATS_CD 6
+#define STATS_COPY 7
+#define STATS_RENAME 8
+#define STATS_RENAME_DIR 9
+#define STATS_FIND 10
+#define STATS_REMOVE 11
+#define STATS_RMDIR 12
+#define STATS_OPEN 13
+#define STATS_HANDLE_READ 14 // fsRead and fsPread
+#define STATS_HANDLE_WRITE 15 // fsWrite, fsPwrite and fsAppend
+#define STATS_TRUNCATE 16
+#define STATS_CLOSE 17
+#define STATS_SYNC 18
+#define STATS_LIST_PAGE 19
+#define STATS_SEEK 20
+#define STATS_NUM_OPS 21
+
+// Operation traces: a header, then one record per call with its fields as LEB128 varints
+#define TRACE_MAGIC "MFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER (1 << 20) // bytes of records buffered before they are written out
+#define TRACE_MAX_STRING (1 << 30) // longer strings mean the trace is damaged
+
+//On-disk superblock (block 0 of an image)
+struct DiskSuperblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t numBlocks;
+    uint32_t numInodes;
+    uint32_t inodeTableStart;
+    uint32_t bitmapStart;
+    uint32_t dataStart;
+    uint32_t freeBlocks;
+    uint32_t freeInodes;
+    uint32_t flags; // IMAGE_CATALOG
+    uint32_t numDirs; // not counting the root
+    uint32_t numFiles;
+    uint32_t sharesStart; // first block of the share counts (one uint16_t per block), or 0 without them
+    uint32_t orphans; // first removed inode still waiting to be freed, or 0 (see orphans)
 };
 
-//Superblock
-struct Superblock {
-    //file system metadata
-    int totalFiles;
-    struct Directory directories[MAX_DIRS];
-    char currentDirectory[MAX_DIR_NAME_LENGTH]; // Variable to store the current directory path
+//On-disk extent: `length` contiguous blocks starting at `start`
+struct DiskExtent {
+    uint32_t start;
+    uint32_t length;
 };
 
-// Definition of struct Inode
-struct Inode {
-    //metadata
+//On-disk inode
+// Directories and files are both inodes; a file's parent is its directory's inode number.
+// Inode 0 is the root directory. Each directory keeps its entries, in creation order, on a
+// circular list through nextSibling/prevSibling, so loading one never scans the table.
+// Copied files share their data: both point (dataIno) at an IMAGE_INODE_DATA inode that
+// owns the extents and counts its references, until one of them is written to.
+// A file of up to IMAGE_INLINE_SIZE bytes keeps them where its extents would be.
+struct DiskInode {
+    uint32_t flags; // IMAGE_INODE_USED | IMAGE_INODE_DIR | IMAGE_INODE_DATA
+    uint32_t parent;
+    uint64_t size;
+    uint32_t numExtents;
+    uint32_t extentBlock; // block holding extents past the first IMAGE_INODE_EXTENTS, or 0
+    uint32_t dataIno; // shared data inode, or 0 when this inode owns its extents
+    union {
+        uint32_t refcount; // data inodes only: number of files sharing it
+        uint32_t mtime; // files and directories: last change, seconds since the epoch (0 when not known)
+    };
+    uint32_t firstChild; // directories only: first entry, or 0 when empty
+    uint32_t nextSibling;
+    uint32_t prevSibling;
+    union {
+        struct DiskExtent extents[IMAGE_INODE_EXTENTS];
+        unsigned char inlineData[IMAGE_INLINE_SIZE]; // IMAGE_INODE_INLINE
+    };
     char name[MAX_FILE_NAME_LENGTH];
-    char content[MAX_FILE_CONTENT_LENGTH];
-    int size;
-    int isDirectory;
+    char reserved[IMAGE_DISK_INODE_SIZE - 44 - 8 * IMAGE_INODE_EXTENTS - MAX_FILE_NAME_LENGTH];
 };
 
-// Function declarations
+_Static_assert(sizeof(struct DiskInode) == IMAGE_DISK_INODE_SIZE, "DiskInode must match IMAGE_DISK_INODE_SIZE");
 
-void createFile(struct Superblock *sb, const char *dirName, const char *fileName);
-void makeDirectory(struct Superblock *sb, const char *dirName);
-void echo(struct Superblock *sb, const char *dirName, const char *fileName, const char *content);
-void readFile(struct Superblock *sb, const char *dirName, const char *fileName);
-void listFiles(struct Superblock *sb, const char *dirName);
-void changeDirectory(struct Superblock *sb, const char *dirName) ;
-void copyFile(struct Superblock *sb, const char *srcDir, const char *destDir, const char *fileName) ;
-void renameFile(struct Superblock *sb, const char *dirName, const char *oldFileName, const char *newFileName);
-void renameDirectory(struct Superblock *sb, const char *oldDirName, const char *newDirName);
-void findFile(struct Superblock *sb, const char *fileName);
-void printCurrentDirectoryPath(const char *currentDir) ;
-void removeDirectory(struct Superblock *sb, const char *dirName);
-void removeFile(struct Superblock *sb, const char *dirName, const char *fileName) ;
+//Journal transaction header
+// Followed by numBlocks block numbers and then the numBlocks block images, in that order.
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence; // consecutive from the start of the journal
+    uint32_t numBlocks;
+    uint32_t fileBlocks; // length of the image or catalog when the transaction committed
+    uint64_t checksum; // of the block numbers and images
+};
 
+//Metadata journal of a mounted image or catalog
+// Operations change metadata blocks in the private mapping and mark them dirty here; a
+// commit writes the dirty blocks of a whole group of operations to the journal at once.
+struct Journal {
+    int fd;
+    uint64_t sequence; // of the next transaction
+    off_t size; // bytes written since the journal was last emptied
+    int numOps; // operations in the open group
+    struct timespec groupStart; // when the open group's first operation started
+    struct timespec dirtySince; // when the open group first changed a block
+    pthread_cond_t wake; // signalled with sb->catalogLock held: a group has opened, or stop
+    pthread_t committer; // commits a group nothing else has committed in time
+    int running; // the committer has been started and not joined yet
+    int stop;
+    uint64_t *dirtyMap; // one bit per metadata block changed by the open group
+    uint32_t *dirtyBlocks; // the same blocks, in the order they were first changed
+    uint32_t numDirty;
+    uint32_t capBlocks; // metadata blocks both arrays can describe
+};
 
-// Function definitions
+//Snapshot entry of the snapshot store header
+struct DiskSnapshot {
+    int64_t created; // seconds since the epoch
+    uint64_t sequence; // snapshots are numbered in the order they were taken
+    char name[MAX_FILE_NAME_LENGTH]; // empty for an unused entry
+    char reserved[6];
+};
 
-//CREATE A FILE
-void createFile(struct Superblock *sb, const char *dirName, const char *fileName) {
-    // Find the directory
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            // Check if there's space for a new file in this directory
-            if (sb->directories[i].numFiles < MAX_FILES) {
-                // Construct the full path
-                char fullPath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2]; // 2 for '/' and null terminator
-                snprintf(fullPath, sizeof(fullPath), "%s/%s", dirName, fileName);
-
-                // Open the file for writing
-                FILE *file = fopen(fullPath, "w");
-                if (file == NULL) {
-                    printf("Failed to create file '%s'.\n", fileName);
-                    return;
-                }
+//Snapshot store header (block 0 of "<image>.snapshots")
+// Followed by one block map per entry, each mapBlocks blocks long, and then the
+// preserved metadata blocks, one per slot.
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t metaBlocks; // the image's dataStart: entries in each block map
+    uint32_t reserved;
+    uint64_t nextSequence;
+    struct DiskSnapshot snapshots[MAX_SNAPSHOTS];
+};
 
-                // Close the file
-                fclose(file);
+_Static_assert(sizeof(struct SnapshotHeader) <= IMAGE_BLOCK_SIZE, "SnapshotHeader must fit in a block");
 
-                // Allocate memory for a new Inode instance
-                struct Inode *newFile = malloc(sizeof(struct Inode));
-                if (newFile == NULL) {
-                    printf("Memory allocation failed.\n");
-                    return;
-                }
+//Snapshots of a mounted image
+struct SnapshotStore {
+    int fd;
+    struct SnapshotHeader header;
+    uint32_t mapBlocks; // blocks each map takes in the file
+    uint32_t *maps[MAX_SNAPSHOTS]; // per metadata block: 1 + the slot of the snapshot's copy, 0 while the image still has it; NULL for an unused entry
+    int mapDirty[MAX_SNAPSHOTS]; // changed since it was last written to the file
+    uint32_t numSlots; // slots in the file
+    uint32_t *freeSlots; // slots below numSlots that no map refers to
+    uint32_t numFree;
+};
 
-                // Initialize the new Inode instance
-                strcpy(newFile->name, fileName);
-                newFile->size = 0;
-                newFile->isDirectory = false;
+//Mounted image
+struct Image {
+    int fd;
+    unsigned char *base; // the whole image: metadata mapped private, data mapped shared
+    size_t size;
+    struct DiskSuperblock *super;
+    struct DiskInode *inodes;
+    uint64_t *bitmap; // NULL for a catalog
+    uint32_t allocHint[IMAGE_SIZE_CLASSES]; // where the last allocation of each size class ended
+    uint32_t inodeHint; // where the search for a free inode starts
+    struct Journal *journal; // NULL while the image is being formatted
+    int compress; // files replaced whole (echo) are stored compressed
+    uint16_t *shares; // per block: extents referencing it besides the first, or NULL (older images)
+    struct DedupIndex *dedup; // NULL unless deduplication is on
+    char *snapshotPath; // "<image>.snapshots"
+    struct SnapshotStore *snapshots; // NULL until the image has had a snapshot
+    uint64_t *pinned; // per bitmap word: blocks kept for snapshots, or NULL while there are none
+    uint32_t *pinnedEpoch; // per bitmap word: the epoch its pinned bits were last brought up to
+    uint32_t epoch; // advanced by each new snapshot
+};
 
-                // Add the file to the directory
-                sb->directories[i].files[sb->directories[i].numFiles++] = newFile;
-                sb->totalFiles++;
+//Block fingerprint index
+// Every full data block written while deduplication is on is indexed by a fingerprint
+// of its contents. The per-block arrays are indexed by block number.
+struct DedupIndex {
+    uint32_t numBuckets; // a power of two
+    uint32_t *buckets; // fingerprint -> first indexed block with it (0 for none), chained through next
+    uint32_t *next;
+    uint64_t *prints; // fingerprint of each indexed block
+    uint64_t *indexed; // one bit per block, set while it is in the index
+};
 
-                printf("File '%s' created in directory '%s'.\n", fileName, dirName);
-                return;
-            } else {
-                printf("Directory '%s' is full.\n", dirName);
-            }
-            break;
-        }
-    }
-    printf("Directory '%s' not found.\n", dirName);
-}
+//Cached block of a host file
+struct CacheBlock {
+    uint32_t ino;
+    uint32_t index; // block number within the file
+    int dirty;
+    size_t len; // valid bytes in data
+    char path[HOST_PATH_LENGTH]; // host file a dirty block is written back to
+    struct CacheBlock *hashNext;
+    struct CacheBlock *lruPrev;
+    struct CacheBlock *lruNext;
+    unsigned char data[CACHE_BLOCK_SIZE];
+};
 
+//Buffer cache
+struct BufferCache {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signals the write-back thread
+    pthread_t writer;
+    int stop;
+    size_t numBlocks;
+    size_t maxBlocks; // memory budget in blocks
+    size_t numDirty;
+    struct CacheBlock *buckets[CACHE_HASH_BUCKETS];
+    struct CacheBlock *lruHead; // most recently used
+    struct CacheBlock *lruTail; // next to evict
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+};
 
+//Batched host I/O request
+struct IoRequest {
+    int op; // IO_UNLINK, IO_RMDIR, IO_COPY or IO_PREFETCH
+    char path[HOST_PATH_LENGTH];
+    char destPath[HOST_PATH_LENGTH]; // IO_COPY
+    struct Inode *inode; // the file the request is for (the source of a copy)
+    uint32_t destIno; // IO_COPY
+    int stage; // io_uring: a prefetch opens the file, advises the kernel, then closes it
+    int fd;
+    long result; // -1 on failure; bytes copied for IO_COPY, otherwise 0
+};
 
-//CREATE A DIRECTORY
-void makeDirectory(struct Superblock *sb, const char *dirName) {
-  
-        struct Directory newDir;
-        strcpy(newDir.name, dirName);
-        newDir.numFiles = 0;
-        sb->directories[sb->totalFiles++] = newDir;
-
-        // Create the directory
-        if (mkdir(dirName, 0777) == 0) { // 0777 gives full permissions, adjust as needed
-            printf("Directory '%s' created.\n", dirName);
-        } else {
-            printf("Failed to create directory '%s'.\n", dirName);
-        }
-    
-}
+//io_uring instance
+struct IoRing {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+};
 
-//WRITE CONTENT ONTO A FILE
-void echo(struct Superblock *sb, const char *dirName, const char *fileName, const char *content) {
-    // Find the directory
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            // Search for the file in the directory
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                if (strcmp(sb->directories[i].files[j]->name, fileName) == 0) {
-                    // Construct the full path to the file
-                    char fullPath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2]; // 2 for '/' and null terminator
-                    snprintf(fullPath, sizeof(fullPath), "%s/%s", dirName, fileName);
-
-                    // Open the file for writing
-                    FILE *file = fopen(fullPath, "w");
-                    if (file == NULL) {
-                        printf("Failed to open file '%s' in directory '%s'.\n", fileName, dirName);
-                        return;
-                    }
+//Counters of one operation
+struct OpCounters {
+    uint64_t calls;
+    uint64_t errors; // calls that failed
+    uint64_t bytes; // read or written by the successful calls
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+    uint64_t histogram[STATS_BUCKETS]; // latencies in nanoseconds
+};
 
-                    // Write content to the file
-                    fprintf(file, "%s", content);
+//Operation statistics
+struct FsStats {
+    struct OpCounters ops[STATS_NUM_OPS];
+};
 
-                    // Close the file
-                    fclose(file);
+//Operation trace being recorded
+struct Tracer {
+    pthread_mutex_t lock; // everything below, and writes to `file`
+    FILE *file; // NULL while no trace is being recorded
+    char *buffer; // the file's stdio buffer
+    uint64_t startNanos; // monotonic time the trace started
+    uint64_t lastNanos; // start of the previous record, relative to startNanos
+    uint64_t records;
+    const void **callers; // sessions, or threads without one; a caller's number is its position + 1
+    uint32_t numCallers;
+    uint32_t capCallers;
+};
 
-                    printf("Content written to file '%s' in directory '%s'.\n", fileName, dirName);
-                    return;
-                }
-            }
-            // File not found in the directory
-            printf("File '%s' not found in directory '%s'.\n", fileName, dirName);
-            return;
-        }
-    }
-    // Directory not found
-    printf("Directory '%s' not found.\n", dirName);
+//Trace file header
+struct TraceHeader {
+    char magic[8]; // TRACE_MAGIC
+    uint32_t version;
+    uint32_t reserved;
+    int64_t started; // wall clock, seconds since the epoch
+};
+
+//Arguments of the call being made on this thread, written out by statsDone
+struct TraceCall {
+    int op; // FS_OP_*
+    int numNumbers;
+    int64_t numbers[FS_TRACE_MAX_NUMBERS];
+    int numStrings;
+    const char *strings[3];
+    const char *const *names; // more strings after `strings`: the file list of a bulk call
+    int numNames;
+    char kept[MAX_FILE_NAME_LENGTH]; // copy of an argument the call itself changes
+};
+
+//Operation trace being read back
+struct FsTrace {
+    FILE *file;
+    uint64_t time; // start of the last record read
+    int capStrings;
+    char **buffers; // record strings, reused from one record to the next
+    size_t *capacities;
+    char **strings; // the last record's strings: buffers, or NULL where the call had NULL
+};
+
+//Inode slab
+struct InodeSlab {
+    struct InodeSlab *next; // older, smaller slab
+    int capacity;
+    int used; // inodes handed out so far
+    struct Inode inodes[];
+};
+
+//Background reclaimer
+struct Reclaimer {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running; // the thread has been started and not joined yet
+    int stop;
+    int pending; // work was queued since the thread last looked for it
+    int trash; // HOST_TRASH_DIR may hold something
+    struct Directory *detached; // removed trees still in memory, linked through nextSibling
+};
+
+
+// Sessions
+//
+// The server runs each client's commands on a worker thread with the client's session
+// attached, so messages and file contents reach that client and its relative paths start
+// at its own current directory. Threads without a session use standard output and sb->cwd.
+
+static __thread struct FsSession *currentSession;
+
+// Where messages and file contents go on this thread
+static FILE *output(void) {
+    return currentSession != NULL ? currentSession->out : stdout;
 }
 
-//READ A FILE'S CONTENTS
-void readFile(struct Superblock *sb, const char *dirName, const char *fileName) {
-    // Find the directory
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            // Check if the file exists in the directory
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                if (strcmp(sb->directories[i].files[j]->name, fileName) == 0) {
-                    // Construct the full file path
-                    char filePath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2]; // +2 for '/' and '\0'
-                    snprintf(filePath, sizeof(filePath), "%s/%s", dirName, fileName);
-
-                    // Open the file for reading
-                    FILE *file = fopen(filePath, "r");
-                    if (file == NULL) {
-                        printf("Failed to open file '%s'.\n", fileName);
-                        return;
-                    }
 
-                    // Read content from the file
-                    char content[MAX_FILE_CONTENT_LENGTH];
-                    while (fgets(content, MAX_FILE_CONTENT_LENGTH, file) != NULL) {
-                        printf("%s", content);
-                    }
+// Operation statistics
+//
+// While statistics are enabled, every public operation records its latency, whether it
+// failed and how many bytes it moved. A bulk call (removeFiles, copyFiles) counts once.
+// The counters are updated with relaxed atomics, so sessions never wait for each other;
+// while statistics are disabled an operation only tests sb->statsEnabled on entry.
 
-                    // Close the file
-                    fclose(file);
-                    return;
-                }
-            }
-            printf("File '%s' not found in directory '%s'.\n", fileName, dirName);
-            return;
-        }
+static const char *statsNames[STATS_NUM_OPS] = {
+    "createFile", "makeDirectory", "echo", "readFile", "prefetchFiles", "listFiles",
+    "changeDirectory", "copyFiles", "renameFile", "renameDirectory", "findFile",
+    "removeFiles", "removeDirectory", "fsOpen", "fsRead", "fsWrite", "fsTruncate",
+    "fsClose", "fsSync", "fsListDirectory", "fsSeek"
+};
+
+static uint64_t monotonicNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Start timing an operation; 0 means neither statistics nor a trace are being kept
+static uint64_t statsStart(struct Superblock *sb) {
+    if (!__atomic_load_n(&sb->statsEnabled, __ATOMIC_ACQUIRE) && !__atomic_load_n(&sb->tracing, __ATOMIC_ACQUIRE)) {
+        return 0;
     }
-    printf("Directory '%s' not found.\n", dirName);
+    return monotonicNanos();
 }
 
-//LIST FILES IN A DIRECTORY
-void listFiles(struct Superblock *sb, const char *dirName) {
-    printf("Attempting to list files in directory '%s'\n", dirName);
-    for (int i = 0; i < sb->totalFiles; i++) {
-        printf("Checking directory '%s'\n", sb->directories[i].name);
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            printf("Directory '%s' found\n", dirName);
-            printf("Files in directory '%s':\n", dirName);
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                printf("- %s\n", sb->directories[i].files[j]->name);
-            }
-            return;
-        }
+// Values below STATS_SUB_BUCKETS have a bucket each; above that, every power of two is
+// split into STATS_SUB_BUCKETS equal parts
+static int statsBucket(uint64_t nanos) {
+    if (nanos < STATS_SUB_BUCKETS) {
+        return (int)nanos;
     }
-    printf("Directory '%s' not found.\n", dirName);
+    int msb = 63 - __builtin_clzll(nanos);
+    return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) | (int)((nanos >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
 }
 
-//CHANGE DIRECTORY
-void changeDirectory(struct Superblock *sb, const char *dirName) {
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            // Update the current directory path
-            strcpy(sb->currentDirectory, dirName);
-            printf("Changed directory to '%s'\n", dirName);
-            return;
-        }
+// Smallest and largest value that land in bucket `b`
+static uint64_t statsBucketLow(int b) {
+    int group = b >> STATS_SUB_BITS;
+    uint64_t sub = (uint64_t)(b & (STATS_SUB_BUCKETS - 1));
+    return group == 0 ? sub : (STATS_SUB_BUCKETS + sub) << (group - 1);
+}
+
+static uint64_t statsBucketHigh(int b) {
+    int group = b >> STATS_SUB_BITS;
+    return statsBucketLow(b) + (group == 0 ? 0 : ((uint64_t)1 << (group - 1)) - 1);
+}
+
+// Operation traces
+//
+// While a trace is being recorded, statsDone also appends a record of each call to it: the
+// operation, its arguments, when it started, how long it took and what it returned. Every
+// public operation names itself and its arguments with traceBegin (plus traceNumber and
+// traceNames) as it starts; that only fills in a per-thread TraceCall, so it costs a few
+// stores when nothing is being recorded. Records are written in the order calls finish,
+// under the tracer's lock, with their start times as differences from the previous one.
+
+static __thread struct TraceCall traceCall;
+static __thread const struct Tracer *traceCallerTracer; // the trace this thread last recorded to...
+static __thread const void *traceCaller; // ...the caller it recorded for...
+static __thread uint32_t traceCallerNumber; // ...and that caller's number
+
+// Strings after the last one given are left out; a NULL before it is kept as such
+static void traceBegin(int op, const char *first, const char *second, const char *third) {
+    traceCall.op = op;
+    traceCall.numNumbers = 0;
+    traceCall.strings[0] = first;
+    traceCall.strings[1] = second;
+    traceCall.strings[2] = third;
+    traceCall.numStrings = third != NULL ? 3 : second != NULL ? 2 : first != NULL ? 1 : 0;
+    traceCall.names = NULL;
+    traceCall.numNames = 0;
+}
+
+// A copy of `string` taken now, for an argument the call overwrites before it finishes
+static const char *traceKeep(const char *string) {
+    snprintf(traceCall.kept, sizeof(traceCall.kept), "%s", string);
+    return traceCall.kept;
+}
+
+static void traceNumber(int64_t value) {
+    if (traceCall.numNumbers < FS_TRACE_MAX_NUMBERS) {
+        traceCall.numbers[traceCall.numNumbers++] = value;
     }
-    printf("Directory '%s' not found.\n", dirName);
 }
 
-//COPY FILE & ITS CONTENTS FROM ONE DIRECTORY TO ANOTHER
-void copyFile(struct Superblock *sb, const char *srcDir, const char *destDir, const char *fileName) {
-    struct Inode *srcFile = NULL;
-    int fileFound = false;
+static void traceNames(const char *const *names, int count) {
+    traceCall.names = names;
+    traceCall.numNames = count > 0 ? count : 0;
+}
 
-    // Find the source file
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, srcDir) == 0) {
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                if (strcmp(sb->directories[i].files[j]->name, fileName) == 0) {
-                    srcFile = sb->directories[i].files[j];
-                    fileFound = true;
-                    break;
-                }
-            }
-            if (fileFound) break;
-        }
+static void traceVarint(FILE *file, uint64_t value) {
+    while (value >= 0x80) {
+        putc_unlocked((int)(value & 0x7F) | 0x80, file);
+        value >>= 7;
     }
+    putc_unlocked((int)value, file);
+}
+
+// Signed values are zigzag encoded so small negative numbers stay short
+static void traceSigned(FILE *file, int64_t value) {
+    traceVarint(file, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
 
-    if (!fileFound) {
-        printf("File '%s' not found in directory '%s'.\n", fileName, srcDir);
+// A string is its length plus one, then its bytes; NULL is written as a bare 0
+static void traceString(FILE *file, const char *string) {
+    if (string == NULL) {
+        traceVarint(file, 0);
         return;
     }
+    size_t length = strlen(string);
+    traceVarint(file, length + 1);
+    fwrite(string, 1, length, file);
+}
 
-    // Check if the destination directory exists
-    int destDirIndex = -1;
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, destDir) == 0) {
-            destDirIndex = i;
-            break;
+// Number the caller of the operation on this thread: its session when one is attached (a
+// server client, whichever worker runs its commands), otherwise the thread itself. The
+// tracer's lock must be held. Returns 0 when there is no memory to add a new caller.
+static uint32_t traceCallerOf(struct Tracer *tracer) {
+    const void *caller = currentSession != NULL ? (const void *)currentSession : (const void *)&traceCall;
+    if (caller == traceCaller && tracer == traceCallerTracer) {
+        return traceCallerNumber;
+    }
+    uint32_t number = 0;
+    for (uint32_t k = 0; k < tracer->numCallers && number == 0; k++) {
+        number = tracer->callers[k] == caller ? k + 1 : 0;
+    }
+    if (number == 0) {
+        if (tracer->numCallers == tracer->capCallers) {
+            uint32_t cap = tracer->capCallers ? tracer->capCallers * 2 : 16;
+            const void **grown = realloc(tracer->callers, cap * sizeof(const void *));
+            if (grown == NULL) {
+                return 0;
+            }
+            tracer->callers = grown;
+            tracer->capCallers = cap;
         }
+        tracer->callers[tracer->numCallers++] = caller;
+        number = tracer->numCallers;
     }
+    traceCallerTracer = tracer;
+    traceCaller = caller;
+    traceCallerNumber = number;
+    return number;
+}
 
-    if (destDirIndex == -1) {
-        printf("Directory '%s' not found.\n", destDir);
+// Append the call on this thread to the trace. Calls that began before the trace did are
+// left out.
+static void traceRecord(struct Superblock *sb, uint64_t start, uint64_t nanos, long status) {
+    struct Tracer *tracer = __atomic_load_n(&sb->tracer, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&tracer->lock);
+    FILE *file = tracer->file;
+    if (file == NULL || start < tracer->startNanos) {
+        pthread_mutex_unlock(&tracer->lock);
         return;
     }
-
-    // Open the source file for reading
-    char srcFilePath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2];  // 1 for '/' and 1 for null terminator
-    snprintf(srcFilePath, sizeof(srcFilePath), "%s/%s", srcDir, fileName);
-    FILE *srcFilePtr = fopen(srcFilePath, "r");
-    if (srcFilePtr == NULL) {
-        printf("Failed to open source file '%s' in directory '%s'.\n", fileName, srcDir);
-        return;
+    uint64_t time = start - tracer->startNanos;
+    putc_unlocked(traceCall.op, file);
+    traceVarint(file, traceCallerOf(tracer));
+    traceSigned(file, (int64_t)(time - tracer->lastNanos));
+    traceVarint(file, nanos);
+    traceSigned(file, status);
+    traceVarint(file, (uint64_t)traceCall.numNumbers);
+    for (int k = 0; k < traceCall.numNumbers; k++) {
+        traceSigned(file, traceCall.numbers[k]);
     }
+    traceVarint(file, (uint64_t)(traceCall.numStrings + traceCall.numNames));
+    for (int k = 0; k < traceCall.numStrings; k++) {
+        traceString(file, traceCall.strings[k]);
+    }
+    for (int k = 0; k < traceCall.numNames; k++) {
+        traceString(file, traceCall.names[k]);
+    }
+    tracer->lastNanos = time;
+    tracer->records++;
+    pthread_mutex_unlock(&tracer->lock);
+}
 
-    // Open the destination file for writing
-    char destFilePath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2];  // 1 for '/' and 1 for null terminator
-    snprintf(destFilePath, sizeof(destFilePath), "%s/%s", destDir, fileName);
-    FILE *destFilePtr = fopen(destFilePath, "w");
-    if (destFilePtr == NULL) {
-        printf("Failed to create file '%s' in directory '%s'.\n", fileName, destDir);
-        fclose(srcFilePtr); // Close the source file
-        return;
+// Finish an operation begun with statsStart. Returns `status`, so a public call can end
+// with `return statsDone(...)`; a negative status counts as an error.
+static long statsDone(struct Superblock *sb, int op, uint64_t start, long status, uint64_t bytes) {
+    if (start == 0) {
+        return status;
     }
+    uint64_t nanos = monotonicNanos() - start;
+    if (__atomic_load_n(&sb->tracing, __ATOMIC_ACQUIRE)) {
+        traceRecord(sb, start, nanos, status);
+    }
+    if (!__atomic_load_n(&sb->statsEnabled, __ATOMIC_ACQUIRE)) {
+        return status;
+    }
+    struct OpCounters *counters = &__atomic_load_n(&sb->stats, __ATOMIC_ACQUIRE)->ops[op];
+    __atomic_fetch_add(&counters->calls, 1, __ATOMIC_RELAXED);
+    if (status < 0) {
+        __atomic_fetch_add(&counters->errors, 1, __ATOMIC_RELAXED);
+    } else if (bytes > 0) {
+        __atomic_fetch_add(&counters->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&counters->totalNanos, nanos, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->histogram[statsBucket(nanos)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&counters->maxNanos, __ATOMIC_RELAXED);
+    while (nanos > max && !__atomic_compare_exchange_n(&counters->maxNanos, &max, nanos, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return status;
+}
 
-    // Copy contents from source file to destination file
-    int ch;
-    while ((ch = fgetc(srcFilePtr)) != EOF) {
-        fputc(ch, destFilePtr);
+// Copy one operation's counters; they may still be changing, so each is read atomically
+static void statsSnapshot(struct Superblock *sb, int op, struct OpCounters *copy) {
+    struct OpCounters *counters = &__atomic_load_n(&sb->stats, __ATOMIC_ACQUIRE)->ops[op];
+    copy->calls = __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+    copy->errors = __atomic_load_n(&counters->errors, __ATOMIC_RELAXED);
+    copy->bytes = __atomic_load_n(&counters->bytes, __ATOMIC_RELAXED);
+    copy->totalNanos = __atomic_load_n(&counters->totalNanos, __ATOMIC_RELAXED);
+    copy->maxNanos = __atomic_load_n(&counters->maxNanos, __ATOMIC_RELAXED);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        copy->histogram[b] = __atomic_load_n(&counters->histogram[b], __ATOMIC_RELAXED);
     }
+}
 
-    // Close the files
-    fclose(srcFilePtr);
-    fclose(destFilePtr);
+// Latency below which `fraction` of the calls finished, rounded up to its bucket's end
+static uint64_t statsPercentile(const struct OpCounters *counters, double fraction) {
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        total += counters->histogram[b];
+    }
+    uint64_t rank = (uint64_t)(fraction * (double)total + 0.5), seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += counters->histogram[b];
+        if (seen >= rank) {
+            uint64_t high = statsBucketHigh(b);
+            return high < counters->maxNanos ? high : counters->maxNanos;
+        }
+    }
+    return counters->maxNanos;
+}
 
-    // Update the directory structure in the superblock
-    sb->directories[destDirIndex].files[sb->directories[destDirIndex].numFiles++] = srcFile;
 
-    printf("File '%s' copied from directory '%s' to directory '%s'.\n", fileName, srcDir, destDir);
-}
+// Hash index helpers
 
-// RENAME A FILE
-void renameFile(struct Superblock *sb, const char *dirName, const char *oldFileName, const char *newFileName) {
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                if (strcmp(sb->directories[i].files[j]->name, oldFileName) == 0) {
-                    // Rename the file on disk
-                    char oldPath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2]; // 2 for '/' and null terminator
-                    char newPath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2];
-                    snprintf(oldPath, sizeof(oldPath), "%s/%s", dirName, oldFileName);
-                    snprintf(newPath, sizeof(newPath), "%s/%s", dirName, newFileName);
-
-                    if (rename(oldPath, newPath) != 0) {
-                        printf("Failed to rename file '%s' to '%s' on disk.\n", oldFileName, newFileName);
-                        return;
-                    }
+// Returns the name stored at position `pos` of the indexed array
+typedef const char *(*NameAt)(const void *owner, int pos);
 
-                    // Update the file's name in metadata
-                    strcpy(sb->directories[i].files[j]->name, newFileName);
+//HASH A NAME (FNV-1a)
+static unsigned int hashName(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-                    printf("File '%s' renamed to '%s' in directory '%s'.\n", oldFileName, newFileName, dirName);
-                    return;
-                }
-            }
-            printf("File '%s' not found in directory '%s'.\n", oldFileName, dirName);
-            return;
-        }
+// Smallest table size that keeps `entries` at most half full
+static int nameIndexSizeFor(int entries) {
+    int size = NAME_INDEX_MIN_SIZE;
+    while (size < entries * 2) {
+        size *= 2;
     }
-    printf("Directory '%s' not found.\n", dirName);
+    return size;
 }
 
-//FIND A FILE
-void findFile(struct Superblock *sb, const char *fileName) {
-    int found = false;
-    for (int i = 0; i < sb->totalFiles; i++) {
-        for (int j = 0; j < sb->directories[i].numFiles; j++) {
-            if (strcmp(sb->directories[i].files[j]->name, fileName) == 0) {
-                printf("File '%s' found in directory '%s'.\n", fileName, sb->directories[i].name);
-                found = true;
-            }
+// Empty the index, resizing it to `size` slots. Returns -1, leaving the index as it
+// was, when the memory for a larger table cannot be had.
+static int nameIndexReset(struct NameIndex *index, int size) {
+    if (size != index->size) {
+        int *slots = realloc(index->slots, size * sizeof(int));
+        if (slots == NULL) {
+            return -1;
         }
+        index->slots = slots;
+        index->size = size;
     }
-    if (!found) {
-        printf("File '%s' not found.\n", fileName);
+    for (int s = 0; s < size; s++) {
+        index->slots[s] = HASH_EMPTY;
     }
+    index->used = 0;
+    index->tombstones = 0;
+    return 0;
 }
 
-//PRINT LATEST DIRECTORY ACCESSED
-void printCurrentDirectoryPath(const char *currentDir) {
-    printf("Current directory path: %s\n", currentDir);
+// Returns the position stored for `name`, or -1 if it is not indexed. `hashes` holds the
+// hash of the name at each position, so only a slot whose hash agrees costs a comparison.
+static int nameIndexLookup(const struct NameIndex *index, const char *name, const uint32_t *hashes, NameAt nameAt, const void *owner) {
+    unsigned int hash = hashName(name);
+    unsigned int mask = index->size - 1;
+    unsigned int s = hash & mask;
+    for (int probes = 0; probes < index->size; probes++, s = (s + 1) & mask) {
+        int pos = index->slots[s];
+        if (pos == HASH_EMPTY) {
+            return -1;
+        }
+        if (pos != HASH_DELETED && hashes[pos] == hash && strcmp(nameAt(owner, pos), name) == 0) {
+            return pos;
+        }
+    }
+    return -1;
 }
 
-//REMOVE A DIRECTORY
-void removeDirectory(struct Superblock *sb, const char *dirName) {
-    // Find the directory
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            // Remove all files in the directory
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                char filePath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2]; // +2 for '/' and '\0'
-                snprintf(filePath, sizeof(filePath), "%s/%s", dirName, sb->directories[i].files[j]->name);
-                if (remove(filePath) != 0) {
-                    printf("Failed to remove file '%s' from directory '%s'.\n", sb->directories[i].files[j]->name, dirName);
-                    return;
-                }
-                free(sb->directories[i].files[j]); // Free the memory allocated for the file
-            }
-            sb->directories[i].numFiles = 0; // Reset the number of files in the directory
-
-            // Remove the directory from the Superblock
-            for (int k = i; k < sb->totalFiles - 1; k++) {
-                sb->directories[k] = sb->directories[k + 1];
-            }
-            sb->totalFiles--;
-
-            // Delete the directory itself from the file system
-            if (remove(dirName) != 0) {
-                printf("Failed to remove directory '%s'.\n", dirName);
-                return;
-            }
+static void nameIndexInsert(struct NameIndex *index, unsigned int hash, int pos) {
+    unsigned int mask = index->size - 1;
+    unsigned int s = hash & mask;
+    while (index->slots[s] >= 0) {
+        s = (s + 1) & mask;
+    }
+    if (index->slots[s] == HASH_DELETED) {
+        index->tombstones--;
+    }
+    index->slots[s] = pos;
+    index->used++;
+}
 
-            printf("Directory '%s' removed.\n", dirName);
+static void nameIndexRemove(struct NameIndex *index, unsigned int hash, int pos) {
+    unsigned int mask = index->size - 1;
+    unsigned int s = hash & mask;
+    for (int probes = 0; probes < index->size; probes++, s = (s + 1) & mask) {
+        if (index->slots[s] == HASH_EMPTY) {
+            return;
+        }
+        if (index->slots[s] == pos) {
+            index->slots[s] = HASH_DELETED;
+            index->tombstones++;
+            index->used--;
             return;
         }
     }
-    printf("Directory '%s' not found.\n", dirName);
 }
 
-//REMOVE A FILE
-void removeFile(struct Superblock *sb, const char *dirName, const char *fileName) {
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, dirName) == 0) {
-            for (int j = 0; j < sb->directories[i].numFiles; j++) {
-                if (strcmp(sb->directories[i].files[j]->name, fileName) == 0) {
-                    // Remove the file from the directory by shifting elements
-                    free(sb->directories[i].files[j]);
-                    for (int k = j; k < sb->directories[i].numFiles - 1; k++) {
-                        sb->directories[i].files[k] = sb->directories[i].files[k + 1];
-                    }
-                    sb->directories[i].numFiles--;
-                    sb->totalFiles--;
-
-                    // Remove the file from the filesystem
-                    char filePath[MAX_DIR_NAME_LENGTH + MAX_FILE_NAME_LENGTH + 2]; // +2 for '/' and '\0'
-                    snprintf(filePath, sizeof(filePath), "%s/%s", dirName, fileName);
-                    if (remove(filePath) != 0) {
-                        printf("Failed to remove file '%s' from directory '%s'.\n", fileName, dirName);
-                        return;
-                    }
-
-                    printf("File '%s' removed from directory '%s'.\n", fileName, dirName);
-                    return;
-                }
-            }
-            printf("File '%s' not found in directory '%s'.\n", fileName, dirName);
+// Repoint the slot holding `pos` for a name with this hash to `newPos`
+static void nameIndexMove(struct NameIndex *index, unsigned int hash, int pos, int newPos) {
+    unsigned int mask = index->size - 1;
+    unsigned int s = hash & mask;
+    for (int probes = 0; probes < index->size; probes++, s = (s + 1) & mask) {
+        if (index->slots[s] == HASH_EMPTY) {
+            return;
+        }
+        if (index->slots[s] == pos) {
+            index->slots[s] = newPos;
             return;
         }
     }
-    printf("Directory '%s' not found.\n", dirName);
 }
 
-//RENAME A DIRECTORY
-void renameDirectory(struct Superblock *sb, const char *oldDirName, const char *newDirName) {
-    for (int i = 0; i < sb->totalFiles; i++) {
-        if (strcmp(sb->directories[i].name, oldDirName) == 0) {
-            // Rename the directory on disk
-            char oldPath[MAX_DIR_NAME_LENGTH + 1]; // 1 for null terminator
-            char newPath[MAX_DIR_NAME_LENGTH + 1];
-            snprintf(oldPath, sizeof(oldPath), "%s", oldDirName);
-            snprintf(newPath, sizeof(newPath), "%s", newDirName);
+// Re-insert `count` names, given by their hashes, into the index, growing it first when
+// they would fill more than half of it. If a larger table cannot be allocated the current
+// one is reused as long as everything still fits. Returns -1 when it does not.
+static int nameIndexRebuild(struct NameIndex *index, int count, const uint32_t *hashes) {
+    int size = nameIndexSizeFor(count);
+    if (size < index->size) {
+        size = index->size; // never shrink
+    }
+    if (nameIndexReset(index, size) != 0 && (count >= index->size || nameIndexReset(index, index->size) != 0)) {
+        return -1;
+    }
+    for (int pos = 0; pos < count; pos++) {
+        nameIndexInsert(index, hashes[pos], pos);
+    }
+    return 0;
+}
 
-            if (rename(oldPath, newPath) != 0) {
-                printf("Failed to rename directory '%s' to '%s' on disk.\n", oldDirName, newDirName);
-                return;
-            }
+// True when one more insert would leave the index over half full (tombstones included)
+static int nameIndexCrowded(const struct NameIndex *index) {
+    return (index->used + index->tombstones + 1) * 2 > index->size;
+}
 
-            // Update the directory name in metadata
-            strcpy(sb->directories[i].name, newDirName);
+// Name keys
+//
+// Beside files[], a directory keeps two arrays at the same positions: the hash of each
+// name and its key, the name's first 8 bytes packed into an integer with the first byte
+// on top and zeros past the end. Lookups, find and sorted listings stream through these
+// and visit an inode only for the entries still in the running. Keys order like the names
+// they come from: when two keys differ, the names differ the same way.
 
-            printf("Directory '%s' renamed to '%s'.\n", oldDirName, newDirName);
-            return;
+static uint64_t nameKey(const char *name) {
+    uint64_t key = 0;
+    for (int k = 0; k < 8; k++) {
+        key = key << 8 | (unsigned char)*name;
+        if (*name != '\0') {
+            name++;
         }
     }
-    printf("Directory '%s' not found.\n", oldDirName);
+    return key;
 }
 
-//MAIN PROGRAM
-int main() {
+// The key and mask of a glob pattern's literal start: a name can match only if its key
+// equals `want` wherever `mask` is set. Returns false when the pattern starts with a
+// wildcard and every name is a candidate.
+static int patternKey(const char *pattern, uint64_t *want, uint64_t *mask) {
+    char literal[9] = {0};
+    int k = 0;
+    while (k < 8 && pattern[k] != '\0' && strchr("*?[\\", pattern[k]) == NULL) {
+        literal[k] = pattern[k];
+        k++;
+    }
+    if (k == 0) {
+        return false;
+    }
+    // A short pattern without wildcards also fixes where the name ends
+    int bytes = pattern[k] == '\0' && k < 8 ? k + 1 : k;
+    *mask = bytes == 8 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> (8 * bytes));
+    *want = nameKey(literal) & *mask;
+    return true;
+}
 
-    //initialise superblock
-    struct Superblock sb;
-    sb.totalFiles = 0;
+// Bit k of the result is set when keys[k] & mask == want, for k from 0 to 3
+static unsigned int keyMatches4(const uint64_t *keys, uint64_t want, uint64_t mask) {
+#ifdef __SSE2__
+    __m128i wantv = _mm_set1_epi64x((long long)want), maskv = _mm_set1_epi64x((long long)mask);
+    __m128i low = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)keys), maskv), wantv);
+    __m128i high = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(keys + 2)), maskv), wantv);
+    unsigned int halves = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(low))
+                        | (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(high)) << 4;
+    // A key matches when both of its 32-bit halves do
+    halves &= halves >> 1;
+    return (halves & 1) | (halves >> 1 & 2) | (halves >> 2 & 4) | (halves >> 3 & 8);
+#else
+    unsigned int bits = 0;
+    for (int k = 0; k < 4; k++) {
+        bits |= (unsigned int)((keys[k] & mask) == want) << k;
+    }
+    return bits;
+#endif
+}
 
-    
-    printf("Initialization complete.\n");
+// Put `file` at files[pos], along with its hash and key
+static void placeFile(struct Directory *dir, int pos, struct Inode *file) {
+    dir->files[pos] = file;
+    dir->fileHashes[pos] = hashName(file->name);
+    dir->fileKeys[pos] = nameKey(file->name);
+}
 
-    while (true) {
-        printf("\n\nWaiting for user input...\n");
-        sleep(2);
-
-        //variables
-
-        int option;
-
-        char dirName[MAX_DIR_NAME_LENGTH], fileName[MAX_FILE_NAME_LENGTH], content[MAX_FILE_CONTENT_LENGTH];
-
-        char srcDir[MAX_DIR_NAME_LENGTH], destDir[MAX_DIR_NAME_LENGTH], oldFileName[MAX_FILE_NAME_LENGTH], newFileName[MAX_FILE_NAME_LENGTH];
-        printf("           _       _       _____ _ _      ____            _                 \n");
-        printf(" _ __ ___ (_)_ __ (_)     |  ___(_) | ___/ ___| _   _ ___| |_ ___ _ __ ___  \n");
-        printf("| '_ ` _ \\| | '_ \\| |_____| |_  | | |/ _ \\___ \\| | | / __| __/ _ \\ '_ ` _ \\ \n");
-        printf("| | | | | | | | | | |_____|  _| | | |  __/___) | |_| \\__ \\ | | __/ | | | | |\n");
-        printf("|_| |_| |_|_|_| |_|_|     |_|   |_|_|\\___|____/ \\__, |___/\\__\\___|_| |_| |_|\n");
-        printf("                                                |___/\n");
-
-        // Display the command list
-
-        printf("1. ls [Dir]...\t\t\tlist files under directories.\n");
-        printf("2. cd [Dir]\t\t\tchange to [Dir].\n");
-        printf("3. cp [file]...[Dir]\t\tcopy files to [Dir].\n");
-        printf("4. rm [file]...\t\t\tremove files.\n");
-        printf("5. rmdir [Dir]...\t\tremove directories.\n");
-        printf("6. touch [file]...\t\tcreate files.\n");
-        printf("7. mkdir [Dir]...\t\tcreate directories.\n");
-        printf("8. mv [file] [filename]\t\trename the file.\n");
-        printf("9. mvdir [Dir] [directoryname]\trename the directory.\n");
-        printf("10. cat [file]...\t\tread files.\n");
-        printf("11. pwd\t\t\t\tprint the current directory path.\n");
-        printf("12. echo [content] > [file]\twrite content to the file.\n");
-        printf("13. find [Dir] [file/Dir]\tfind specific file or directory.\n");
-        printf("0. Exit\n");
-       
-
-        printf("Enter your option: ");
-        scanf("%d", &option);
-
-        // Debugging print statement
-        printf("Option selected: %d\n", option);
-
-        switch (option) {
-            // Cases for different options
-            case 1:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                listFiles(&sb, dirName);
-                break;
+static const char *fileNameAt(const void *owner, int pos) {
+    return ((const struct Directory *)owner)->files[pos]->name;
+}
 
-            case 2:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                changeDirectory(&sb, dirName);
-                break;
+// Rebuild a directory's file index from scratch (after files[] has been shifted)
+static int rebuildFileIndex(struct Directory *dir) {
+    return nameIndexRebuild(&dir->fileIndex, dir->numFiles, dir->fileHashes);
+}
 
-            case 3:
-                printf("Enter source directory name: ");
-                scanf("%s", srcDir);
-                printf("Enter destination directory name: ");
-                scanf("%s", destDir);
-                printf("Enter file name: ");
-                scanf("%s", fileName);
-                copyFile(&sb, srcDir, destDir, fileName);
-                break;
+// Returns the position of the file in dir->files, or -1
+static int findFileInDirectory(struct Directory *dir, const char *fileName) {
+    return nameIndexLookup(&dir->fileIndex, fileName, dir->fileHashes, fileNameAt, dir);
+}
 
-            case 4:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                printf("Enter file name: ");
-                scanf("%s", fileName);
-                removeFile(&sb, dirName, fileName);
-                break;
+// Take files[pos] out of the directory and its index, moving the last file into its place
+static void detachFile(struct Directory *dir, int pos) {
+    int last = dir->numFiles - 1;
+    nameIndexRemove(&dir->fileIndex, dir->fileHashes[pos], pos);
+    if (pos != last) {
+        nameIndexMove(&dir->fileIndex, dir->fileHashes[last], last, pos);
+        dir->files[pos] = dir->files[last];
+        dir->fileHashes[pos] = dir->fileHashes[last];
+        dir->fileKeys[pos] = dir->fileKeys[last];
+    }
+    dir->numFiles--;
+}
 
-            case 5:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                removeDirectory(&sb, dirName);
-                break;
+// Add files[pos] to the directory's index, growing it (or clearing out tombstones) when
+// it gets crowded; files[0 .. numFiles) must already include the new entry
+static int indexFile(struct Directory *dir, int pos) {
+    if (nameIndexCrowded(&dir->fileIndex)) {
+        return rebuildFileIndex(dir);
+    }
+    nameIndexInsert(&dir->fileIndex, dir->fileHashes[pos], pos);
+    return 0;
+}
 
-            case 6:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                printf("Enter file name: ");
-                scanf("%s", fileName);
-                createFile(&sb, dirName, fileName);
-                break;
+// Dentry cache
+//
+// Every directory except the root is hashed by (parent, name), so each step of a path
+// walk is one bucket probe no matter how many directories there are. A second table of
+// the same size hashes them by name alone, for finds of an exact name.
 
-            case 7:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                makeDirectory(&sb, dirName);
-                break;
+static size_t dentryBucket(const struct Superblock *sb, const struct Directory *parent, const char *name) {
+    return (hashName(name) ^ (size_t)(uintptr_t)parent * 0x9E3779B1u) & (sb->numDentryBuckets - 1);
+}
 
-            case 8:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                printf("Enter old file name: ");
-                scanf("%s", oldFileName);
-                printf("Enter new file name: ");
-                scanf("%s", newFileName);
-                renameFile(&sb, dirName, oldFileName, newFileName);
-                break;
+// The subdirectory `name` of `parent`, or NULL
+static struct Directory *lookupDentry(struct Superblock *sb, struct Directory *parent, const char *name) {
+    if (sb->numDentryBuckets == 0) {
+        return NULL;
+    }
+    for (struct Directory *dir = sb->dentries[dentryBucket(sb, parent, name)]; dir != NULL; dir = dir->dentryNext) {
+        if (dir->parent == parent && strcmp(dir->name, name) == 0) {
+            return dir;
+        }
+    }
+    return NULL;
+}
 
-            case 9:
-                printf("Enter old directory name: ");
-                scanf("%s", dirName);
-                printf("Enter new directory name: ");
-                scanf("%s", newFileName);
-                renameDirectory(&sb, dirName, newFileName);
-                break;
+// Double the dentry cache (to at least DENTRY_BUCKETS_MIN) and rehash its chains
+static int growDentries(struct Superblock *sb) {
+    size_t oldBuckets = sb->numDentryBuckets;
+    struct Directory **old = sb->dentries, **oldNames = sb->dirNames;
+    size_t numBuckets = oldBuckets ? oldBuckets * 2 : DENTRY_BUCKETS_MIN;
+    struct Directory **buckets = calloc(numBuckets, sizeof(struct Directory *));
+    struct Directory **names = calloc(numBuckets, sizeof(struct Directory *));
+    if (buckets == NULL || names == NULL) {
+        free(buckets);
+        free(names);
+        return -1;
+    }
+    sb->dentries = buckets;
+    sb->dirNames = names;
+    sb->numDentryBuckets = numBuckets;
+    for (size_t b = 0; b < oldBuckets; b++) {
+        struct Directory *dir = old[b];
+        while (dir != NULL) {
+            struct Directory *next = dir->dentryNext;
+            size_t nb = dentryBucket(sb, dir->parent, dir->name);
+            dir->dentryNext = buckets[nb];
+            buckets[nb] = dir;
+            dir = next;
+        }
+        dir = oldNames[b];
+        while (dir != NULL) {
+            struct Directory *next = dir->nameNext;
+            size_t nb = hashName(dir->name) & (numBuckets - 1);
+            dir->nameNext = names[nb];
+            names[nb] = dir;
+            dir = next;
+        }
+    }
+    free(old);
+    free(oldNames);
+    return 0;
+}
 
-            case 10:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                printf("Enter file name: ");
-                scanf("%s", fileName);
-                readFile(&sb, dirName, fileName);
-                break;
-                
-            case 11:
-                
-                printCurrentDirectoryPath(dirName);
-                break;
+static int addDentry(struct Superblock *sb, struct Directory *dir) {
+    if ((size_t)sb->numDirs >= sb->numDentryBuckets && growDentries(sb) != 0 && sb->numDentryBuckets == 0) {
+        return -1;
+    }
+    size_t b = dentryBucket(sb, dir->parent, dir->name);
+    dir->dentryNext = sb->dentries[b];
+    sb->dentries[b] = dir;
+    b = hashName(dir->name) & (sb->numDentryBuckets - 1);
+    dir->nameNext = sb->dirNames[b];
+    sb->dirNames[b] = dir;
+    return 0;
+}
 
-            case 12:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                printf("Enter file name: ");
-                scanf("%s", fileName);
-                printf("Enter content: ");
-                scanf("%s", content);
-                echo(&sb, dirName, fileName, content);
-                break;
+// Must be called while dir->name is still the hashed name
+static void removeDentry(struct Superblock *sb, struct Directory *dir) {
+    struct Directory **link = &sb->dentries[dentryBucket(sb, dir->parent, dir->name)];
+    while (*link != NULL && *link != dir) {
+        link = &(*link)->dentryNext;
+    }
+    if (*link != NULL) {
+        *link = dir->dentryNext;
+    }
+    link = &sb->dirNames[hashName(dir->name) & (sb->numDentryBuckets - 1)];
+    while (*link != NULL && *link != dir) {
+        link = &(*link)->nameNext;
+    }
+    if (*link != NULL) {
+        *link = dir->nameNext;
+    }
+}
 
-            case 13:
-                printf("Enter directory name: ");
-                scanf("%s", dirName);
-                printf("Enter file/directory name: ");
-                scanf("%s", fileName);
-                findFile(&sb, fileName);
-                break;
+static int loadDirectory(struct Superblock *sb, struct Directory *dir);
 
-            case 0:
-                printf("Exiting...\n");
-                return 0;
+//RESOLVE A DIRECTORY PATH
+// `path` is absolute ("/a/b") or relative to the current directory ("b/c", "../d", "" or
+// "."), which is the attached session's when there is one. Returns the directory's
+// position in sb->directories, or -1. With `load` set, every directory on the way, and
+// the one found, is loaded from the catalog if it was not already; without it (when the
+// caller only holds sb->treeLock shared) meeting an unloaded one returns DIR_UNLOADED.
+static int findDirectory(struct Superblock *sb, const char *path, int load) {
+    struct Directory *dir = sb->directories[0];
+    char component[MAX_DIR_NAME_LENGTH];
 
-            default:
-                printf("Invalid option!\n");
-                break;
+    if (path[0] != '/') {
+        if (currentSession == NULL) {
+            dir = sb->cwd;
+        } else {
+            int cwd = findDirectory(sb, currentSession->cwd, load);
+            if (cwd < 0) {
+                return cwd;
+            }
+            dir = sb->directories[cwd];
+        }
+    }
+    while (*path != '\0') {
+        if (!dir->loaded && !load && sb->catalog != NULL) {
+            return DIR_UNLOADED;
+        }
+        if (loadDirectory(sb, dir) != 0) {
+            return -1;
+        }
+        while (*path == '/') {
+            path++;
+        }
+        size_t len = strcspn(path, "/");
+        if (len == 0) {
+            break;
+        }
+        if (len >= MAX_DIR_NAME_LENGTH) {
+            return -1;
+        }
+        memcpy(component, path, len);
+        component[len] = '\0';
+        path += len;
 
+        if (strcmp(component, "..") == 0) {
+            if (dir->parent != NULL) {
+                dir = dir->parent;
+            }
+        } else if (strcmp(component, ".") != 0) {
+            dir = lookupDentry(sb, dir, component);
+            if (dir == NULL) {
+                return -1;
+            }
         }
+    }
+    if (!dir->loaded && !load && sb->catalog != NULL) {
+        return DIR_UNLOADED;
+    }
+    return loadDirectory(sb, dir) == 0 ? dir->pos : -1;
+}
+
+// Write the directory's path relative to the root ("" for the root, "a/b" below it),
+// which is also where it lives under the host working directory
+static void directoryPath(const struct Directory *dir, char *out, size_t size) {
+    if (dir->parent == NULL) {
+        out[0] = '\0';
+        return;
+    }
+    directoryPath(dir->parent, out, size);
+    size_t len = strlen(out);
+    snprintf(out + len, size - len, "%s%s", len > 0 ? "/" : "", dir->name);
+}
 
+// Host path of `fileName` inside `dir`
+static void hostFilePath(const struct Directory *dir, const char *fileName, char *out, size_t size) {
+    directoryPath(dir, out, size);
+    size_t len = strlen(out);
+    snprintf(out + len, size - len, "%s%s", len > 0 ? "/" : "", fileName);
+}
+
+// A file or directory name: not empty, no '/', not "." or "..", and not the host trash
+static int validName(const char *name) {
+    return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0
+           && strcmp(name, HOST_TRASH_DIR) != 0;
+}
+
+// Refresh sb->currentDirectory after the current directory moved or was renamed
+static void updateCurrentDirectory(struct Superblock *sb) {
+    sb->currentDirectory[0] = '/';
+    directoryPath(sb->cwd, sb->currentDirectory + 1, sizeof(sb->currentDirectory) - 1);
+}
+
+// Double the global name index (to at least NAME_BUCKETS_MIN) and rehash its chains
+static int growNameBuckets(struct Superblock *sb) {
+    size_t numBuckets = sb->numNameBuckets ? sb->numNameBuckets * 2 : NAME_BUCKETS_MIN;
+    struct Inode **buckets = calloc(numBuckets, sizeof(struct Inode *));
+    if (buckets == NULL) {
+        return -1;
+    }
+    for (size_t b = 0; b < sb->numNameBuckets; b++) {
+        struct Inode *inode = sb->nameBuckets[b];
+        while (inode != NULL) {
+            struct Inode *next = inode->nameNext;
+            size_t nb = hashName(inode->name) & (numBuckets - 1);
+            inode->nameNext = buckets[nb];
+            buckets[nb] = inode;
+            inode = next;
+        }
     }
+    free(sb->nameBuckets);
+    sb->nameBuckets = buckets;
+    sb->numNameBuckets = numBuckets;
+    return 0;
+}
 
+// Add `inode` to the global name index, which grows to keep about one file per bucket
+static int addNameEntry(struct Superblock *sb, struct Inode *inode) {
+    if ((size_t)sb->totalFiles >= sb->numNameBuckets && growNameBuckets(sb) != 0 && sb->numNameBuckets == 0) {
+        return -1;
+    }
+    size_t b = hashName(inode->name) & (sb->numNameBuckets - 1);
+    inode->nameNext = sb->nameBuckets[b];
+    sb->nameBuckets[b] = inode;
     return 0;
 }
+
+// Drop `inode` from the global name index; must be called while inode->name is still the indexed name
+static void removeNameEntry(struct Superblock *sb, struct Inode *inode) {
+    struct Inode **link = &sb->nameBuckets[hashName(inode->name) & (sb->numNameBuckets - 1)];
+    while (*link != NULL) {
+        if (*link == inode) {
+            *link = inode->nameNext;
+            return;
+        }
+        link = &(*link)->nameNext;
+    }
+}
+
+// Inode slabs
+//
+// A directory's inodes are carved out of slabs it owns, so adding a file costs no malloc
+// and removing a directory frees its inodes a slab at a time. Each slab is twice the size
+// of the previous one (from INODE_SLAB_MIN up to INODE_SLAB_MAX inodes); removed files go
+// on the directory's free list, linked through nameNext.
+
+static struct Inode *allocInode(struct Directory *dir) {
+    struct Inode *inode = dir->freeInodes;
+    if (inode != NULL) {
+        dir->freeInodes = inode->nameNext;
+        return inode;
+    }
+    struct InodeSlab *slab = dir->slabs;
+    if (slab == NULL || slab->used == slab->capacity) {
+        int capacity = slab == NULL ? INODE_SLAB_MIN : slab->capacity * 2;
+        if (capacity > INODE_SLAB_MAX) {
+            capacity = INODE_SLAB_MAX;
+        }
+        struct InodeSlab *grown = malloc(sizeof(struct InodeSlab) + capacity * sizeof(struct Inode));
+        if (grown == NULL) {
+            return NULL;
+        }
+        grown->next = slab;
+        grown->capacity = capacity;
+        grown->used = 0;
+        dir->slabs = slab = grown;
+    }
+    return &slab->inodes[slab->used++];
+}
+
+static void freeInode(struct Directory *dir, struct Inode *inode) {
+    inode->nameNext = dir->freeInodes;
+    dir->freeInodes = inode;
+}
+
+// Release a directory along with every inode it holds
+static void freeDirectory(struct Directory *dir) {
+    while (dir->slabs != NULL) {
+        struct InodeSlab *next = dir->slabs->next;
+        free(dir->slabs);
+        dir->slabs = next;
+    }
+    free(dir->files);
+    free(dir->fileHashes);
+    free(dir->fileKeys);
+    free(dir->fileIndex.slots);
+    pthread_rwlock_destroy(&dir->lock);
+    free(dir);
+}
+
+// LZ codec
+//
+// A small LZ77 codec in the style of the LZ4 block format, used for compressed files in
+// an image. A stream is a series of sequences: a token byte holding the number of literals
+// (high nibble) and the match length minus LZ_MIN_MATCH (low nibble), where 15 means more
+// length bytes follow, each adding up to 255; the literals; and a two-byte little-endian
+// offset back to the match. The last sequence has literals only. Matches are found through
+// a hash of the next four bytes, so compressing takes one pass and decompressing is plain
+// copies.
+
+static uint32_t lzRead32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int lzHash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the part of a length that did not fit in its token nibble
+static unsigned char *lzPutLength(unsigned char *out, size_t len) {
+    while (len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = (unsigned char)len;
+    return out;
+}
+
+// Read the rest of a length whose nibble was 15. Returns -1 past the end of the stream.
+static int lzGetLength(const unsigned char **in, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*in >= end) {
+            return -1;
+        }
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Compress `len` bytes into at most `cap` bytes of dst. Returns the compressed length,
+// or 0 when it does not fit.
+static size_t lzCompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS]; // position + 1 of the last four bytes with each hash
+    memset(table, 0, sizeof(table));
+    unsigned char *out = dst, *end = dst + cap;
+    size_t anchor = 0, pos = 0; // literals waiting to be written start at anchor
+    size_t limit = len > LZ_LAST_LITERALS + LZ_MIN_MATCH ? len - LZ_LAST_LITERALS - LZ_MIN_MATCH : 0;
+
+    while (pos < limit) {
+        uint32_t v = lzRead32(src + pos);
+        unsigned int h = lzHash(v);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)pos + 1;
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET || lzRead32(src + candidate - 1) != v) {
+            pos += 1 + ((pos - anchor) >> 6); // skip faster through data that does not repeat
+            continue;
+        }
+        candidate--;
+        size_t matchEnd = pos + LZ_MIN_MATCH;
+        while (matchEnd < len - LZ_LAST_LITERALS && src[matchEnd] == src[candidate + matchEnd - pos]) {
+            matchEnd++;
+        }
+
+        size_t literals = pos - anchor, matchLen = matchEnd - pos - LZ_MIN_MATCH;
+        if ((size_t)(end - out) < 1 + literals / 255 + 1 + literals + 2 + matchLen / 255 + 1) {
+            return 0;
+        }
+        unsigned char *token = out++;
+        *token = (unsigned char)((literals < 15 ? literals : 15) << 4 | (matchLen < 15 ? matchLen : 15));
+        if (literals >= 15) {
+            out = lzPutLength(out, literals - 15);
+        }
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        size_t offset = pos - candidate;
+        *out++ = (unsigned char)(offset & 255);
+        *out++ = (unsigned char)(offset >> 8);
+        if (matchLen >= 15) {
+            out = lzPutLength(out, matchLen - 15);
+        }
+        pos = anchor = matchEnd;
+    }
+
+    size_t literals = len - anchor;
+    if ((size_t)(end - out) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *out++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        out = lzPutLength(out, literals - 15);
+    }
+    memcpy(out, src + anchor, literals);
+    out += literals;
+    return (size_t)(out - dst);
+}
+
+// Decompress a stream that must expand to exactly `len` bytes. Returns -1 if it is damaged.
+static int lzDecompress(const unsigned char *src, size_t srcLen, unsigned char *dst, size_t len) {
+    const unsigned char *in = src, *end = src + srcLen;
+    size_t out = 0;
+
+    while (in < end) {
+        unsigned int token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && lzGetLength(&in, end, &literals) != 0) {
+            return -1;
+        }
+        if (literals > (size_t)(end - in) || literals > len - out) {
+            return -1;
+        }
+        memcpy(dst + out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == end) {
+            break; // the last sequence has no match
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && lzGetLength(&in, end, &matchLen) != 0) {
+            return -1;
+        }
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || matchLen > len - out) {
+            return -1;
+        }
+        unsigned char *to = dst + out;
+        const unsigned char *from = to - offset;
+        if (offset >= matchLen) {
+            memcpy(to, from, matchLen);
+        } else {
+            // The match overlaps what it produces: it repeats every `offset` bytes, so each
+            // copy can take twice as much as the one before
+            size_t span = offset, copied = 0;
+            while (copied < matchLen) {
+                size_t n = span < matchLen - copied ? span : matchLen - copied;
+                memcpy(to + copied, to + copied - span, n);
+                copied += n;
+                span += n;
+            }
+        }
+        out += matchLen;
+    }
+    return out == len ? 0 : -1;
+}
+
+
+// Disk image backend
+//
+// Image layout, in IMAGE_BLOCK_SIZE blocks:
+//   block 0                   struct DiskSuperblock
+//   inodeTableStart ...       struct DiskInode[numInodes] (inode 0 is the root)
+//   bitmapStart ...           one bit per block, set when the block is in use
+//   dataStart ... numBlocks   file data and extent overflow blocks
+// The whole image is mapped, so reads and writes are plain memory accesses. Blocks below
+// dataStart are mapped MAP_PRIVATE and reach the file only through the metadata journal;
+// every change to them must be reported with imageDirty. The data region is MAP_SHARED.
+//
+// A file's data is a list of extents (runs of contiguous blocks) in file order. The
+// allocator scans the bitmap a 64-bit word at a time and tries, in order, to grow the
+// file's last extent in place, to find one free run big enough for the whole request
+// near the previous allocation of the same size class, and only then splits it.
+//
+// Compressed files (IMAGE_INODE_COMPRESSED) are written whole by imageWriteCompressed as
+// independent IMAGE_COMPRESS_CHUNK-byte chunks, so a read decompresses only the chunks it
+// touches. Their blocks start with a table holding, for each chunk, the offset just past
+// its stored bytes (counted from the end of the table, with IMAGE_CHUNK_RAW set when the
+// chunk did not shrink), and the chunks follow. The inode's size is the uncompressed size.
+// Changing such a file in place first expands it back to plain blocks.
+
+static void *imageBlock(struct Image *img, uint32_t block) {
+    return img->base + (size_t)block * IMAGE_BLOCK_SIZE;
+}
+
+// Record that the metadata bytes [addr, addr + len) changed in the open journal group
+static void imageDirty(struct Image *img, const void *addr, size_t len) {
+    struct Journal *journal = img->journal;
+    if (journal == NULL) {
+        return;
+    }
+    size_t offset = (size_t)((const unsigned char *)addr - img->base);
+    uint32_t last = (uint32_t)((offset + len - 1) / IMAGE_BLOCK_SIZE);
+    for (uint32_t block = (uint32_t)(offset / IMAGE_BLOCK_SIZE); block <= last && block < journal->capBlocks; block++) {
+        uint64_t bit = 1ull << (block % 64);
+        if (!(journal->dirtyMap[block / 64] & bit)) {
+            if (journal->numDirty == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &journal->dirtySince);
+                pthread_cond_signal(&journal->wake);
+            }
+            journal->dirtyMap[block / 64] |= bit;
+            journal->dirtyBlocks[journal->numDirty++] = block;
+        }
+    }
+}
+
+static void imageDirtyInode(struct Image *img, uint32_t ino) {
+    imageDirty(img, &img->inodes[ino], sizeof(struct DiskInode));
+}
+
+static void imageDirtySuper(struct Image *img) {
+    imageDirty(img, img->super, sizeof(struct DiskSuperblock));
+}
+
+// Stamp the image with this build's format version before storing something older
+// builds would misread (a compressed or inline file)
+static void imageUpgrade(struct Image *img) {
+    if (img->super->version < IMAGE_VERSION) {
+        img->super->version = IMAGE_VERSION;
+        imageDirtySuper(img);
+    }
+}
+
+// Make the journal able to track `numBlocks` metadata blocks (a catalog about to grow)
+static int journalReserve(struct Journal *journal, uint32_t numBlocks) {
+    if (journal == NULL || numBlocks <= journal->capBlocks) {
+        return 0;
+    }
+    size_t oldWords = (journal->capBlocks + 63) / 64, words = (numBlocks + 63) / 64;
+    uint64_t *dirtyMap = realloc(journal->dirtyMap, words * sizeof(uint64_t));
+    if (dirtyMap == NULL) {
+        return -1;
+    }
+    memset(dirtyMap + oldWords, 0, (words - oldWords) * sizeof(uint64_t));
+    journal->dirtyMap = dirtyMap;
+    uint32_t *dirtyBlocks = realloc(journal->dirtyBlocks, numBlocks * sizeof(uint32_t));
+    if (dirtyBlocks == NULL) {
+        return -1;
+    }
+    journal->dirtyBlocks = dirtyBlocks;
+    journal->capBlocks = numBlocks;
+    return 0;
+}
+
+// Every block in use when a snapshot is taken stays allocated to it (see snapshots). A
+// new snapshot only advances img->epoch: a bitmap word adds its bits to img->pinned just
+// before it first changes after that, so the bitmap is never copied for a snapshot.
+static void imagePinWord(struct Image *img, uint32_t w) {
+    if (img->pinned != NULL && img->pinnedEpoch[w] != img->epoch) {
+        img->pinned[w] |= img->bitmap[w];
+        img->pinnedEpoch[w] = img->epoch;
+    }
+}
+
+// Whether a snapshot keeps `block`
+static int imagePinned(struct Image *img, uint32_t block) {
+    if (img->pinned == NULL) {
+        return false;
+    }
+    imagePinWord(img, block / 64);
+    return (img->pinned[block / 64] >> (block % 64)) & 1;
+}
+
+// Blocks of bitmap word `w` that cannot be handed out: in use, or kept by a snapshot. A
+// word not brought up to date still holds the bits a snapshot saw.
+static uint64_t imageTakenWord(struct Image *img, uint32_t w) {
+    return img->pinned != NULL ? img->bitmap[w] | img->pinned[w] : img->bitmap[w];
+}
+
+// Mark blocks [start, start + len) used or free, a word at a time
+static void imageMarkRun(struct Image *img, uint32_t start, uint32_t len, int used) {
+    uint32_t block = start, end = start + len;
+    while (block < end) {
+        uint32_t bit = block % 64;
+        uint32_t count = end - block < 64 - bit ? end - block : 64 - bit;
+        uint64_t mask = (count == 64 ? ~0ull : ((1ull << count) - 1)) << bit;
+        imagePinWord(img, block / 64);
+        if (used) {
+            img->bitmap[block / 64] |= mask;
+        } else {
+            img->bitmap[block / 64] &= ~mask;
+        }
+        imageDirty(img, &img->bitmap[block / 64], sizeof(uint64_t));
+        block += count;
+    }
+    imageDirtySuper(img);
+    if (used) {
+        img->super->freeBlocks -= len;
+    } else {
+        img->super->freeBlocks += len;
+    }
+}
+
+// First free block (not kept by a snapshot either) at or after `block`, or numBlocks if
+// there is none
+static uint32_t imageNextFree(struct Image *img, uint32_t block) {
+    uint32_t numBlocks = img->super->numBlocks;
+    if (block >= numBlocks) {
+        return numBlocks;
+    }
+    uint32_t w = block / 64;
+    uint64_t word = imageTakenWord(img, w) | ((1ull << (block % 64)) - 1); // blocks before `block` count as used
+    while (word == ~0ull) {
+        if (++w >= (numBlocks + 63) / 64) {
+            return numBlocks;
+        }
+        word = imageTakenWord(img, w);
+    }
+    uint32_t found = w * 64 + __builtin_ctzll(~word);
+    return found < numBlocks ? found : numBlocks;
+}
+
+// First used (or snapshot-kept) block at or after `block`, or numBlocks if there is none
+static uint32_t imageNextUsed(struct Image *img, uint32_t block) {
+    uint32_t numBlocks = img->super->numBlocks;
+    if (block >= numBlocks) {
+        return numBlocks;
+    }
+    uint32_t w = block / 64;
+    uint64_t word = imageTakenWord(img, w) & ~((1ull << (block % 64)) - 1);
+    while (word == 0) {
+        if (++w >= (numBlocks + 63) / 64) {
+            return numBlocks;
+        }
+        word = imageTakenWord(img, w);
+    }
+    uint32_t found = w * 64 + __builtin_ctzll(word);
+    return found < numBlocks ? found : numBlocks;
+}
+
+// Find a free run of `want` blocks, searching from `hint` to the end and then wrapping
+// to the start of the data region. When no run is long enough the longest one seen is
+// returned. *got receives the run length (0 when the image is full).
+static uint32_t imageFindFreeRun(struct Image *img, uint32_t hint, uint32_t want, uint32_t *got) {
+    uint32_t dataStart = img->super->dataStart, numBlocks = img->super->numBlocks;
+    uint32_t bestStart = 0, bestLen = 0;
+
+    if (hint < dataStart || hint >= numBlocks) {
+        hint = dataStart;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t block = pass == 0 ? hint : dataStart;
+        uint32_t limit = pass == 0 ? numBlocks : hint;
+        while (block < limit) {
+            uint32_t start = imageNextFree(img, block);
+            if (start >= limit) {
+                break;
+            }
+            uint32_t end = imageNextUsed(img, start);
+            if (end - start >= want) {
+                *got = want;
+                return start;
+            }
+            if (end - start > bestLen) {
+                bestStart = start;
+                bestLen = end - start;
+            }
+            block = end;
+        }
+    }
+    *got = bestLen;
+    return bestStart;
+}
+
+// Size class of a request, used to keep small and large allocations apart
+static int imageSizeClass(uint32_t blocks) {
+    if (blocks <= 1) {
+        return 0;
+    }
+    return blocks < 16 ? 1 : 2;
+}
+
+// Extent `k` of an inode (the first IMAGE_INODE_EXTENTS live in the inode itself)
+static struct DiskExtent *imageExtent(struct Image *img, struct DiskInode *inode, uint32_t k) {
+    if (k < IMAGE_INODE_EXTENTS) {
+        return &inode->extents[k];
+    }
+    return (struct DiskExtent *)imageBlock(img, inode->extentBlock) + (k - IMAGE_INODE_EXTENTS);
+}
+
+// Number of data blocks held by the inode
+static uint32_t imageAllocatedBlocks(struct Image *img, struct DiskInode *inode) {
+    uint32_t total = 0;
+    for (uint32_t k = 0; k < inode->numExtents; k++) {
+        total += imageExtent(img, inode, k)->length;
+    }
+    return total;
+}
+
+// Before the inode's extents past the first IMAGE_INODE_EXTENTS change: move them out of
+// an overflow block a snapshot keeps. Returns -1 when there is no block to move them to.
+static int imageOwnExtents(struct Image *img, struct DiskInode *inode) {
+    if (inode->extentBlock == 0 || !imagePinned(img, inode->extentBlock)) {
+        return 0;
+    }
+    uint32_t got;
+    uint32_t copy = imageFindFreeRun(img, inode->extentBlock, 1, &got);
+    if (got == 0) {
+        return -1;
+    }
+    imageMarkRun(img, copy, 1, true);
+    memcpy(imageBlock(img, copy), imageBlock(img, inode->extentBlock), IMAGE_BLOCK_SIZE);
+    imageMarkRun(img, inode->extentBlock, 1, false);
+    inode->extentBlock = copy;
+    imageDirty(img, inode, sizeof(*inode));
+    return 0;
+}
+
+// Grow the inode by `count` zeroed blocks. Returns the number actually added.
+static uint32_t imageAllocBlocks(struct Image *img, struct DiskInode *inode, uint32_t count) {
+    uint32_t added = 0;
+
+    if (imageOwnExtents(img, inode) != 0) {
+        return 0;
+    }
+
+    while (added < count) {
+        uint32_t want = count - added;
+        struct DiskExtent *last = inode->numExtents ? imageExtent(img, inode, inode->numExtents - 1) : NULL;
+        uint32_t start, got;
+
+        if (last != NULL && imageNextFree(img, last->start + last->length) == last->start + last->length
+                && last->start + last->length < img->super->numBlocks) {
+            // Grow the last extent in place
+            start = last->start + last->length;
+            got = imageNextUsed(img, start) - start;
+            if (got > want) {
+                got = want;
+            }
+            imageMarkRun(img, start, got, true);
+        } else {
+            int sizeClass = imageSizeClass(want);
+            uint32_t hint = last != NULL ? last->start + last->length : img->allocHint[sizeClass];
+            uint32_t k = inode->numExtents;
+            if (k >= IMAGE_INODE_EXTENTS + IMAGE_EXTENTS_PER_BLOCK) {
+                break; // no extent slot left
+            }
+            start = imageFindFreeRun(img, hint, want, &got);
+            if (got == 0) {
+                break; // image full
+            }
+            imageMarkRun(img, start, got, true);
+
+            // The overflow block for extents past the inode is allocated on first use
+            if (k == IMAGE_INODE_EXTENTS && inode->extentBlock == 0) {
+                uint32_t overflowLen;
+                uint32_t overflow = imageFindFreeRun(img, start + got, 1, &overflowLen);
+                if (overflowLen == 0) {
+                    imageMarkRun(img, start, got, false);
+                    break;
+                }
+                imageMarkRun(img, overflow, 1, true);
+                inode->extentBlock = overflow;
+            }
+            imageExtent(img, inode, k)->start = start;
+            imageExtent(img, inode, k)->length = 0;
+            inode->numExtents++;
+            last = imageExtent(img, inode, k);
+            img->allocHint[sizeClass] = start + got;
+        }
+
+        memset(imageBlock(img, start), 0, (size_t)got * IMAGE_BLOCK_SIZE);
+        last->length += got;
+        added += got;
+    }
+    imageDirty(img, inode, sizeof(*inode));
+    return added;
+}
+
+// Locate the byte at `pos`: returns a pointer into the mapping and, in *contiguous,
+// how many bytes follow it in the same extent. NULL past the allocated blocks.
+static unsigned char *imageLocate(struct Image *img, struct DiskInode *inode, uint64_t pos, size_t *contiguous) {
+    uint64_t index = pos / IMAGE_BLOCK_SIZE;
+    for (uint32_t k = 0; k < inode->numExtents; k++) {
+        struct DiskExtent *extent = imageExtent(img, inode, k);
+        if (index < extent->length) {
+            *contiguous = (size_t)(extent->length - index) * IMAGE_BLOCK_SIZE - pos % IMAGE_BLOCK_SIZE;
+            return (unsigned char *)imageBlock(img, extent->start + (uint32_t)index) + pos % IMAGE_BLOCK_SIZE;
+        }
+        index -= extent->length;
+    }
+    return NULL;
+}
+
+// Block sharing
+//
+// On images with share counts (format 6), one block can belong to several extents: a
+// copied file keeps sharing the blocks neither copy has changed, and deduplication points
+// files with identical blocks at one of them. A block is freed when its last extent lets
+// go of it, and a shared block is copied before it is written in place. So is a block a
+// snapshot keeps, which the image itself may be the only one left using.
+
+// Make room for `count` more extents, allocating the overflow block on first use.
+// Returns -1 when the inode has no slots left.
+static int imageExtentSlots(struct Image *img, struct DiskInode *inode, uint32_t count) {
+    uint32_t total = inode->numExtents + count;
+    if (total > IMAGE_INODE_EXTENTS + IMAGE_EXTENTS_PER_BLOCK) {
+        return -1;
+    }
+    if (total > IMAGE_INODE_EXTENTS && inode->extentBlock == 0) {
+        uint32_t got;
+        uint32_t overflow = imageFindFreeRun(img, img->allocHint[0], 1, &got);
+        if (got == 0) {
+            return -1;
+        }
+        imageMarkRun(img, overflow, 1, true);
+        inode->extentBlock = overflow;
+        imageDirty(img, inode, sizeof(*inode));
+    }
+    return 0;
+}
+
+// Add blocks [start, start + len) at the end of the inode's data
+static int imageAppendExtent(struct Image *img, struct DiskInode *inode, uint32_t start, uint32_t len) {
+    if (imageOwnExtents(img, inode) != 0) {
+        return -1;
+    }
+    struct DiskExtent *last = inode->numExtents ? imageExtent(img, inode, inode->numExtents - 1) : NULL;
+    if (last != NULL && last->start + last->length == start) {
+        last->length += len;
+    } else {
+        if (imageExtentSlots(img, inode, 1) != 0) {
+            return -1;
+        }
+        struct DiskExtent *extent = imageExtent(img, inode, inode->numExtents++);
+        extent->start = start;
+        extent->length = len;
+    }
+    imageDirty(img, inode, sizeof(*inode));
+    return 0;
+}
+
+// Point block `index` of the inode's data at `block`, splitting the extent that holds it.
+// Returns -1 when there is no extent slot for the split.
+static int imageRemapBlock(struct Image *img, struct DiskInode *inode, uint64_t index, uint32_t block) {
+    if (imageOwnExtents(img, inode) != 0) {
+        return -1;
+    }
+    uint32_t k = 0;
+    struct DiskExtent *extent = imageExtent(img, inode, 0);
+    while (index >= extent->length) {
+        index -= extent->length;
+        extent = imageExtent(img, inode, ++k);
+    }
+    struct DiskExtent old = *extent;
+    uint32_t at = (uint32_t)index;
+    uint32_t pieces = (at > 0) + 1 + (at + 1 < old.length);
+    if (pieces > 1) {
+        if (imageExtentSlots(img, inode, pieces - 1) != 0) {
+            return -1;
+        }
+        for (uint32_t m = inode->numExtents; m-- > k + 1; ) {
+            *imageExtent(img, inode, m + pieces - 1) = *imageExtent(img, inode, m);
+        }
+        inode->numExtents += pieces - 1;
+    }
+    if (at > 0) {
+        imageExtent(img, inode, k)->length = at;
+        k++;
+    }
+    imageExtent(img, inode, k)->start = block;
+    imageExtent(img, inode, k)->length = 1;
+    if (at + 1 < old.length) {
+        imageExtent(img, inode, k + 1)->start = old.start + at + 1;
+        imageExtent(img, inode, k + 1)->length = old.length - at - 1;
+    }
+    imageDirty(img, inode, sizeof(*inode));
+    return 0;
+}
+
+static void imageAddShare(struct Image *img, uint32_t block) {
+    img->shares[block]++;
+    imageDirty(img, &img->shares[block], sizeof(uint16_t));
+}
+
+// 64-bit fingerprint of a block's contents: four independent multiply-rotate lanes over
+// 32-byte strides (so the multiplies overlap, or become vector instructions where the
+// target has 64-bit vector multiplies), folded together at the end
+static uint64_t blockPrint(const unsigned char *block) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull, prime2 = 0xC2B2AE3D27D4EB4Full;
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    for (size_t i = 0; i < IMAGE_BLOCK_SIZE; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t v;
+            memcpy(&v, block + i + 8 * l, sizeof(v));
+            lanes[l] += v * prime2;
+            lanes[l] = (lanes[l] << 31 | lanes[l] >> 33) * prime1;
+        }
+    }
+    uint64_t h = (lanes[0] << 1 | lanes[0] >> 63) + (lanes[1] << 7 | lanes[1] >> 57)
+               + (lanes[2] << 12 | lanes[2] >> 52) + (lanes[3] << 18 | lanes[3] >> 46);
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    return h;
+}
+
+static int dedupIndexed(struct DedupIndex *index, uint32_t block) {
+    return (index->indexed[block / 64] >> (block % 64)) & 1;
+}
+
+static void dedupInsert(struct Image *img, uint32_t block, uint64_t print) {
+    struct DedupIndex *index = img->dedup;
+    uint32_t b = (uint32_t)print & (index->numBuckets - 1);
+    index->prints[block] = print;
+    index->next[block] = index->buckets[b];
+    index->buckets[b] = block;
+    index->indexed[block / 64] |= 1ull << (block % 64);
+}
+
+// Drop a block from the index before it is freed or its contents change
+static void dedupRemove(struct Image *img, uint32_t block) {
+    struct DedupIndex *index = img->dedup;
+    if (index == NULL || !dedupIndexed(index, block)) {
+        return;
+    }
+    uint32_t *link = &index->buckets[(uint32_t)index->prints[block] & (index->numBuckets - 1)];
+    while (*link != block) {
+        link = &index->next[*link];
+    }
+    *link = index->next[block];
+    index->indexed[block / 64] &= ~(1ull << (block % 64));
+}
+
+// An indexed block holding exactly `data` that can take another sharer, or 0
+static uint32_t dedupFind(struct Image *img, const unsigned char *data, uint64_t print) {
+    struct DedupIndex *index = img->dedup;
+    for (uint32_t block = index->buckets[(uint32_t)print & (index->numBuckets - 1)]; block != 0; block = index->next[block]) {
+        if (index->prints[block] == print && img->shares[block] < IMAGE_MAX_SHARES
+                && memcmp(imageBlock(img, block), data, IMAGE_BLOCK_SIZE) == 0) {
+            return block;
+        }
+    }
+    return 0;
+}
+
+static void dedupDestroy(struct DedupIndex *index) {
+    if (index != NULL) {
+        free(index->buckets);
+        free(index->next);
+        free(index->prints);
+        free(index->indexed);
+        free(index);
+    }
+}
+
+// Index every full block of the plain files in the image. Returns -1 when out of memory.
+static int dedupBuild(struct Image *img) {
+    uint32_t numBlocks = img->super->numBlocks;
+    struct DedupIndex *index = calloc(1, sizeof(struct DedupIndex));
+    if (index == NULL) {
+        return -1;
+    }
+    index->numBuckets = 1;
+    while (index->numBuckets < numBlocks * DEDUP_BUCKETS_PER_BLOCK) {
+        index->numBuckets *= 2;
+    }
+    index->buckets = calloc(index->numBuckets, sizeof(uint32_t));
+    index->next = malloc(numBlocks * sizeof(uint32_t));
+    index->prints = malloc(numBlocks * sizeof(uint64_t));
+    index->indexed = calloc((numBlocks + 63) / 64, sizeof(uint64_t));
+    if (index->buckets == NULL || index->next == NULL || index->prints == NULL || index->indexed == NULL) {
+        dedupDestroy(index);
+        return -1;
+    }
+    img->dedup = index;
+
+    for (uint32_t ino = 1; ino < img->super->numInodes; ino++) {
+        struct DiskInode *inode = &img->inodes[ino];
+        if (!(inode->flags & IMAGE_INODE_USED) || (inode->flags & (IMAGE_INODE_DIR | IMAGE_INODE_COMPRESSED)) || inode->dataIno != 0) {
+            continue;
+        }
+        uint64_t full = inode->size / IMAGE_BLOCK_SIZE, i = 0;
+        for (uint32_t k = 0; k < inode->numExtents && i < full; k++) {
+            struct DiskExtent *extent = imageExtent(img, inode, k);
+            for (uint32_t b = 0; b < extent->length && i < full; b++, i++) {
+                uint32_t block = extent->start + b;
+                if (!dedupIndexed(index, block)) {
+                    dedupInsert(img, block, blockPrint(imageBlock(img, block)));
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// An extent lets go of blocks [start, start + len): shared blocks lose a sharer and the
+// others are freed
+static void imageReleaseRun(struct Image *img, uint32_t start, uint32_t len) {
+    if (img->shares == NULL) {
+        imageMarkRun(img, start, len, false);
+        return;
+    }
+    uint32_t end = start + len, run = start; // blocks [run, block) are to be freed
+    for (uint32_t block = start; block <= end; block++) {
+        if (block < end && img->shares[block] == 0) {
+            dedupRemove(img, block);
+            continue;
+        }
+        if (block > run) {
+            imageMarkRun(img, run, block - run, false);
+        }
+        if (block < end) {
+            img->shares[block]--;
+            imageDirty(img, &img->shares[block], sizeof(uint16_t));
+        }
+        run = block + 1;
+    }
+}
+
+// Before blocks [first, last] of the inode's data are written in place: give it its own
+// copy of each one that is shared or kept by a snapshot, and drop the others from the
+// fingerprint index since their contents are about to change. Returns -1 when a copy
+// cannot be made.
+static int imageOwnBlocks(struct Image *img, struct DiskInode *inode, uint64_t first, uint64_t last) {
+    if (img->shares == NULL && img->pinned == NULL) {
+        return 0;
+    }
+    for (uint64_t i = first; i <= last; i++) {
+        size_t contiguous;
+        unsigned char *at = imageLocate(img, inode, i * IMAGE_BLOCK_SIZE, &contiguous);
+        if (at == NULL) {
+            break; // not allocated yet
+        }
+        uint32_t block = (uint32_t)((at - img->base) / IMAGE_BLOCK_SIZE);
+        if ((img->shares == NULL || img->shares[block] == 0) && !imagePinned(img, block)) {
+            dedupRemove(img, block);
+            continue;
+        }
+        uint32_t got;
+        uint32_t copy = imageFindFreeRun(img, block, 1, &got);
+        if (got == 0) {
+            return -1;
+        }
+        imageMarkRun(img, copy, 1, true);
+        if (imageRemapBlock(img, inode, i, copy) != 0) {
+            imageMarkRun(img, copy, 1, false);
+            return -1;
+        }
+        memcpy(imageBlock(img, copy), imageBlock(img, block), IMAGE_BLOCK_SIZE);
+        imageReleaseRun(img, block, 1);
+    }
+    return 0;
+}
+
+static int imageCopyData(struct Image *img, uint32_t src, uint32_t dst);
+static int imageExpand(struct Image *img, uint32_t ino);
+
+// Copy bytes [pos, pos + len) of the inode's blocks, regardless of its size, into the
+// image (`store`) or out of it. Returns bytes copied, fewer when the blocks run out.
+static size_t imageTransfer(struct Image *img, struct DiskInode *inode, uint64_t pos, void *buf, size_t len, int store) {
+    unsigned char *mem = buf;
+    size_t done = 0;
+    while (done < len) {
+        size_t contiguous;
+        unsigned char *at = imageLocate(img, inode, pos + done, &contiguous);
+        if (at == NULL) {
+            break;
+        }
+        size_t chunk = contiguous < len - done ? contiguous : len - done;
+        if (store) {
+            memcpy(at, mem + done, chunk);
+        } else {
+            memcpy(mem + done, at, chunk);
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+// The inode that holds ino's data: its shared data inode, or itself
+static struct DiskInode *imageDataOf(struct Image *img, uint32_t ino) {
+    uint32_t dataIno = img->inodes[ino].dataIno;
+    return dataIno != 0 ? &img->inodes[dataIno] : &img->inodes[ino];
+}
+
+// Give ino back its own extents (copy-on-write). The last reference simply takes the
+// shared extents over; otherwise the data is copied when `keepData` is set.
+static int imageUnshare(struct Image *img, uint32_t ino, int keepData) {
+    struct DiskInode *inode = &img->inodes[ino];
+    uint32_t dataIno = inode->dataIno;
+    struct DiskInode *shared = &img->inodes[dataIno];
+
+    imageDirtyInode(img, ino);
+    imageDirtyInode(img, dataIno);
+    inode->dataIno = 0;
+    inode->size = 0;
+    inode->numExtents = 0;
+    inode->extentBlock = 0;
+    if (shared->refcount == 1) {
+        inode->flags |= shared->flags & IMAGE_INODE_LAYOUT;
+        inode->size = shared->size;
+        inode->numExtents = shared->numExtents;
+        inode->extentBlock = shared->extentBlock;
+        memcpy(inode->extents, shared->extents, sizeof(inode->extents));
+        memset(shared, 0, sizeof(*shared));
+        img->super->freeInodes++;
+        imageDirtySuper(img);
+        return 0;
+    }
+    shared->refcount--;
+    return keepData ? imageCopyData(img, dataIno, ino) : 0;
+}
+
+// Shrink the inode to `size` bytes, releasing every block past the new end. Returns -1,
+// changing nothing, when a compressed file cannot be expanded first or there is no block
+// to move extents a snapshot keeps to.
+static int imageTruncate(struct Image *img, uint32_t ino, uint64_t size) {
+    if (img->inodes[ino].dataIno != 0) {
+        imageUnshare(img, ino, size > 0);
+    }
+    struct DiskInode *inode = &img->inodes[ino];
+    if (inode->flags & IMAGE_INODE_INLINE) {
+        imageDirtyInode(img, ino);
+        if (inode->size > size) {
+            memset(inode->inlineData + size, 0, (size_t)(inode->size - size));
+            inode->size = size;
+        }
+        if (inode->size == 0) {
+            inode->flags &= ~IMAGE_INODE_INLINE;
+        }
+        return 0;
+    }
+    if (inode->flags & IMAGE_INODE_COMPRESSED) {
+        if (size > 0) {
+            return imageExpand(img, ino) == 0 ? imageTruncate(img, ino, size) : -1;
+        }
+        inode->flags &= ~IMAGE_INODE_COMPRESSED;
+    }
+    uint64_t keep = (size + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    uint32_t numExtents = 0;
+    if (keep > 0 && imageOwnExtents(img, inode) != 0) {
+        return -1;
+    }
+
+    imageDirtyInode(img, ino);
+    for (uint32_t k = 0; k < inode->numExtents; k++) {
+        struct DiskExtent *extent = imageExtent(img, inode, k);
+        if (keep >= extent->length) {
+            keep -= extent->length;
+            numExtents++;
+            continue;
+        }
+        // Free the tail of this extent (all of it when keep is 0). Extents dropped whole
+        // are left as they are: their overflow block may be one a snapshot keeps.
+        imageReleaseRun(img, extent->start + (uint32_t)keep, extent->length - (uint32_t)keep);
+        if (keep > 0) {
+            extent->length = (uint32_t)keep;
+            numExtents++;
+        }
+        keep = 0;
+    }
+    inode->numExtents = numExtents;
+    if (numExtents <= IMAGE_INODE_EXTENTS && inode->extentBlock != 0) {
+        imageMarkRun(img, inode->extentBlock, 1, false);
+        inode->extentBlock = 0;
+    }
+    if (inode->size > size) {
+        inode->size = size;
+    }
+    return 0;
+}
+
+// Write `len` bytes at `offset`, growing the file as needed. Returns bytes written.
+static size_t imageWrite(struct Image *img, uint32_t ino, uint64_t offset, const void *data, size_t len) {
+    if (img->inodes[ino].dataIno != 0 && imageUnshare(img, ino, true) != 0) {
+        return 0;
+    }
+    if ((img->inodes[ino].flags & IMAGE_INODE_COMPRESSED) && imageExpand(img, ino) != 0) {
+        return 0;
+    }
+    struct DiskInode *inode = &img->inodes[ino];
+
+    // A small file stays in its inode, so reading and writing it touch no data block
+    int isInline = (inode->flags & IMAGE_INODE_INLINE) != 0;
+    if ((isInline || (inode->numExtents == 0 && len > 0)) && offset + len <= IMAGE_INLINE_SIZE) {
+        imageDirtyInode(img, ino);
+        if (!isInline) {
+            memset(inode->inlineData, 0, IMAGE_INLINE_SIZE);
+            inode->flags |= IMAGE_INODE_INLINE;
+            imageUpgrade(img);
+        }
+        memcpy(inode->inlineData + offset, data, len);
+        if (offset + len > inode->size) {
+            inode->size = offset + len;
+        }
+        return len;
+    }
+    // Outgrowing the inode: its bytes move to the first block once there is one
+    unsigned char held[IMAGE_INLINE_SIZE];
+    size_t heldLen = isInline ? (size_t)inode->size : 0;
+    if (isInline) {
+        memcpy(held, inode->inlineData, heldLen);
+        memset(inode->inlineData, 0, IMAGE_INLINE_SIZE);
+        inode->flags &= ~IMAGE_INODE_INLINE;
+        imageDirtyInode(img, ino);
+    }
+
+    // Reserve every missing block up front so the write lands in as few extents as possible
+    uint64_t needed = (offset + len + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    uint32_t allocated = imageAllocatedBlocks(img, inode);
+    if (needed > allocated) {
+        imageAllocBlocks(img, inode, (uint32_t)(needed - allocated));
+    }
+    if (heldLen > 0 && imageTransfer(img, inode, 0, held, heldLen, true) != heldLen) {
+        // Not a single block to be had: the file stays inline as it was
+        memcpy(inode->inlineData, held, heldLen);
+        inode->flags |= IMAGE_INODE_INLINE;
+        return 0;
+    }
+    uint64_t from = offset < inode->size ? offset : inode->size;
+    if (len > 0 && imageOwnBlocks(img, inode, from / IMAGE_BLOCK_SIZE, (offset + len - 1) / IMAGE_BLOCK_SIZE) != 0) {
+        return 0;
+    }
+
+    // A write past the end leaves a hole that reads back as zeros, whatever its blocks
+    // held before: the tail of a block kept by a truncation, or one another file freed
+    for (uint64_t pos = inode->size; len > 0 && pos < offset; ) {
+        size_t contiguous;
+        unsigned char *at = imageLocate(img, inode, pos, &contiguous);
+        if (at == NULL) {
+            return 0;
+        }
+        size_t chunk = contiguous < offset - pos ? contiguous : (size_t)(offset - pos);
+        memset(at, 0, chunk);
+        pos += chunk;
+    }
+
+    // Short when the image is full or the file has its maximum number of extents
+    size_t done = imageTransfer(img, inode, offset, (void *)data, len, true);
+    if (offset + done > inode->size) {
+        inode->size = offset + done;
+        imageDirtyInode(img, ino);
+    }
+    return done;
+}
+
+// Write all of `len` bytes to fd, retrying short writes
+static int writeAll(int fd, const void *data, size_t len) {
+    const char *src = data;
+    while (len > 0) {
+        ssize_t n = write(fd, src, len);
+        if (n <= 0) {
+            return -1;
+        }
+        src += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// writev that retries short writes
+static int writevAll(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n <= 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Read `len` bytes at `offset` of a compressed file (which must hold them) into buf, or
+// when buf is NULL write them to fd, decompressing only the chunks they fall in.
+// Returns the byte count, or -1 when the data is damaged or cannot be written.
+static long imageReadCompressed(struct Image *img, struct DiskInode *inode, uint64_t offset, uint64_t len, unsigned char *buf, int fd) {
+    uint64_t tableLen = (inode->size + IMAGE_COMPRESS_CHUNK - 1) / IMAGE_COMPRESS_CHUNK * sizeof(uint32_t);
+    unsigned char *stored = malloc(IMAGE_COMPRESS_CHUNK);
+    unsigned char *plain = malloc(IMAGE_COMPRESS_CHUNK);
+    uint64_t done = 0;
+    long status = stored != NULL && plain != NULL ? 0 : -1;
+
+    while (done < len && status == 0) {
+        uint64_t chunk = (offset + done) / IMAGE_COMPRESS_CHUNK;
+        size_t skip = (size_t)((offset + done) % IMAGE_COMPRESS_CHUNK);
+        size_t chunkLen = inode->size - chunk * IMAGE_COMPRESS_CHUNK < IMAGE_COMPRESS_CHUNK
+                        ? (size_t)(inode->size - chunk * IMAGE_COMPRESS_CHUNK) : IMAGE_COMPRESS_CHUNK;
+
+        // The chunk's stored bytes run from the previous chunk's end to its own
+        uint32_t bounds[2] = {0, 0};
+        if (chunk > 0) {
+            imageTransfer(img, inode, (chunk - 1) * sizeof(uint32_t), bounds, 2 * sizeof(uint32_t), false);
+        } else {
+            imageTransfer(img, inode, 0, &bounds[1], sizeof(uint32_t), false);
+        }
+        uint32_t from = bounds[0] & ~IMAGE_CHUNK_RAW, to = bounds[1] & ~IMAGE_CHUNK_RAW;
+        int raw = (bounds[1] & IMAGE_CHUNK_RAW) != 0;
+        size_t storedLen = to - from;
+        if (to < from || storedLen > IMAGE_COMPRESS_CHUNK || (raw && storedLen != chunkLen)
+                || imageTransfer(img, inode, tableLen + from, stored, storedLen, false) != storedLen
+                || (!raw && lzDecompress(stored, storedLen, plain, chunkLen) != 0)) {
+            status = -1;
+            break;
+        }
+
+        const unsigned char *bytes = raw ? stored : plain;
+        size_t n = chunkLen - skip < len - done ? chunkLen - skip : (size_t)(len - done);
+        if (buf != NULL) {
+            memcpy(buf + done, bytes + skip, n);
+        } else if (writeAll(fd, bytes + skip, n) != 0) {
+            status = -1;
+        }
+        done += n;
+    }
+    free(stored);
+    free(plain);
+    return status == 0 ? (long)done : -1;
+}
+
+// Write bytes [offset, offset + length) of the data held by `inode` to fd straight from
+// the mapping, gathering up to READ_MAX_IOVECS extents per writev. Returns bytes written,
+// or -1.
+static long imageReadInode(struct Image *img, struct DiskInode *inode, uint64_t offset, uint64_t length, int fd) {
+    struct iovec iov[READ_MAX_IOVECS];
+    int count = 0;
+
+    if (offset >= inode->size) {
+        return 0;
+    }
+    uint64_t end = inode->size - offset < length ? inode->size : offset + length;
+    if (inode->flags & IMAGE_INODE_INLINE) {
+        return writeAll(fd, inode->inlineData + offset, (size_t)(end - offset)) == 0 ? (long)(end - offset) : -1;
+    }
+    if (inode->flags & IMAGE_INODE_COMPRESSED) {
+        return imageReadCompressed(img, inode, offset, end - offset, NULL, fd);
+    }
+    uint64_t pos = offset;
+    while (pos < end) {
+        size_t contiguous;
+        unsigned char *src = imageLocate(img, inode, pos, &contiguous);
+        if (src == NULL) {
+            break;
+        }
+        size_t chunk = end - pos < contiguous ? (size_t)(end - pos) : contiguous;
+        iov[count].iov_base = src;
+        iov[count].iov_len = chunk;
+        if (++count == READ_MAX_IOVECS) {
+            if (writevAll(fd, iov, count) != 0) {
+                return -1;
+            }
+            count = 0;
+        }
+        pos += chunk;
+    }
+    if (count > 0 && writevAll(fd, iov, count) != 0) {
+        return -1;
+    }
+    return (long)(pos - offset);
+}
+
+// Write bytes [offset, offset + length) of file `ino` to fd. Returns bytes written, or -1.
+static long imageReadRange(struct Image *img, uint32_t ino, uint64_t offset, uint64_t length, int fd) {
+    return imageReadInode(img, imageDataOf(img, ino), offset, length, fd);
+}
+
+// Copy up to `len` bytes at `offset` out of the mapping. Returns bytes copied, or -1
+// when a compressed file is damaged.
+static long imageReadAt(struct Image *img, uint32_t ino, uint64_t offset, void *buf, size_t len) {
+    struct DiskInode *inode = imageDataOf(img, ino);
+
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (inode->size - offset < len) {
+        len = (size_t)(inode->size - offset);
+    }
+    if (inode->flags & IMAGE_INODE_INLINE) {
+        memcpy(buf, inode->inlineData + offset, len);
+        return (long)len;
+    }
+    if (inode->flags & IMAGE_INODE_COMPRESSED) {
+        return imageReadCompressed(img, inode, offset, len, buf, -1);
+    }
+    return (long)imageTransfer(img, inode, offset, buf, len, false);
+}
+
+// Replace the contents of `dst` with those of `src`. The blocks are shared when the
+// image counts shares, and otherwise copied as they are, so a compressed file stays
+// compressed either way.
+static int imageCopyData(struct Image *img, uint32_t src, uint32_t dst) {
+    imageTruncate(img, dst, 0);
+    struct DiskInode *from = &img->inodes[src], *to = &img->inodes[dst];
+
+    if (from->flags & IMAGE_INODE_INLINE) {
+        memcpy(to->inlineData, from->inlineData, IMAGE_INLINE_SIZE);
+        to->flags |= IMAGE_INODE_INLINE;
+        to->size = from->size;
+        imageDirtyInode(img, dst);
+        return 0;
+    }
+
+    int shareable = img->shares != NULL && imageExtentSlots(img, to, from->numExtents) == 0;
+    for (uint32_t k = 0; k < from->numExtents && shareable; k++) {
+        struct DiskExtent *extent = imageExtent(img, from, k);
+        for (uint32_t b = 0; b < extent->length && shareable; b++) {
+            shareable = img->shares[extent->start + b] < IMAGE_MAX_SHARES;
+        }
+    }
+    if (shareable) {
+        for (uint32_t k = 0; k < from->numExtents; k++) {
+            struct DiskExtent *extent = imageExtent(img, from, k);
+            *imageExtent(img, to, k) = *extent;
+            for (uint32_t b = 0; b < extent->length; b++) {
+                imageAddShare(img, extent->start + b);
+            }
+        }
+        to->numExtents = from->numExtents;
+        to->flags |= from->flags & IMAGE_INODE_COMPRESSED;
+        to->size = from->size;
+        imageDirtyInode(img, dst);
+        return 0;
+    }
+
+    // One reservation for the whole file keeps the copy contiguous
+    uint32_t needed = imageAllocatedBlocks(img, from);
+    if (imageAllocBlocks(img, to, needed) != needed) {
+        return -1;
+    }
+
+    uint64_t pos = 0;
+    while (pos < (uint64_t)needed * IMAGE_BLOCK_SIZE) {
+        size_t contiguous;
+        unsigned char *blocks = imageLocate(img, from, pos, &contiguous);
+        if (blocks == NULL || imageTransfer(img, to, pos, blocks, contiguous, true) != contiguous) {
+            return -1;
+        }
+        pos += contiguous;
+    }
+    to->flags |= from->flags & IMAGE_INODE_COMPRESSED;
+    to->size = from->size;
+    imageDirtyInode(img, dst);
+    return 0;
+}
+
+// Store `len` bytes as the contents of an empty file that owns its extents, compressing
+// each chunk. Falls back to imageWrite when that would not save a block. Returns bytes
+// written (0 when the compressed file does not fit).
+static size_t imageWriteCompressed(struct Image *img, uint32_t ino, const void *data, size_t len) {
+    const unsigned char *src = data;
+    size_t numChunks = (len + IMAGE_COMPRESS_CHUNK - 1) / IMAGE_COMPRESS_CHUNK;
+    size_t tableLen = numChunks * sizeof(uint32_t);
+    unsigned char *packed = len > IMAGE_BLOCK_SIZE && len < IMAGE_CHUNK_RAW ? malloc(tableLen + len) : NULL;
+    if (packed == NULL) {
+        return imageWrite(img, ino, 0, data, len);
+    }
+
+    uint32_t *table = (uint32_t *)packed;
+    unsigned char *chunks = packed + tableLen;
+    size_t used = 0;
+    for (size_t c = 0; c < numChunks; c++) {
+        size_t chunkLen = len - c * IMAGE_COMPRESS_CHUNK < IMAGE_COMPRESS_CHUNK ? len - c * IMAGE_COMPRESS_CHUNK : IMAGE_COMPRESS_CHUNK;
+        size_t packedLen = lzCompress(src + c * IMAGE_COMPRESS_CHUNK, chunkLen, chunks + used, chunkLen - 1);
+        if (packedLen == 0) {
+            memcpy(chunks + used, src + c * IMAGE_COMPRESS_CHUNK, chunkLen);
+            used += chunkLen;
+            table[c] = (uint32_t)used | IMAGE_CHUNK_RAW;
+        } else {
+            used += packedLen;
+            table[c] = (uint32_t)used;
+        }
+    }
+
+    size_t total = tableLen + used, written = 0;
+    uint32_t needed = (uint32_t)((total + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE);
+    struct DiskInode *inode = &img->inodes[ino];
+    if (needed >= (len + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE) {
+        written = imageWrite(img, ino, 0, data, len);
+    } else if (imageAllocBlocks(img, inode, needed) == needed && imageTransfer(img, inode, 0, packed, total, true) == total) {
+        inode->flags |= IMAGE_INODE_COMPRESSED;
+        inode->size = len;
+        imageDirtyInode(img, ino);
+        imageUpgrade(img);
+        written = len;
+    } else {
+        imageTruncate(img, ino, 0);
+    }
+    free(packed);
+    return written;
+}
+
+// Store `len` bytes as the contents of an empty file that owns its extents. A full block
+// identical to one in the fingerprint index becomes another reference to that block;
+// the others are written and indexed. Returns bytes written.
+static size_t imageWriteDeduped(struct Image *img, uint32_t ino, const void *data, size_t len) {
+    const unsigned char *src = data;
+    struct DiskInode *inode = &img->inodes[ino];
+    size_t full = len / IMAGE_BLOCK_SIZE * IMAGE_BLOCK_SIZE, done = 0;
+
+    while (done < full) {
+        uint64_t print = blockPrint(src + done);
+        uint32_t match = dedupFind(img, src + done, print);
+        if (match != 0) {
+            if (imageAppendExtent(img, inode, match, 1) != 0) {
+                break;
+            }
+            imageAddShare(img, match);
+        } else {
+            if (imageAllocBlocks(img, inode, 1) != 1) {
+                break;
+            }
+            struct DiskExtent *last = imageExtent(img, inode, inode->numExtents - 1);
+            uint32_t block = last->start + last->length - 1;
+            memcpy(imageBlock(img, block), src + done, IMAGE_BLOCK_SIZE);
+            dedupInsert(img, block, print);
+        }
+        done += IMAGE_BLOCK_SIZE;
+    }
+    inode->size = done;
+    imageDirtyInode(img, ino);
+    if (done == full && len > full) {
+        done += imageWrite(img, ino, full, src + full, len - full);
+    }
+    return done;
+}
+
+// Turn a compressed file that owns its extents back into plain blocks before it is
+// changed in place. Returns -1, leaving it compressed, when it cannot be.
+static int imageExpand(struct Image *img, uint32_t ino) {
+    struct DiskInode *inode = &img->inodes[ino];
+    size_t len = (size_t)inode->size;
+    uint64_t needed = (len + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    if (needed > (uint64_t)img->super->freeBlocks + imageAllocatedBlocks(img, inode)) {
+        return -1;
+    }
+    unsigned char *plain = malloc(len > 0 ? len : 1);
+    if (plain == NULL || imageReadCompressed(img, inode, 0, len, plain, -1) != (long)len) {
+        free(plain);
+        return -1;
+    }
+    imageTruncate(img, ino, 0);
+    size_t written = imageWrite(img, ino, 0, plain, len);
+    free(plain);
+    return written == len ? 0 : -1;
+}
+
+// Double a catalog's inode table. A catalog is only a superblock and an inode table, so
+// the table simply grows at the end of the file.
+static int imageGrowCatalog(struct Image *img) {
+    uint32_t numInodes = img->super->numInodes * 2;
+    uint32_t numBlocks = 1 + (uint32_t)(((size_t)numInodes * sizeof(struct DiskInode) + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE);
+    size_t size = (size_t)numBlocks * IMAGE_BLOCK_SIZE;
+
+    if (numInodes < img->super->numInodes || journalReserve(img->journal, numBlocks) != 0
+            || ftruncate(img->fd, (off_t)size) != 0) {
+        return -1;
+    }
+    unsigned char *base = mremap(img->base, img->size, size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    img->base = base;
+    img->size = size;
+    img->super = (struct DiskSuperblock *)base;
+    img->inodes = imageBlock(img, img->super->inodeTableStart);
+    img->super->freeInodes += numInodes - img->super->numInodes;
+    img->super->numInodes = numInodes;
+    img->super->numBlocks = numBlocks;
+    img->super->bitmapStart = numBlocks;
+    img->super->dataStart = numBlocks;
+    imageDirtySuper(img);
+    return 0;
+}
+
+// Append `ino` to a circular list threaded through nextSibling/prevSibling, whose first
+// entry is *head: a directory's firstChild, or the superblock's orphans
+static void imageListAppend(struct Image *img, uint32_t *head, uint32_t ino) {
+    struct DiskInode *entry = &img->inodes[ino];
+    imageDirtyInode(img, ino);
+    if (*head == 0) {
+        imageDirty(img, head, sizeof(*head));
+        *head = ino;
+        entry->nextSibling = ino;
+        entry->prevSibling = ino;
+        return;
+    }
+    uint32_t first = *head;
+    uint32_t last = img->inodes[first].prevSibling;
+    imageDirtyInode(img, first);
+    imageDirtyInode(img, last);
+    entry->nextSibling = first;
+    entry->prevSibling = last;
+    img->inodes[last].nextSibling = ino;
+    img->inodes[first].prevSibling = ino;
+}
+
+static void imageListRemove(struct Image *img, uint32_t *head, uint32_t ino) {
+    struct DiskInode *entry = &img->inodes[ino];
+    imageDirty(img, head, sizeof(*head));
+    if (entry->nextSibling == ino) {
+        *head = 0;
+        return;
+    }
+    imageDirtyInode(img, entry->prevSibling);
+    imageDirtyInode(img, entry->nextSibling);
+    img->inodes[entry->prevSibling].nextSibling = entry->nextSibling;
+    img->inodes[entry->nextSibling].prevSibling = entry->prevSibling;
+    if (*head == ino) {
+        *head = entry->nextSibling;
+    }
+}
+
+// Append `ino` to the entry list of directory `parent`
+static void imageLinkChild(struct Image *img, uint32_t parent, uint32_t ino) {
+    imageListAppend(img, &img->inodes[parent].firstChild, ino);
+}
+
+static void imageUnlinkChild(struct Image *img, uint32_t ino) {
+    imageListRemove(img, &img->inodes[img->inodes[ino].parent].firstChild, ino);
+}
+
+// Returns a fresh inode number, or 0 when the inode table is full. `type` is 0 for a
+// file, IMAGE_INODE_DIR or IMAGE_INODE_DATA; files and directories join their parent's
+// entry list.
+static uint32_t imageAllocInode(struct Image *img, const char *name, uint32_t parent, uint32_t type) {
+    if (img->super->freeInodes == 0 && (!(img->super->flags & IMAGE_CATALOG) || imageGrowCatalog(img) != 0)) {
+        return 0;
+    }
+    uint32_t numInodes = img->super->numInodes;
+    uint32_t ino = img->inodeHint;
+    for (uint32_t tried = 0; tried < numInodes; tried++, ino++) {
+        if (ino == 0 || ino >= numInodes) {
+            ino = 1;
+        }
+        struct DiskInode *inode = &img->inodes[ino];
+        if (!(inode->flags & IMAGE_INODE_USED)) {
+            memset(inode, 0, sizeof(*inode));
+            inode->flags = IMAGE_INODE_USED | type;
+            inode->parent = parent;
+            strncpy(inode->name, name, MAX_FILE_NAME_LENGTH - 1);
+            if (type != IMAGE_INODE_DATA) {
+                inode->mtime = (uint32_t)time(NULL);
+            }
+            img->super->freeInodes--;
+            img->inodeHint = ino + 1;
+            imageDirtyInode(img, ino);
+            imageDirtySuper(img);
+            if (type != IMAGE_INODE_DATA) {
+                imageLinkChild(img, parent, ino);
+                if (type == IMAGE_INODE_DIR) {
+                    img->super->numDirs++;
+                } else {
+                    img->super->numFiles++;
+                }
+            }
+            return ino;
+        }
+    }
+    return 0;
+}
+
+// Free an inode that is on no entry list, along with its data
+static void imageReleaseInode(struct Image *img, uint32_t ino) {
+    imageTruncate(img, ino, 0);
+    if (img->inodes[ino].flags & IMAGE_INODE_DIR) {
+        img->super->numDirs--;
+    } else {
+        img->super->numFiles--;
+    }
+    img->inodes[ino].flags = 0;
+    img->super->freeInodes++;
+    imageDirtyInode(img, ino);
+    imageDirtySuper(img);
+}
+
+static void imageFreeInode(struct Image *img, uint32_t ino) {
+    imageUnlinkChild(img, ino);
+    imageReleaseInode(img, ino);
+}
+
+// Orphans
+//
+// rm and rmdir do not free anything on the spot: they move the inode from its parent's
+// entry list to the orphan list, another circular list whose head is in the superblock,
+// and the reclaimer frees orphans a batch at a time later. A removed directory takes its
+// entries along, so removing a tree is a single move however large it is; its entries
+// become orphans themselves, one at a time, as the reclaimer empties it. The list is
+// journaled metadata like the entry lists, so orphans left behind by a crash or an
+// unmount are picked up at the next mount. Builds older than the list ignore it, which
+// only leaks the orphans' space.
+
+// Move `ino` off its parent's entry list onto the orphan list
+static void imageOrphanInode(struct Image *img, uint32_t ino) {
+    imageUnlinkChild(img, ino);
+    imageListAppend(img, &img->super->orphans, ino);
+}
+
+// Free up to `limit` orphans, or hand that many entries of orphaned directories over to
+// the orphan list. The inode numbers of the files freed go into freed[] (when it is not
+// NULL, it has room for `limit`); returns how many there were.
+static uint32_t imageReclaimOrphans(struct Image *img, uint32_t limit, uint32_t *freed) {
+    uint32_t numFreed = 0;
+    for (uint32_t k = 0; k < limit && img->super->orphans != 0; k++) {
+        uint32_t ino = img->super->orphans;
+        uint32_t child = img->inodes[ino].firstChild;
+        if (child != 0) {
+            imageUnlinkChild(img, child);
+            imageListAppend(img, &img->super->orphans, child);
+            continue;
+        }
+        imageListRemove(img, &img->super->orphans, ino);
+        if (freed != NULL && !(img->inodes[ino].flags & IMAGE_INODE_DIR)) {
+            freed[numFreed++] = ino;
+        }
+        imageReleaseInode(img, ino);
+    }
+    return numFreed;
+}
+
+// Free every orphan at once when fewer than `len` bytes' worth of data blocks (plus one
+// for an extent overflow block), or no inodes, are left, so that an operation does not
+// fail for space that removed files still hold. Called before the operation changes
+// anything: freeing an orphan can release blocks it shares with a copy.
+static void imageMakeRoom(struct Image *img, uint64_t len) {
+    uint64_t blocks = (len + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE + 1;
+    if (img->super->orphans != 0 && (img->super->freeBlocks < blocks || img->super->freeInodes == 0)) {
+        imageReclaimOrphans(img, UINT32_MAX, NULL);
+    }
+}
+
+// Make `dst` a copy of `src` in O(1) by sharing src's data. The first copy moves src's
+// extents into a new data inode that both files then reference.
+static int imageShare(struct Image *img, uint32_t src, uint32_t dst) {
+    imageTruncate(img, dst, 0);
+
+    uint32_t dataIno = img->inodes[src].dataIno;
+    if (dataIno == 0) {
+        dataIno = imageAllocInode(img, "", 0, IMAGE_INODE_DATA);
+        if (dataIno == 0) {
+            return -1;
+        }
+        struct DiskInode *inode = &img->inodes[src];
+        struct DiskInode *shared = &img->inodes[dataIno];
+        shared->flags |= inode->flags & IMAGE_INODE_LAYOUT;
+        shared->size = inode->size;
+        shared->numExtents = inode->numExtents;
+        shared->extentBlock = inode->extentBlock;
+        memcpy(shared->extents, inode->extents, sizeof(shared->extents));
+        shared->refcount = 1;
+        inode->flags &= ~IMAGE_INODE_LAYOUT;
+        inode->numExtents = 0;
+        inode->extentBlock = 0;
+        inode->dataIno = dataIno;
+        imageDirtyInode(img, src);
+    }
+    imageDirtyInode(img, dataIno);
+    imageDirtyInode(img, dst);
+    img->inodes[dataIno].refcount++;
+    img->inodes[dst].dataIno = dataIno;
+    img->inodes[dst].size = img->inodes[dataIno].size;
+    return 0;
+}
+
+static void imageRenameInode(struct Image *img, uint32_t ino, const char *name) {
+    imageDirtyInode(img, ino);
+    memset(img->inodes[ino].name, 0, MAX_FILE_NAME_LENGTH);
+    strncpy(img->inodes[ino].name, name, MAX_FILE_NAME_LENGTH - 1);
+}
+
+// Snapshots
+//
+// A snapshot freezes an image's namespace and file contents in O(1): the open journal
+// group is committed and an entry is added to the snapshot store ("<image>.snapshots"
+// beside the image), and nothing is copied. Metadata is copied on write instead: when a
+// journal commit is about to replace a metadata block that a snapshot still shares with
+// the image, the block's home copy (what the snapshot saw) first goes to a slot of the
+// store, and the snapshot's block map records the slot. File data is never copied for a
+// snapshot: every block in use when it was taken stays allocated until it is deleted
+// (pinned), and the image copies a pinned block before writing to it in place, as it
+// does a shared one (see block sharing). A snapshot is read through its map, each
+// metadata block coming from the store when it has a slot there and from the image
+// otherwise; rolling back writes its slots back as one journaled change. Both cost what
+// changed since the snapshot, not the size of the image. Slots are synced before a map
+// refers to them and maps before the journal commit that needed them, so a crash never
+// leaves a snapshot short of a block. Slots no map refers to any more are reused.
+
+static off_t snapshotMapOffset(struct SnapshotStore *store, int s) {
+    return (off_t)(1 + (size_t)s * store->mapBlocks) * IMAGE_BLOCK_SIZE;
+}
+
+static off_t snapshotSlotOffset(struct SnapshotStore *store, uint32_t slot) {
+    return (off_t)(1 + (size_t)MAX_SNAPSHOTS * store->mapBlocks + slot) * IMAGE_BLOCK_SIZE;
+}
+
+static void snapshotDestroy(struct SnapshotStore *store) {
+    if (store == NULL) {
+        return;
+    }
+    close(store->fd);
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        free(store->maps[s]);
+    }
+    free(store->freeSlots);
+    free(store);
+}
+
+// Snapshot called `name`, or -1
+static int snapshotFind(struct SnapshotStore *store, const char *name) {
+    for (int s = 0; store != NULL && s < MAX_SNAPSHOTS; s++) {
+        if (store->maps[s] != NULL && strncmp(store->header.snapshots[s].name, name, MAX_FILE_NAME_LENGTH) == 0) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+// Work out from the maps which slots are still used: the file is cut after the last of
+// them, and the unused ones below it are handed out again
+static int snapshotRebuildSlots(struct Image *img) {
+    struct SnapshotStore *store = img->snapshots;
+    uint32_t metaBlocks = store->header.metaBlocks, numSlots = 0;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        for (uint32_t block = 0; store->maps[s] != NULL && block < metaBlocks; block++) {
+            if (store->maps[s][block] > numSlots) {
+                numSlots = store->maps[s][block];
+            }
+        }
+    }
+    unsigned char *used = calloc(numSlots + 1, 1);
+    uint32_t *freeSlots = malloc((numSlots + 1) * sizeof(uint32_t));
+    if (used == NULL || freeSlots == NULL) {
+        free(used);
+        free(freeSlots);
+        return -1;
+    }
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        for (uint32_t block = 0; store->maps[s] != NULL && block < metaBlocks; block++) {
+            if (store->maps[s][block] != 0) {
+                used[store->maps[s][block] - 1] = true;
+            }
+        }
+    }
+    uint32_t numFree = 0;
+    for (uint32_t slot = numSlots; slot-- > 0; ) {
+        if (!used[slot]) {
+            freeSlots[numFree++] = slot; // the lowest slot is handed out first
+        }
+    }
+    free(used);
+    free(store->freeSlots);
+    store->freeSlots = freeSlots;
+    store->numFree = numFree;
+    store->numSlots = numSlots;
+    return ftruncate(store->fd, snapshotSlotOffset(store, numSlots));
+}
+
+// Metadata block `block` as snapshot `s` saw it: its slot, read into `buf`, or the
+// image's own copy. The image must have no uncommitted changes. NULL on a read error.
+static const void *snapshotBlock(struct Image *img, int s, uint32_t block, void *buf) {
+    struct SnapshotStore *store = img->snapshots;
+    uint32_t slot = store->maps[s][block];
+    if (slot == 0) {
+        return imageBlock(img, block);
+    }
+    return pread(store->fd, buf, IMAGE_BLOCK_SIZE, snapshotSlotOffset(store, slot - 1)) == IMAGE_BLOCK_SIZE ? buf : NULL;
+}
+
+// Copy inode `ino` as snapshot `s` saw it into *inode
+static int snapshotInode(struct Image *img, int s, uint32_t ino, struct DiskInode *inode) {
+    unsigned char buf[IMAGE_BLOCK_SIZE];
+    if (ino >= img->super->numInodes) {
+        return -1;
+    }
+    size_t offset = (size_t)img->super->inodeTableStart * IMAGE_BLOCK_SIZE + (size_t)ino * sizeof(struct DiskInode);
+    const unsigned char *block = snapshotBlock(img, s, (uint32_t)(offset / IMAGE_BLOCK_SIZE), buf);
+    if (block == NULL) {
+        return -1;
+    }
+    memcpy(inode, block + offset % IMAGE_BLOCK_SIZE, sizeof(*inode));
+    return 0;
+}
+
+// Recompute the pinned blocks from the bitmaps the snapshots saw. The image must have
+// no uncommitted changes.
+static int snapshotRepin(struct Image *img) {
+    struct SnapshotStore *store = img->snapshots;
+    uint32_t words = (img->super->numBlocks + 63) / 64, perBlock = IMAGE_BLOCK_SIZE / sizeof(uint64_t);
+    int any = false;
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        any |= store->maps[s] != NULL;
+    }
+    uint64_t *pinned = any ? calloc(words, sizeof(uint64_t)) : NULL;
+    uint32_t *pinnedEpoch = any ? malloc(words * sizeof(uint32_t)) : NULL;
+    unsigned char buf[IMAGE_BLOCK_SIZE];
+    int status = !any || (pinned != NULL && pinnedEpoch != NULL) ? 0 : -1;
+    for (int s = 0; s < MAX_SNAPSHOTS && status == 0; s++) {
+        for (uint32_t w = 0; store->maps[s] != NULL && w < words && status == 0; w += perBlock) {
+            const uint64_t *bitmap = snapshotBlock(img, s, img->super->bitmapStart + w / perBlock, buf);
+            if (bitmap == NULL) {
+                status = -1;
+                break;
+            }
+            for (uint32_t k = w; k < words && k < w + perBlock; k++) {
+                pinned[k] |= bitmap[k - w];
+            }
+        }
+    }
+    if (status != 0) {
+        free(pinned);
+        free(pinnedEpoch);
+        return -1;
+    }
+    for (uint32_t w = 0; any && w < words; w++) {
+        pinnedEpoch[w] = img->epoch;
+    }
+    free(img->pinned);
+    free(img->pinnedEpoch);
+    img->pinned = pinned;
+    img->pinnedEpoch = pinnedEpoch;
+    return 0;
+}
+
+// Open the image's snapshot store, creating it when `create` is set; an image that has
+// never had a snapshot has none, which is not an error. Returns -1 when the store cannot
+// be read or is not this image's.
+static int snapshotAttach(struct Image *img, int create) {
+    int fd = open(img->snapshotPath, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        return !create && errno == ENOENT ? 0 : -1;
+    }
+    struct SnapshotStore *store = calloc(1, sizeof(struct SnapshotStore));
+    if (store == NULL) {
+        close(fd);
+        return -1;
+    }
+    uint32_t metaBlocks = img->super->dataStart;
+    store->fd = fd;
+    store->mapBlocks = (uint32_t)(((size_t)metaBlocks * sizeof(uint32_t) + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE);
+    img->snapshots = store;
+
+    struct stat st;
+    int status = fstat(fd, &st);
+    if (status == 0 && st.st_size == 0) {
+        store->header.magic = SNAPSHOT_MAGIC;
+        store->header.version = SNAPSHOT_VERSION;
+        store->header.metaBlocks = metaBlocks;
+        status = pwrite(fd, &store->header, sizeof(store->header), 0) == (ssize_t)sizeof(store->header) && fdatasync(fd) == 0 ? 0 : -1;
+    } else if (status == 0) {
+        status = pread(fd, &store->header, sizeof(store->header), 0) == (ssize_t)sizeof(store->header)
+                 && store->header.magic == SNAPSHOT_MAGIC && store->header.version == SNAPSHOT_VERSION
+                 && store->header.metaBlocks == metaBlocks ? 0 : -1;
+    }
+    // A slot past the end of the file can only be damage
+    uint64_t fileSlots = st.st_size > snapshotSlotOffset(store, 0) ? (uint64_t)(st.st_size - snapshotSlotOffset(store, 0)) / IMAGE_BLOCK_SIZE : 0;
+    for (int s = 0; s < MAX_SNAPSHOTS && status == 0; s++) {
+        store->header.snapshots[s].name[MAX_FILE_NAME_LENGTH - 1] = '\0';
+        if (store->header.snapshots[s].name[0] == '\0') {
+            continue;
+        }
+        size_t len = (size_t)metaBlocks * sizeof(uint32_t);
+        store->maps[s] = malloc(len);
+        status = store->maps[s] != NULL && pread(fd, store->maps[s], len, snapshotMapOffset(store, s)) == (ssize_t)len ? 0 : -1;
+        for (uint32_t block = 0; status == 0 && block < metaBlocks; block++) {
+            status = store->maps[s][block] <= fileSlots ? 0 : -1;
+        }
+    }
+    if (status == 0) {
+        status = snapshotRebuildSlots(img) == 0 && snapshotRepin(img) == 0 ? 0 : -1;
+    }
+    if (status != 0) {
+        snapshotDestroy(store);
+        img->snapshots = NULL;
+    }
+    return status;
+}
+
+// Called by journalCommit before the open group reaches the image file: each dirty block
+// that some snapshot still shares with the image has its home copy saved to a slot
+// first, and the maps that now refer to slots are written. Returns -1 when the store
+// cannot be written; the commit must not go ahead then.
+static int snapshotPreserve(struct Image *img) {
+    struct SnapshotStore *store = img->snapshots;
+    struct Journal *journal = img->journal;
+    unsigned char buf[IMAGE_BLOCK_SIZE];
+    int saved = false, written = false;
+
+    for (uint32_t k = 0; k < journal->numDirty; k++) {
+        uint32_t block = journal->dirtyBlocks[k];
+        int sharing = false;
+        for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+            sharing |= store->maps[s] != NULL && store->maps[s][block] == 0;
+        }
+        if (!sharing) {
+            continue;
+        }
+        // Snapshots that still share a block all saw the same contents: one slot serves them
+        uint32_t slot = store->numFree > 0 ? store->freeSlots[--store->numFree] : store->numSlots++;
+        if (pread(img->fd, buf, IMAGE_BLOCK_SIZE, (off_t)block * IMAGE_BLOCK_SIZE) != IMAGE_BLOCK_SIZE
+                || pwrite(store->fd, buf, IMAGE_BLOCK_SIZE, snapshotSlotOffset(store, slot)) != IMAGE_BLOCK_SIZE) {
+            return -1;
+        }
+        for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+            if (store->maps[s] != NULL && store->maps[s][block] == 0) {
+                store->maps[s][block] = slot + 1;
+                store->mapDirty[s] = true;
+            }
+        }
+        saved = true;
+    }
+    if (saved && fdatasync(store->fd) != 0) {
+        return -1;
+    }
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        if (store->mapDirty[s]) {
+            size_t len = (size_t)store->header.metaBlocks * sizeof(uint32_t);
+            if (pwrite(store->fd, store->maps[s], len, snapshotMapOffset(store, s)) != (ssize_t)len) {
+                return -1;
+            }
+            store->mapDirty[s] = false;
+            written = true;
+        }
+    }
+    return written && fdatasync(store->fd) != 0 ? -1 : 0;
+}
+
+// Write the store's header and make it durable
+static int snapshotWriteHeader(struct SnapshotStore *store) {
+    return pwrite(store->fd, &store->header, sizeof(store->header), 0) == (ssize_t)sizeof(store->header)
+           && fdatasync(store->fd) == 0 ? 0 : -1;
+}
+
+// Delete snapshot `s` of an image with no uncommitted changes, releasing its slots and
+// the blocks only it kept
+static int snapshotDelete(struct Image *img, int s) {
+    struct SnapshotStore *store = img->snapshots;
+    struct DiskSnapshot held = store->header.snapshots[s];
+    memset(&store->header.snapshots[s], 0, sizeof(struct DiskSnapshot));
+    if (snapshotWriteHeader(store) != 0) {
+        store->header.snapshots[s] = held;
+        return -1;
+    }
+    free(store->maps[s]);
+    store->maps[s] = NULL;
+    store->mapDirty[s] = false;
+    return snapshotRebuildSlots(img) == 0 && snapshotRepin(img) == 0 ? 0 : -1;
+}
+
+// Take snapshot `name` of an image with no uncommitted changes. Returns -1 when every
+// entry is in use or the store cannot be written.
+static int snapshotCreate(struct Image *img, const char *name) {
+    struct SnapshotStore *store = img->snapshots;
+    int s = 0;
+    while (s < MAX_SNAPSHOTS && store->maps[s] != NULL) {
+        s++;
+    }
+    if (s == MAX_SNAPSHOTS) {
+        return -1;
+    }
+    // The empty map is on disk before the entry that makes it count
+    size_t len = (size_t)store->header.metaBlocks * sizeof(uint32_t);
+    uint32_t *map = calloc(store->header.metaBlocks, sizeof(uint32_t));
+    if (map == NULL || pwrite(store->fd, map, len, snapshotMapOffset(store, s)) != (ssize_t)len || fdatasync(store->fd) != 0) {
+        free(map);
+        return -1;
+    }
+    struct DiskSnapshot *entry = &store->header.snapshots[s];
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->name, name, MAX_FILE_NAME_LENGTH - 1);
+    entry->created = (int64_t)time(NULL);
+    entry->sequence = store->header.nextSequence++;
+    if (snapshotWriteHeader(store) != 0) {
+        memset(entry, 0, sizeof(*entry));
+        free(map);
+        return -1;
+    }
+    store->maps[s] = map;
+
+    // Every block in use now is pinned as the bitmap words next change
+    img->epoch++;
+    if (img->pinned == NULL && snapshotRepin(img) != 0) {
+        snapshotDelete(img, s);
+        return -1;
+    }
+    return 0;
+}
+
+// Put the metadata blocks snapshot `s` has slots for back into the image, as changes of
+// the open group; every other block is still as it saw it. Nothing changes on a read error.
+static int snapshotRestore(struct Image *img, int s) {
+    struct SnapshotStore *store = img->snapshots;
+    uint32_t metaBlocks = store->header.metaBlocks, count = 0;
+    for (uint32_t block = 0; block < metaBlocks; block++) {
+        count += store->maps[s][block] != 0;
+    }
+    unsigned char *blocks = malloc((size_t)(count > 0 ? count : 1) * IMAGE_BLOCK_SIZE);
+    if (blocks == NULL) {
+        return -1;
+    }
+    for (uint32_t block = 0, k = 0; block < metaBlocks; block++) {
+        if (store->maps[s][block] != 0 && snapshotBlock(img, s, block, blocks + (size_t)k++ * IMAGE_BLOCK_SIZE) == NULL) {
+            free(blocks);
+            return -1;
+        }
+    }
+    for (uint32_t block = 0, k = 0; block < metaBlocks; block++) {
+        if (store->maps[s][block] != 0) {
+            memcpy(imageBlock(img, block), blocks + (size_t)k++ * IMAGE_BLOCK_SIZE, IMAGE_BLOCK_SIZE);
+            imageDirty(img, imageBlock(img, block), IMAGE_BLOCK_SIZE);
+        }
+    }
+    free(blocks);
+    return 0;
+}
+
+// Entry `name` of directory `dir` in snapshot `s`, a directory when `isDir` is set, or 0
+static uint32_t snapshotFindEntry(struct Image *img, int s, uint32_t dir, const char *name, int isDir) {
+    struct DiskInode inode;
+    if (snapshotInode(img, s, dir, &inode) != 0) {
+        return 0;
+    }
+    uint32_t first = inode.firstChild, ino = first;
+    for (uint32_t seen = 0; ino != 0 && seen < img->super->numInodes; seen++) {
+        if (snapshotInode(img, s, ino, &inode) != 0) {
+            return 0;
+        }
+        if (strncmp(inode.name, name, MAX_FILE_NAME_LENGTH) == 0 && ((inode.flags & IMAGE_INODE_DIR) != 0) == (isDir != 0)) {
+            return ino;
+        }
+        ino = inode.nextSibling != first ? inode.nextSibling : 0;
+    }
+    return 0;
+}
+
+// Resolve a directory path of snapshot `s` into *ino. Paths start at the snapshot's root
+// ("", "/" and "." are the root). Returns -1 when there is no such directory.
+static int snapshotFindDirectory(struct Image *img, int s, const char *path, uint32_t *ino) {
+    char component[MAX_DIR_NAME_LENGTH];
+    *ino = 0;
+    while (*path != '\0') {
+        size_t len = strcspn(path, "/");
+        if (len >= MAX_DIR_NAME_LENGTH) {
+            return -1;
+        }
+        memcpy(component, path, len);
+        component[len] = '\0';
+        path += len + (path[len] == '/');
+        if (len == 0 || strcmp(component, ".") == 0) {
+            continue;
+        }
+        if ((*ino = snapshotFindEntry(img, s, *ino, component, true)) == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Metadata journal
+//
+// Metadata changes are grouped: the first operation of a group notes the time, and the
+// group is committed as the next operation starts once it holds JOURNAL_GROUP_OPS
+// operations or is JOURNAL_GROUP_MS old (and at fsSync and unmount). When no operation
+// follows, a committer thread does it once the group's first change is JOURNAL_GROUP_MS
+// old, so an operation that returned is never left uncommitted for longer. A commit appends one
+// transaction (header, block numbers, block images) to "<image>.journal", makes it durable
+// with a single fdatasync, and only then copies the blocks into the image file. Mounting
+// replays every complete transaction, so after a crash the metadata reflects exactly the
+// groups that committed. File data in the image, extent overflow blocks and the host
+// files of host mode are written in place and are not journaled.
+
+static uint64_t journalChecksum(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t k = 0; k < len; k++) {
+        hash = (hash ^ bytes[k]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Empty the journal once everything it holds is safely in the image file
+static int journalCheckpoint(struct Image *img) {
+    struct Journal *journal = img->journal;
+    if (fdatasync(img->fd) != 0 || ftruncate(journal->fd, 0) != 0 || fdatasync(journal->fd) != 0) {
+        return -1;
+    }
+    journal->size = 0;
+    journal->sequence = 0;
+    return 0;
+}
+
+// Commit the open group as one transaction
+static int journalCommit(struct Image *img) {
+    struct Journal *journal = img->journal;
+    if (journal == NULL) {
+        return 0;
+    }
+    journal->numOps = 0;
+    if (journal->numDirty == 0) {
+        return 0;
+    }
+    if (img->snapshots != NULL && snapshotPreserve(img) != 0) {
+        fprintf(output(), "Failed to preserve metadata for snapshots.\n");
+        return -1;
+    }
+
+    struct JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.sequence = journal->sequence;
+    header.numBlocks = journal->numDirty;
+    header.fileBlocks = (uint32_t)(img->size / IMAGE_BLOCK_SIZE);
+    uint64_t checksum = journalChecksum(0xCBF29CE484222325ull, journal->dirtyBlocks, journal->numDirty * sizeof(uint32_t));
+    for (uint32_t k = 0; k < journal->numDirty; k++) {
+        checksum = journalChecksum(checksum, imageBlock(img, journal->dirtyBlocks[k]), IMAGE_BLOCK_SIZE);
+    }
+    header.checksum = checksum;
+
+    struct iovec iov[READ_MAX_IOVECS];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = journal->dirtyBlocks;
+    iov[1].iov_len = journal->numDirty * sizeof(uint32_t);
+    int count = 2;
+    for (uint32_t k = 0; k <= journal->numDirty; k++) {
+        if (count == READ_MAX_IOVECS || (k == journal->numDirty && count > 0)) {
+            if (writevAll(journal->fd, iov, count) != 0) {
+                fprintf(output(), "Failed to write the metadata journal.\n");
+                return -1;
+            }
+            count = 0;
+        }
+        if (k < journal->numDirty) {
+            iov[count].iov_base = imageBlock(img, journal->dirtyBlocks[k]);
+            iov[count].iov_len = IMAGE_BLOCK_SIZE;
+            count++;
+        }
+    }
+    if (fdatasync(journal->fd) != 0) {
+        fprintf(output(), "Failed to write the metadata journal.\n");
+        return -1;
+    }
+
+    // Committed: the blocks may now go to their home locations
+    for (uint32_t k = 0; k < journal->numDirty; k++) {
+        uint32_t block = journal->dirtyBlocks[k];
+        if (pwrite(img->fd, imageBlock(img, block), IMAGE_BLOCK_SIZE, (off_t)block * IMAGE_BLOCK_SIZE) != IMAGE_BLOCK_SIZE) {
+            fprintf(output(), "Failed to write metadata block %u.\n", block);
+        }
+        journal->dirtyMap[block / 64] &= ~(1ull << (block % 64));
+    }
+    journal->size += sizeof(header) + (off_t)journal->numDirty * (sizeof(uint32_t) + IMAGE_BLOCK_SIZE);
+    journal->sequence++;
+    journal->numDirty = 0;
+    if (journal->size >= JOURNAL_CHECKPOINT_BYTES && journalCheckpoint(img) != 0) {
+        fprintf(output(), "Failed to checkpoint the metadata journal.\n");
+    }
+    return 0;
+}
+
+// Copy every complete transaction of the journal into the image file `fd`, then empty
+// the journal. Returns the number of transactions replayed, or -1.
+static int journalReplay(int fd, int journalFd) {
+    struct JournalHeader header;
+    off_t pos = 0;
+    int replayed = 0;
+
+    while (pread(journalFd, &header, sizeof(header), pos) == (ssize_t)sizeof(header)) {
+        if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION || header.sequence != (uint64_t)replayed
+                || header.numBlocks == 0 || header.numBlocks > header.fileBlocks) {
+            break;
+        }
+        size_t len = (size_t)header.numBlocks * (sizeof(uint32_t) + IMAGE_BLOCK_SIZE);
+        unsigned char *body = malloc(len);
+        if (body == NULL) {
+            return -1;
+        }
+        if (pread(journalFd, body, len, pos + (off_t)sizeof(header)) != (ssize_t)len) {
+            free(body);
+            break; // torn tail: this group never committed
+        }
+        uint32_t *blocks = (uint32_t *)body;
+        unsigned char *images = body + (size_t)header.numBlocks * sizeof(uint32_t);
+        if (journalChecksum(0xCBF29CE484222325ull, body, len) != header.checksum) {
+            free(body);
+            break;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (st.st_size < (off_t)header.fileBlocks * IMAGE_BLOCK_SIZE
+                && ftruncate(fd, (off_t)header.fileBlocks * IMAGE_BLOCK_SIZE) != 0)) {
+            free(body);
+            return -1;
+        }
+        for (uint32_t k = 0; k < header.numBlocks; k++) {
+            if (blocks[k] >= header.fileBlocks || pwrite(fd, images + (size_t)k * IMAGE_BLOCK_SIZE, IMAGE_BLOCK_SIZE,
+                    (off_t)blocks[k] * IMAGE_BLOCK_SIZE) != IMAGE_BLOCK_SIZE) {
+                free(body);
+                return -1;
+            }
+        }
+        free(body);
+        pos += (off_t)(sizeof(header) + len);
+        replayed++;
+    }
+
+    if (fdatasync(fd) != 0 || ftruncate(journalFd, 0) != 0 || fdatasync(journalFd) != 0) {
+        return -1;
+    }
+    return replayed;
+}
+
+// Start journaling an open image whose metadata is the first `metaBlocks` blocks
+static struct Journal *journalCreate(int journalFd, uint32_t metaBlocks) {
+    struct Journal *journal = calloc(1, sizeof(struct Journal));
+    if (journal == NULL) {
+        return NULL;
+    }
+    journal->fd = journalFd;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (journalReserve(journal, metaBlocks) != 0) {
+        pthread_cond_destroy(&journal->wake);
+        free(journal->dirtyMap);
+        free(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+static void journalDestroy(struct Journal *journal) {
+    pthread_cond_destroy(&journal->wake);
+    close(journal->fd);
+    free(journal->dirtyMap);
+    free(journal->dirtyBlocks);
+    free(journal);
+}
+
+// Lay out an empty file system over an image of `numBlocks` blocks. A catalog
+// (IMAGE_CATALOG in `flags`) gets only the superblock and the inode table.
+static int imageFormat(int fd, uint32_t numBlocks, uint32_t flags) {
+    uint32_t numInodes = numBlocks / 4;
+    uint32_t inodeBlocks = (numInodes * sizeof(struct DiskInode) + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    uint32_t bitmapBlocks = (numBlocks / 8 + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    uint32_t sharesBlocks = (numBlocks * sizeof(uint16_t) + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+    if (flags & IMAGE_CATALOG) {
+        numInodes = IMAGE_CATALOG_MIN_INODES;
+        inodeBlocks = (numInodes * sizeof(struct DiskInode) + IMAGE_BLOCK_SIZE - 1) / IMAGE_BLOCK_SIZE;
+        bitmapBlocks = 0;
+        sharesBlocks = 0;
+        numBlocks = 1 + inodeBlocks;
+    }
+
+    if (ftruncate(fd, (off_t)numBlocks * IMAGE_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    unsigned char *base = mmap(NULL, (size_t)numBlocks * IMAGE_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    struct Image img;
+    memset(&img, 0, sizeof(img)); // no journal while formatting
+    img.base = base;
+    img.super = (struct DiskSuperblock *)base;
+    img.super->magic = IMAGE_MAGIC;
+    img.super->version = IMAGE_VERSION;
+    img.super->blockSize = IMAGE_BLOCK_SIZE;
+    img.super->numBlocks = numBlocks;
+    img.super->numInodes = numInodes;
+    img.super->inodeTableStart = 1;
+    img.super->bitmapStart = 1 + inodeBlocks;
+    img.super->sharesStart = sharesBlocks ? img.super->bitmapStart + bitmapBlocks : 0;
+    img.super->dataStart = img.super->bitmapStart + bitmapBlocks + sharesBlocks;
+    img.super->freeBlocks = numBlocks;
+    img.super->freeInodes = numInodes - 1;
+    img.super->flags = flags;
+
+    // Inode 0 is the root directory
+    struct DiskInode *root = imageBlock(&img, img.super->inodeTableStart);
+    root->flags = IMAGE_INODE_USED | IMAGE_INODE_DIR;
+    root->mtime = (uint32_t)time(NULL);
+
+    // The metadata region is permanently allocated
+    if (flags & IMAGE_CATALOG) {
+        img.super->freeBlocks = 0;
+    } else {
+        img.bitmap = imageBlock(&img, img.super->bitmapStart);
+        imageMarkRun(&img, 0, img.super->dataStart, true);
+    }
+
+    munmap(base, (size_t)numBlocks * IMAGE_BLOCK_SIZE);
+    return 0;
+}
+
+static void imageClose(struct Image *img);
+
+// Map the image (or, with IMAGE_CATALOG, the catalog) at `path`, formatting a new one
+// if it does not exist yet and replaying its journal otherwise. Nothing is read beyond
+// the superblock, and the snapshot store if there is one.
+static struct Image *imageOpen(const char *path, uint32_t flags) {
+    char journalPath[PATH_MAX];
+    if (snprintf(journalPath, sizeof(journalPath), "%s.journal", path) >= (int)sizeof(journalPath)) {
+        fprintf(output(), "Image path '%s' is too long.\n", path);
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(output(), "Failed to open image '%s'.\n", path);
+        return NULL;
+    }
+    int journalFd = open(journalPath, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journalFd < 0) {
+        fprintf(output(), "Failed to open journal '%s'.\n", journalPath);
+        close(fd);
+        return NULL;
+    }
+
+    // A new image starts with an empty journal; an existing one first gets its committed
+    // transactions back
+    struct stat st;
+    int formatted = fstat(fd, &st) == 0 && st.st_size == 0;
+    if (fstat(fd, &st) != 0 || (formatted && (imageFormat(fd, IMAGE_DEFAULT_BLOCKS, flags) != 0 || ftruncate(journalFd, 0) != 0))) {
+        fprintf(output(), "Failed to format image '%s'.\n", path);
+        close(journalFd);
+        close(fd);
+        return NULL;
+    }
+    int replayed = formatted ? 0 : journalReplay(fd, journalFd);
+    if (replayed < 0 || fstat(fd, &st) != 0) {
+        fprintf(output(), "Failed to replay journal '%s'.\n", journalPath);
+        close(journalFd);
+        close(fd);
+        return NULL;
+    }
+    if (replayed > 0) {
+        fprintf(output(), "Replayed %d journal transaction%s into '%s'.\n", replayed, replayed == 1 ? "" : "s", path);
+    }
+
+    unsigned char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(output(), "Failed to map image '%s'.\n", path);
+        close(journalFd);
+        close(fd);
+        return NULL;
+    }
+
+    // The metadata is remapped private: changes stay in memory until the journal has them
+    struct DiskSuperblock *super = (struct DiskSuperblock *)base;
+    int valid = false;
+    if ((size_t)st.st_size >= sizeof(*super) && super->magic == IMAGE_MAGIC
+            && (super->version < IMAGE_VERSION_MIN || super->version > IMAGE_VERSION)) {
+        fprintf(output(), "Image '%s' has format version %u; this build reads versions %d to %d.\n", path, super->version,
+                IMAGE_VERSION_MIN, IMAGE_VERSION);
+    } else if ((size_t)st.st_size < sizeof(*super) || super->magic != IMAGE_MAGIC || super->blockSize != IMAGE_BLOCK_SIZE
+            || (super->flags & IMAGE_CATALOG) != (flags & IMAGE_CATALOG)
+            || (off_t)super->numBlocks * IMAGE_BLOCK_SIZE != st.st_size || super->dataStart > super->numBlocks
+            || (super->sharesStart != 0 && (super->version < 6 || super->sharesStart >= super->dataStart))
+            || super->orphans >= super->numInodes) {
+        fprintf(output(), "'%s' is not a valid file system %s.\n", path, (flags & IMAGE_CATALOG) ? "catalog" : "image");
+    } else if (mmap(base, (size_t)super->dataStart * IMAGE_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        fprintf(output(), "Failed to map image '%s'.\n", path);
+    } else {
+        valid = true;
+    }
+
+    struct Image *img = valid ? malloc(sizeof(struct Image)) : NULL;
+    struct Journal *journal = img != NULL ? journalCreate(journalFd, super->dataStart) : NULL;
+    if (journal == NULL) {
+        if (valid) {
+            fprintf(output(), "Memory allocation failed.\n");
+        }
+        free(img);
+        munmap(base, st.st_size);
+        close(journalFd);
+        close(fd);
+        return NULL;
+    }
+    img->fd = fd;
+    img->base = base;
+    img->size = st.st_size;
+    img->super = super;
+    img->inodes = imageBlock(img, super->inodeTableStart);
+    img->bitmap = (flags & IMAGE_CATALOG) ? NULL : imageBlock(img, super->bitmapStart);
+    for (int c = 0; c < IMAGE_SIZE_CLASSES; c++) {
+        img->allocHint[c] = super->dataStart;
+    }
+    img->inodeHint = 1;
+    img->journal = journal;
+    img->compress = false;
+    img->shares = super->sharesStart != 0 ? imageBlock(img, super->sharesStart) : NULL;
+    img->dedup = NULL;
+    img->snapshots = NULL;
+    img->pinned = NULL;
+    img->pinnedEpoch = NULL;
+    img->epoch = 0;
+    img->snapshotPath = (flags & IMAGE_CATALOG) ? NULL : malloc(strlen(path) + sizeof(".snapshots"));
+    if (img->snapshotPath != NULL) {
+        sprintf(img->snapshotPath, "%s.snapshots", path);
+    }
+    if (!(flags & IMAGE_CATALOG) && (img->snapshotPath == NULL || snapshotAttach(img, false) != 0)) {
+        fprintf(output(), "Failed to open the snapshots of image '%s'.\n", path);
+        imageClose(img);
+        return NULL;
+    }
+    return img;
+}
+
+// Commit and checkpoint the journal, flush the data and release the image
+static void imageClose(struct Image *img) {
+    if (journalCommit(img) != 0 || journalCheckpoint(img) != 0) {
+        fprintf(output(), "Failed to write back image metadata; it will be recovered from the journal.\n");
+    }
+    msync(img->base, img->size, MS_SYNC);
+    munmap(img->base, img->size);
+    journalDestroy(img->journal);
+    dedupDestroy(img->dedup);
+    snapshotDestroy(img->snapshots);
+    free(img->snapshotPath);
+    free(img->pinned);
+    free(img->pinnedEpoch);
+    close(img->fd);
+    free(img);
+}
+
+// Buffer cache
+//
+// Host-mode file data is cached in CACHE_BLOCK_SIZE blocks keyed by (file, block index).
+// Blocks sit on an LRU list (head = most recently used); when the memory budget is
+// reached the tail is evicted, writing it back first if it is dirty. Writes only dirty
+// the cached block; a background thread writes dirty blocks back to the host file
+// every CACHE_WRITEBACK_INTERVAL_MS, or sooner once half the cache is dirty.
+// Each dirty block remembers the host path it belongs to, so callers flush a file's
+// blocks before renaming it.
+
+static unsigned int cacheBucket(uint32_t ino, uint32_t index) {
+    return (unsigned int)((ino * 0x9E3779B1u) ^ (index * 0x85EBCA77u)) & (CACHE_HASH_BUCKETS - 1);
+}
+
+static void cacheUnlinkLru(struct BufferCache *cache, struct CacheBlock *block) {
+    if (block->lruPrev != NULL) {
+        block->lruPrev->lruNext = block->lruNext;
+    } else {
+        cache->lruHead = block->lruNext;
+    }
+    if (block->lruNext != NULL) {
+        block->lruNext->lruPrev = block->lruPrev;
+    } else {
+        cache->lruTail = block->lruPrev;
+    }
+}
+
+static void cachePushLru(struct BufferCache *cache, struct CacheBlock *block) {
+    block->lruPrev = NULL;
+    block->lruNext = cache->lruHead;
+    if (cache->lruHead != NULL) {
+        cache->lruHead->lruPrev = block;
+    } else {
+        cache->lruTail = block;
+    }
+    cache->lruHead = block;
+}
+
+static struct CacheBlock *cacheFind(struct BufferCache *cache, uint32_t ino, uint32_t index) {
+    for (struct CacheBlock *block = cache->buckets[cacheBucket(ino, index)]; block != NULL; block = block->hashNext) {
+        if (block->ino == ino && block->index == index) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+// Write one dirty block back to its host file. Called with the cache lock held.
+static int cacheWriteBack(struct BufferCache *cache, struct CacheBlock *block) {
+    int fd = open(block->path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = pwrite(fd, block->data, block->len, (off_t)block->index * CACHE_BLOCK_SIZE);
+    close(fd);
+    if (written != (ssize_t)block->len) {
+        return -1;
+    }
+    block->dirty = false;
+    cache->numDirty--;
+    cache->writebacks++;
+    return 0;
+}
+
+// Drop a block from the cache without writing it back
+static void cacheDrop(struct BufferCache *cache, struct CacheBlock *block) {
+    struct CacheBlock **link = &cache->buckets[cacheBucket(block->ino, block->index)];
+    while (*link != block) {
+        link = &(*link)->hashNext;
+    }
+    *link = block->hashNext;
+    cacheUnlinkLru(cache, block);
+    if (block->dirty) {
+        cache->numDirty--;
+    }
+    cache->numBlocks--;
+    free(block);
+}
+
+// Return the cached block for (ino, index), creating an empty one if needed.
+// Evicts from the LRU tail to stay within budget. Called with the cache lock held.
+static struct CacheBlock *cacheGet(struct BufferCache *cache, uint32_t ino, uint32_t index, int *created) {
+    struct CacheBlock *block = cacheFind(cache, ino, index);
+    if (block != NULL) {
+        cacheUnlinkLru(cache, block);
+        cachePushLru(cache, block);
+        *created = false;
+        return block;
+    }
+
+    while (cache->numBlocks >= cache->maxBlocks && cache->lruTail != NULL) {
+        struct CacheBlock *victim = cache->lruTail;
+        if (victim->dirty && cacheWriteBack(cache, victim) != 0) {
+            fprintf(output(), "Failed to write back '%s'.\n", victim->path);
+        }
+        cacheDrop(cache, victim);
+        cache->evictions++;
+    }
+
+    block = malloc(sizeof(struct CacheBlock));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->ino = ino;
+    block->index = index;
+    block->dirty = false;
+    block->len = 0;
+    block->path[0] = '\0';
+    unsigned int b = cacheBucket(ino, index);
+    block->hashNext = cache->buckets[b];
+    cache->buckets[b] = block;
+    cachePushLru(cache, block);
+    cache->numBlocks++;
+    *created = true;
+    return block;
+}
+
+// Background write-back loop
+static void *cacheWriter(void *arg) {
+    struct BufferCache *cache = arg;
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CACHE_WRITEBACK_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&cache->wake, &cache->lock, &deadline);
+
+        // Oldest blocks first
+        for (struct CacheBlock *block = cache->lruTail; block != NULL && cache->numDirty > 0; block = block->lruPrev) {
+            if (block->dirty && cacheWriteBack(cache, block) != 0) {
+                fprintf(output(), "Failed to write back '%s'.\n", block->path);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+// Create a cache holding up to `budget` bytes of file data; NULL when budget is 0
+struct BufferCache *cacheCreate(size_t budget) {
+    if (budget < CACHE_BLOCK_SIZE) {
+        return NULL;
+    }
+    struct BufferCache *cache = calloc(1, sizeof(struct BufferCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->maxBlocks = budget / CACHE_BLOCK_SIZE;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->wake, NULL);
+    if (pthread_create(&cache->writer, NULL, cacheWriter, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Copy up to CACHE_BLOCK_SIZE bytes of block `index` of a host file into `out`,
+// reading it from `path` on a miss. Returns the number of valid bytes, or -1.
+static ssize_t cacheRead(struct BufferCache *cache, uint32_t ino, const char *path, uint32_t index, void *out) {
+    int created;
+    pthread_mutex_lock(&cache->lock);
+    struct CacheBlock *block = cacheGet(cache, ino, index, &created);
+    if (block == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    if (created) {
+        cache->misses++;
+        int fd = open(path, O_RDONLY);
+        ssize_t got = fd < 0 ? -1 : pread(fd, block->data, CACHE_BLOCK_SIZE, (off_t)index * CACHE_BLOCK_SIZE);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (got < 0) {
+            cacheDrop(cache, block);
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+        block->len = (size_t)got;
+    } else {
+        cache->hits++;
+    }
+    size_t len = block->len;
+    memcpy(out, block->data, len);
+    pthread_mutex_unlock(&cache->lock);
+    return (ssize_t)len;
+}
+
+// Replace block `index` of a host file with `len` bytes and mark it dirty
+static int cacheWrite(struct BufferCache *cache, uint32_t ino, const char *path, uint32_t index, const void *data, size_t len) {
+    int created;
+    pthread_mutex_lock(&cache->lock);
+    struct CacheBlock *block = cacheGet(cache, ino, index, &created);
+    if (block == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    memcpy(block->data, data, len);
+    block->len = len;
+    snprintf(block->path, sizeof(block->path), "%s", path);
+    if (!block->dirty) {
+        block->dirty = true;
+        cache->numDirty++;
+    }
+    if (cache->numDirty * 2 >= cache->maxBlocks) {
+        pthread_cond_signal(&cache->wake);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+// Write back (flush) and/or forget (invalidate) every cached block of a file
+static void cacheSyncFile(struct BufferCache *cache, uint32_t ino, int flush, int invalidate) {
+    pthread_mutex_lock(&cache->lock);
+    struct CacheBlock *block = cache->lruHead;
+    while (block != NULL) {
+        struct CacheBlock *next = block->lruNext;
+        if (block->ino == ino) {
+            if (flush && block->dirty && cacheWriteBack(cache, block) != 0) {
+                fprintf(output(), "Failed to write back '%s'.\n", block->path);
+            }
+            if (invalidate) {
+                cacheDrop(cache, block);
+            }
+        }
+        block = next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Forget, without writing them back, the blocks written to files below the host
+// directory `dirPath` (blocks only read carry no path)
+static void cacheDropTree(struct BufferCache *cache, const char *dirPath) {
+    size_t len = strlen(dirPath);
+    pthread_mutex_lock(&cache->lock);
+    struct CacheBlock *block = cache->lruHead;
+    while (block != NULL) {
+        struct CacheBlock *next = block->lruNext;
+        if (strncmp(block->path, dirPath, len) == 0 && block->path[len] == '/') {
+            cacheDrop(cache, block);
+        }
+        block = next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int compareInos(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Forget every block of the files numbered in inos[] (sorted), in one pass
+static void cacheDropFiles(struct BufferCache *cache, const uint32_t *inos, size_t count) {
+    pthread_mutex_lock(&cache->lock);
+    struct CacheBlock *block = cache->lruHead;
+    while (block != NULL) {
+        struct CacheBlock *next = block->lruNext;
+        if (bsearch(&block->ino, inos, count, sizeof(uint32_t), compareInos) != NULL) {
+            cacheDrop(cache, block);
+        }
+        block = next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Write back every dirty block
+static void cacheFlushAll(struct BufferCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    for (struct CacheBlock *block = cache->lruTail; block != NULL; block = block->lruPrev) {
+        if (block->dirty && cacheWriteBack(cache, block) != 0) {
+            fprintf(output(), "Failed to write back '%s'.\n", block->path);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Flush everything, stop the writer thread and free the cache
+void cacheDestroy(struct BufferCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = true;
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->writer, NULL);
+
+    cacheFlushAll(cache);
+    while (cache->lruHead != NULL) {
+        cacheDrop(cache, cache->lruHead);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->wake);
+    free(cache);
+}
+
+
+// Catalog storage
+//
+// Names, parents and sizes persist in sb->catalog: the disk image itself, or in host mode
+// a catalog file beside the data. Without a catalog, host-mode inode numbers come from
+// nextHostIno and the namespace is forgotten when the process exits.
+
+// Called as each metadata operation starts: commits the group gathered so far once it
+// is full or old enough (see the metadata journal)
+static void journalOperation(struct Superblock *sb) {
+    struct Journal *journal = sb->catalog != NULL ? sb->catalog->journal : NULL;
+    if (journal == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&sb->catalogLock);
+    long ageMs = (now.tv_sec - journal->groupStart.tv_sec) * 1000 + (now.tv_nsec - journal->groupStart.tv_nsec) / 1000000;
+    if (journal->numOps > 0 && (journal->numOps >= JOURNAL_GROUP_OPS || ageMs >= JOURNAL_GROUP_MS)) {
+        journalCommit(sb->catalog);
+    }
+    if (journal->numOps++ == 0) {
+        journal->groupStart = now;
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+}
+
+// Commit each group whose first change is JOURNAL_GROUP_MS old. Every operation holds
+// sb->treeLock while it changes metadata, so taking it exclusively lets the operations
+// under way finish first and the group never holds half of one.
+static void *journalCommitter(void *arg) {
+    struct Superblock *sb = arg;
+    struct Journal *journal = sb->catalog->journal;
+    pthread_mutex_lock(&sb->catalogLock);
+    while (!journal->stop) {
+        if (journal->numDirty == 0) {
+            pthread_cond_wait(&journal->wake, &sb->catalogLock);
+            continue;
+        }
+        struct timespec due = journal->dirtySince, now;
+        due.tv_nsec += (long)JOURNAL_GROUP_MS * 1000000;
+        due.tv_sec += due.tv_nsec / 1000000000;
+        due.tv_nsec %= 1000000000;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec)) {
+            pthread_cond_timedwait(&journal->wake, &sb->catalogLock, &due);
+            continue;
+        }
+        pthread_mutex_unlock(&sb->catalogLock);
+        pthread_rwlock_wrlock(&sb->treeLock);
+        pthread_mutex_lock(&sb->catalogLock);
+        if (!journal->stop) {
+            journalCommit(sb->catalog);
+        }
+        pthread_rwlock_unlock(&sb->treeLock);
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    return NULL;
+}
+
+// Start the committer of a catalog being attached; without it groups still commit as
+// operations start
+static void journalStartCommitter(struct Superblock *sb) {
+    struct Journal *journal = sb->catalog->journal;
+    journal->stop = false;
+    journal->running = pthread_create(&journal->committer, NULL, journalCommitter, sb) == 0;
+}
+
+// Stop the committer before the catalog is closed; the open group is left to the close
+static void journalStopCommitter(struct Superblock *sb) {
+    struct Journal *journal = sb->catalog->journal;
+    pthread_mutex_lock(&sb->catalogLock);
+    journal->stop = true;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (journal->running) {
+        pthread_join(journal->committer, NULL);
+        journal->running = false;
+    }
+}
+
+// Allocate a catalog inode for a new file (type 0) or directory (IMAGE_INODE_DIR)
+static int catalogAllocInode(struct Superblock *sb, const char *name, uint32_t parent, uint32_t type, uint32_t *ino) {
+    pthread_mutex_lock(&sb->catalogLock);
+    if (sb->catalog != NULL) {
+        if (sb->image != NULL) {
+            imageMakeRoom(sb->image, 0);
+        }
+        *ino = imageAllocInode(sb->catalog, name, parent, type);
+    } else {
+        *ino = type == IMAGE_INODE_DIR ? 0 : sb->nextHostIno++;
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    return *ino != 0 || sb->catalog == NULL ? 0 : -1;
+}
+
+// Release a catalog inode; in image mode this frees the file's data too
+static void catalogFreeInode(struct Superblock *sb, uint32_t ino) {
+    if (sb->catalog != NULL) {
+        pthread_mutex_lock(&sb->catalogLock);
+        imageFreeInode(sb->catalog, ino);
+        pthread_mutex_unlock(&sb->catalogLock);
+    }
+}
+
+// Take a removed file or directory out of its parent's catalog entries and leave it,
+// with its data and any entries of its own, for the reclaimer to free
+static void catalogOrphanInode(struct Superblock *sb, uint32_t ino) {
+    if (sb->catalog != NULL) {
+        pthread_mutex_lock(&sb->catalogLock);
+        imageOrphanInode(sb->catalog, ino);
+        pthread_mutex_unlock(&sb->catalogLock);
+    }
+}
+
+static void catalogRenameInode(struct Superblock *sb, uint32_t ino, const char *name) {
+    if (sb->catalog != NULL) {
+        pthread_mutex_lock(&sb->catalogLock);
+        imageRenameInode(sb->catalog, ino, name);
+        pthread_mutex_unlock(&sb->catalogLock);
+    }
+}
+
+// A file's contents have changed: stamp it with the current time and record that, and
+// a host file's new size, in the catalog (image mode keeps sizes in the image already)
+static void catalogFileChanged(struct Superblock *sb, struct Inode *inode) {
+    inode->mtime = (int64_t)time(NULL);
+    if (sb->catalog != NULL) {
+        pthread_mutex_lock(&sb->catalogLock);
+        struct DiskInode *disk = &sb->catalog->inodes[inode->ino];
+        if (sb->image == NULL) {
+            disk->size = (uint64_t)inode->size;
+        }
+        disk->mtime = (uint32_t)inode->mtime;
+        imageDirtyInode(sb->catalog, inode->ino);
+        pthread_mutex_unlock(&sb->catalogLock);
+    }
+}
+
+// Host data helpers
+
+// Replace the contents of a host file, through the buffer cache when there is one
+static int hostWriteFile(struct Superblock *sb, struct Inode *inode, const char *path, const char *data, size_t len) {
+    if (sb->cache == NULL) {
+        FILE *file = fopen(path, "w");
+        if (file == NULL) {
+            return -1;
+        }
+        size_t written = fwrite(data, 1, len, file);
+        fclose(file);
+        if (written != len) {
+            return -1;
+        }
+        inode->size = (int64_t)len;
+        catalogFileChanged(sb, inode);
+        return 0;
+    }
+
+    // The old blocks are being replaced, so drop them instead of writing them back
+    cacheSyncFile(sb->cache, inode->ino, false, true);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int sized = ftruncate(fd, (off_t)len);
+    close(fd);
+    if (sized != 0) {
+        return -1;
+    }
+    for (size_t pos = 0; pos < len; pos += CACHE_BLOCK_SIZE) {
+        size_t chunk = len - pos < CACHE_BLOCK_SIZE ? len - pos : CACHE_BLOCK_SIZE;
+        if (cacheWrite(sb->cache, inode->ino, path, (uint32_t)(pos / CACHE_BLOCK_SIZE), data + pos, chunk) != 0) {
+            return -1;
+        }
+    }
+    inode->size = (int64_t)len;
+    catalogFileChanged(sb, inode);
+    return 0;
+}
+
+// Write bytes [offset, offset + length) of a host file to fd. Ranges that fit comfortably
+// in the buffer cache are served from it; larger ones skip it (after flushing the file's
+// dirty blocks) and go through sendfile, or a single mmap + write where sendfile cannot
+// reach fd. Returns bytes written, or -1.
+static long hostReadRange(struct Superblock *sb, struct Inode *inode, const char *path, uint64_t offset, uint64_t length, int fd) {
+    if (sb->cache != NULL) {
+        uint64_t size = (uint64_t)inode->size;
+        uint64_t end = offset >= size ? offset : (size - offset < length ? size : offset + length);
+
+        if ((end - offset) * 4 <= sb->cache->maxBlocks * CACHE_BLOCK_SIZE) {
+            unsigned char *buffer;
+            if (posix_memalign((void **)&buffer, CACHE_BLOCK_SIZE, READ_BUFFER_SIZE) != 0) {
+                return -1;
+            }
+            size_t filled = 0;
+            uint64_t pos = offset;
+            while (pos < end) {
+                // Read a whole block into the staging buffer, then keep just the requested slice
+                if (filled + CACHE_BLOCK_SIZE > READ_BUFFER_SIZE) {
+                    if (writeAll(fd, buffer, filled) != 0) {
+                        free(buffer);
+                        return -1;
+                    }
+                    filled = 0;
+                }
+                ssize_t got = cacheRead(sb->cache, inode->ino, path, (uint32_t)(pos / CACHE_BLOCK_SIZE), buffer + filled);
+                size_t within = pos % CACHE_BLOCK_SIZE;
+                if (got < 0) {
+                    free(buffer);
+                    return -1;
+                }
+                if ((size_t)got <= within) {
+                    break; // host file is shorter than the catalog thinks
+                }
+                size_t chunk = (size_t)got - within < end - pos ? (size_t)got - within : (size_t)(end - pos);
+                memmove(buffer + filled, buffer + filled + within, chunk);
+                filled += chunk;
+                pos += chunk;
+            }
+            int failed = writeAll(fd, buffer, filled) != 0;
+            free(buffer);
+            return failed ? -1 : (long)(pos - offset);
+        }
+        cacheSyncFile(sb->cache, inode->ino, true, false);
+    }
+
+    int in = open(path, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return -1;
+    }
+    if (offset >= (uint64_t)st.st_size) {
+        close(in);
+        return 0;
+    }
+    uint64_t remaining = (uint64_t)st.st_size - offset < length ? (uint64_t)st.st_size - offset : length;
+    uint64_t total = remaining;
+
+    // sendfile keeps the data in the kernel
+    off_t pos = (off_t)offset;
+    while (remaining > 0) {
+        ssize_t n = sendfile(fd, in, &pos, remaining);
+        if (n <= 0) {
+            break;
+        }
+        remaining -= (uint64_t)n;
+    }
+
+    // Otherwise map the rest of the range and hand it to a single write
+    if (remaining > 0) {
+        off_t mapStart = pos & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        size_t mapLength = (size_t)(pos - mapStart) + remaining;
+        unsigned char *map = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, in, mapStart);
+        if (map != MAP_FAILED) {
+            madvise(map, mapLength, MADV_SEQUENTIAL);
+            if (writeAll(fd, map + (pos - mapStart), remaining) == 0) {
+                remaining = 0;
+            }
+            munmap(map, mapLength);
+        }
+    }
+    close(in);
+    return remaining == 0 ? (long)total : -1;
+}
+
+// Copy a host file inside the kernel: copy_file_range, then sendfile, then read/write.
+// Returns the number of bytes copied, or -1.
+static long hostCopyFile(struct Superblock *sb, struct Inode *srcFile, const char *srcPath, uint32_t destIno, const char *destPath) {
+    if (sb->cache != NULL) {
+        // The host copy must see cached writes, and the destination's cached blocks go stale
+        cacheSyncFile(sb->cache, srcFile->ino, true, false);
+        cacheSyncFile(sb->cache, destIno, false, true);
+    }
+
+    int in = open(srcPath, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(destPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    struct stat st;
+    long copied = fstat(in, &st) == 0 ? 0 : -1;
+    int method = 0; // 0 copy_file_range, 1 sendfile, 2 read/write
+    while (copied >= 0 && copied < st.st_size) {
+        ssize_t n;
+        if (method == 0) {
+            n = copy_file_range(in, NULL, out, NULL, st.st_size - copied, 0);
+        } else if (method == 1) {
+            n = sendfile(out, in, NULL, st.st_size - copied);
+        } else {
+            char buffer[65536];
+            n = read(in, buffer, sizeof(buffer));
+            if (n > 0 && write(out, buffer, n) != n) {
+                n = -1;
+            }
+        }
+        if (n < 0 && method < 2 && copied == 0) {
+            method++; // not supported here (e.g. across file systems); try the next method
+            continue;
+        }
+        if (n <= 0) {
+            copied = n < 0 ? -1 : copied;
+            break;
+        }
+        copied += n;
+    }
+
+    close(in);
+    close(out);
+    return copied;
+}
+
+// Read up to `len` bytes at `offset` of a host file opened through a handle, from the
+// buffer cache when there is one. Returns bytes read, or -1.
+static long hostPread(struct Superblock *sb, struct OpenFile *file, void *buf, size_t len, uint64_t offset) {
+    uint64_t size = (uint64_t)file->inode->size;
+    if (offset >= size) {
+        return 0;
+    }
+    if (size - offset < len) {
+        len = (size_t)(size - offset);
+    }
+    if (sb->cache == NULL) {
+        return (long)pread(file->hostFd, buf, len, (off_t)offset);
+    }
+
+    unsigned char block[CACHE_BLOCK_SIZE];
+    unsigned char *dst = buf;
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        size_t within = pos % CACHE_BLOCK_SIZE;
+        size_t chunk = CACHE_BLOCK_SIZE - within < len - done ? CACHE_BLOCK_SIZE - within : len - done;
+        ssize_t got = cacheRead(sb->cache, file->inode->ino, file->path, (uint32_t)(pos / CACHE_BLOCK_SIZE), block);
+        if (got < 0) {
+            return -1;
+        }
+        // A gap before blocks that are not written back yet reads as zeros
+        if ((size_t)got < within + chunk) {
+            memset(block + got, 0, within + chunk - (size_t)got);
+        }
+        memcpy(dst + done, block + within, chunk);
+        done += chunk;
+    }
+    return (long)done;
+}
+
+// Write `len` bytes at `offset` of a host file opened through a handle. With the buffer
+// cache only the blocks touched are replaced (partial blocks are merged with their
+// current contents) and written back later. Returns bytes written, or -1.
+static long hostPwrite(struct Superblock *sb, struct OpenFile *file, const void *data, size_t len, uint64_t offset) {
+    const unsigned char *src = data;
+    size_t done = 0;
+
+    while (done < len) {
+        uint64_t pos = offset + done;
+        if (sb->cache == NULL) {
+            ssize_t n = pwrite(file->hostFd, src + done, len - done, (off_t)pos);
+            if (n <= 0) {
+                return -1;
+            }
+            done += (size_t)n;
+            continue;
+        }
+
+        unsigned char block[CACHE_BLOCK_SIZE];
+        uint32_t index = (uint32_t)(pos / CACHE_BLOCK_SIZE);
+        size_t within = pos % CACHE_BLOCK_SIZE;
+        size_t chunk = CACHE_BLOCK_SIZE - within < len - done ? CACHE_BLOCK_SIZE - within : len - done;
+        size_t blockLen = within + chunk;
+        if (blockLen < CACHE_BLOCK_SIZE || within > 0) {
+            ssize_t got = cacheRead(sb->cache, file->inode->ino, file->path, index, block);
+            if (got < 0) {
+                return -1;
+            }
+            if ((size_t)got < within) {
+                memset(block + got, 0, within - (size_t)got);
+            }
+            if ((size_t)got > blockLen) {
+                blockLen = (size_t)got;
+            }
+        }
+        memcpy(block + within, src + done, chunk);
+        if (cacheWrite(sb->cache, file->inode->ino, file->path, index, block, blockLen) != 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+    if (offset + len > (uint64_t)file->inode->size) {
+        file->inode->size = (int64_t)(offset + len);
+    }
+    catalogFileChanged(sb, file->inode);
+    return (long)len;
+}
+
+// Set the length of a host file opened through a handle
+static int hostTruncate(struct Superblock *sb, struct OpenFile *file, uint64_t size) {
+    if (sb->cache != NULL) {
+        // Blocks past the new end must not be written back over it
+        cacheSyncFile(sb->cache, file->inode->ino, true, true);
+        if (truncate(file->path, (off_t)size) != 0) {
+            return -1;
+        }
+    } else if (ftruncate(file->hostFd, (off_t)size) != 0) {
+        return -1;
+    }
+    file->inode->size = (int64_t)size;
+    catalogFileChanged(sb, file->inode);
+    return 0;
+}
+
+// Batched host I/O
+//
+// Bulk commands (rm and cp of several files, rmdir of a tree, cat of several files) hand
+// their host file operations over as one batch instead of one blocking call at a time.
+// Where io_uring is available, unlinks and prefetches go through a ring: up to
+// IO_RING_ENTRIES operations are in flight at once, and a prefetch is driven through its
+// open, fadvise and close stages as each one completes. Copies (io_uring has no
+// copy_file_range) and every operation on kernels without io_uring are spread over a pool
+// of IO_MAX_THREADS threads instead. Requests only touch the host; the caller applies
+// the results to the catalog afterwards, in request order.
+
+static int ioRingUsable;
+static pthread_once_t ioRingProbed = PTHREAD_ONCE_INIT;
+
+static void ioRingClose(struct IoRing *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+static int ioRingOpen(struct IoRing *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqRingSize = ring->cqRingSize > ring->sqRingSize ? ring->cqRingSize : ring->sqRingSize;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cqRing = ring->sqRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// io_uring is used only when the kernel allows it (containers often filter it out) and
+// supports every operation the batches need
+static void ioRingProbe(void) {
+    struct IoRing ring;
+    if (ioRingOpen(&ring) != 0) {
+        return;
+    }
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe != NULL && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        const int needed[] = {IORING_OP_UNLINKAT, IORING_OP_OPENAT, IORING_OP_FADVISE, IORING_OP_CLOSE};
+        ioRingUsable = true;
+        for (size_t k = 0; k < sizeof(needed) / sizeof(needed[0]); k++) {
+            if (needed[k] > probe->last_op || !(probe->ops[needed[k]].flags & IO_URING_OP_SUPPORTED)) {
+                ioRingUsable = false;
+            }
+        }
+    }
+    free(probe);
+    ioRingClose(&ring);
+}
+
+// Fill in the submission for the request's current stage
+static void ioRingPrepare(struct io_uring_sqe *sqe, struct IoRequest *req, int r) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)r;
+    if (req->op != IO_PREFETCH) {
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)req->path;
+        sqe->unlink_flags = req->op == IO_RMDIR ? AT_REMOVEDIR : 0;
+    } else if (req->stage == 0) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)req->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    } else if (req->stage == 1) {
+        sqe->opcode = IORING_OP_FADVISE;
+        sqe->fd = req->fd;
+        sqe->fadvise_advice = POSIX_FADV_WILLNEED; // offset and length 0: the whole file
+    } else {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = req->fd;
+    }
+}
+
+// Record a completion; returns true when the request has another stage to submit
+static int ioRingComplete(struct IoRequest *req, int res) {
+    if (req->op != IO_PREFETCH) {
+        req->result = res < 0 ? -1 : 0;
+        return false;
+    }
+    if (req->stage == 0) {
+        if (res < 0) {
+            return false;
+        }
+        req->fd = res;
+    } else if (req->stage == 1) {
+        req->result = res < 0 ? -1 : 0;
+    } else {
+        req->fd = -1;
+        return false;
+    }
+    req->stage++;
+    return true;
+}
+
+// Keep the ring full until every request has run all of its stages. Returns -1 if the
+// ring fails part way; requests it did not finish keep result -1.
+static int ioRingRun(struct IoRing *ring, struct IoRequest *reqs, int count) {
+    int *again = malloc(count * sizeof(int)); // requests waiting to submit their next stage
+    if (again == NULL) {
+        return -1;
+    }
+    int next = 0, numAgain = 0, status = 0;
+    unsigned inFlight = 0; // submitted to the kernel and not yet completed
+
+    unsigned tail = *ring->sqTail;
+    while (next < count || numAgain > 0 || inFlight > 0 || tail != __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) {
+        unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        // Stay within the submission queue, and within what the completion queue can hold
+        while ((next < count || numAgain > 0) && tail - head < ring->entries && inFlight + (tail - head) < ring->entries) {
+            int r = numAgain > 0 ? again[--numAgain] : next++;
+            unsigned slot = tail & *ring->sqMask;
+            ioRingPrepare(&ring->sqes[slot], &reqs[r], r);
+            ring->sqArray[slot] = slot;
+            tail++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned queued = tail - head;
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            status = -1;
+            break;
+        }
+        inFlight += (unsigned)submitted;
+
+        unsigned cqHead = *ring->cqHead;
+        unsigned cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; cqHead != cqTail; cqHead++) {
+            struct io_uring_cqe *cqe = &ring->cqes[cqHead & *ring->cqMask];
+            int r = (int)cqe->user_data;
+            inFlight--;
+            if (ioRingComplete(&reqs[r], cqe->res)) {
+                again[numAgain++] = r;
+            }
+        }
+        __atomic_store_n(ring->cqHead, cqHead, __ATOMIC_RELEASE);
+    }
+    // The pool reruns unfinished prefetches with an open of their own: close the files
+    // opened here, except those whose close the ring already has
+    for (int r = 0; r < count && status != 0; r++) {
+        if (reqs[r].fd >= 0 && reqs[r].stage < 2) {
+            close(reqs[r].fd);
+            reqs[r].fd = -1;
+        }
+    }
+    free(again);
+    return status;
+}
+
+// Run one request on the calling thread
+static void ioRunOne(struct Superblock *sb, struct IoRequest *req) {
+    if (req->op == IO_UNLINK) {
+        req->result = unlink(req->path) == 0 ? 0 : -1;
+    } else if (req->op == IO_RMDIR) {
+        req->result = rmdir(req->path) == 0 ? 0 : -1;
+    } else if (req->op == IO_COPY) {
+        // Copying a file onto itself leaves it as it is
+        req->result = strcmp(req->path, req->destPath) == 0 ? 0 : hostCopyFile(sb, req->inode, req->path, req->destIno, req->destPath);
+    } else {
+        int fd = open(req->path, O_RDONLY | O_CLOEXEC);
+        req->result = fd >= 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0 ? 0 : -1;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+// The batch shared by the pool's threads, which take requests in order (skipping any
+// that already succeeded)
+struct IoPool {
+    struct Superblock *sb;
+    struct IoRequest *reqs;
+    int count;
+    int next;
+};
+
+static void *ioWorker(void *arg) {
+    struct IoPool *pool = arg;
+    int r;
+    while ((r = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        if (pool->reqs[r].result < 0) {
+            ioRunOne(pool->sb, &pool->reqs[r]);
+        }
+    }
+    return NULL;
+}
+
+//RUN A BATCH OF HOST I/O
+// Runs every request, filling in its result; returns once all of them have finished
+static void ioRunBatch(struct Superblock *sb, struct IoRequest *reqs, int count) {
+    int ringOps = true;
+    for (int r = 0; r < count; r++) {
+        reqs[r].stage = 0;
+        reqs[r].fd = -1;
+        reqs[r].result = -1;
+        ringOps &= reqs[r].op != IO_COPY;
+    }
+
+    struct IoPool pool = {sb, reqs, count, 0};
+    if (count < IO_BATCH_MIN) {
+        ioWorker(&pool);
+        return;
+    }
+
+    pthread_once(&ioRingProbed, ioRingProbe);
+    struct IoRing ring;
+    if (ringOps && ioRingUsable && ioRingOpen(&ring) == 0) {
+        int status = ioRingRun(&ring, reqs, count);
+        ioRingClose(&ring); // also drops anything the ring still had in flight
+        if (status == 0) {
+            return;
+        }
+        // Whatever the ring did not complete is run again on the pool
+        for (int r = 0; r < count; r++) {
+            if (reqs[r].fd >= 0) {
+                close(reqs[r].fd);
+                reqs[r].fd = -1;
+            }
+        }
+    }
+
+    // The calling thread takes its share too
+    pthread_t threads[IO_MAX_THREADS];
+    int numThreads = pool.count - 1 < IO_MAX_THREADS ? pool.count - 1 : IO_MAX_THREADS;
+    int started = 0;
+    while (started < numThreads && pthread_create(&threads[started], NULL, ioWorker, &pool) == 0) {
+        started++;
+    }
+    ioWorker(&pool);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Deferred deletion
+//
+// rm and rmdir only detach what they remove. A file leaves its directory's files[] by
+// taking the last file into its place. A directory tree leaves the tree, the dentry cache
+// and sb->directories one step per directory, however many files it holds, and its files
+// stay where they are until the reclaimer gets to them; in host mode its host directory
+// is first renamed into HOST_TRASH_DIR. In the catalog both go to the orphan list (see
+// orphans). Freeing all of that is the reclaimer's job: a background thread that works
+// RECLAIM_BATCH entries at a time and pauses RECLAIM_PAUSE_US between batches, so that
+// foreground operations never wait long for the locks it takes. Host files removed by rm
+// are still unlinked straight away, as one batch: that is what takes them off the host.
+
+static void *reclaimerMain(void *arg);
+
+// Have the reclaimer look for work, starting its thread on first use
+static void reclaimerWake(struct Superblock *sb) {
+    struct Reclaimer *reclaimer = sb->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    reclaimer->pending = true;
+    if (!reclaimer->running && !reclaimer->stop) {
+        reclaimer->running = pthread_create(&reclaimer->thread, NULL, reclaimerMain, sb) == 0;
+    }
+    pthread_cond_signal(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->lock);
+}
+
+// Stop the reclaimer's thread and wait for it; whatever is still queued stays queued
+static void reclaimerStop(struct Superblock *sb) {
+    struct Reclaimer *reclaimer = sb->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    __atomic_store_n(&reclaimer->stop, true, __ATOMIC_RELAXED);
+    int running = reclaimer->running;
+    reclaimer->running = false;
+    pthread_cond_signal(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->lock);
+    if (running) {
+        pthread_join(reclaimer->thread, NULL);
+    }
+    pthread_mutex_lock(&reclaimer->lock);
+    __atomic_store_n(&reclaimer->stop, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&reclaimer->lock);
+}
+
+// Host mode: move the directory at `path` into the trash. Returns -1, having moved
+// nothing, when it cannot be done.
+static int hostTrash(struct Superblock *sb, const char *path) {
+    static unsigned int sequence;
+    char trashPath[HOST_PATH_LENGTH];
+    snprintf(trashPath, sizeof(trashPath), "%s/%ld.%ld.%u", HOST_TRASH_DIR, (long)getpid(), (long)time(NULL),
+             __atomic_fetch_add(&sequence, 1, __ATOMIC_RELAXED));
+    if (rename(path, trashPath) != 0 && (errno != ENOENT || (mkdir(HOST_TRASH_DIR, 0755) != 0 && errno != EEXIST)
+            || rename(path, trashPath) != 0)) {
+        return -1;
+    }
+    // Blocks written to its files must not be written back to where they used to be
+    if (sb->cache != NULL) {
+        cacheDropTree(sb->cache, path);
+    }
+    pthread_mutex_lock(&sb->reclaimer->lock);
+    sb->reclaimer->trash = true;
+    pthread_mutex_unlock(&sb->reclaimer->lock);
+    return 0;
+}
+
+// Free a batch of the entries of detached trees: each directory's files, then the
+// directory itself, deepest first. Returns true while trees remain.
+static int reclaimDetached(struct Superblock *sb) {
+    struct Reclaimer *reclaimer = sb->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    struct Directory *trees = reclaimer->detached;
+    reclaimer->detached = NULL;
+    pthread_mutex_unlock(&reclaimer->lock);
+    if (trees == NULL) {
+        return false;
+    }
+
+    // find walks the global name index holding the tree lock shared
+    pthread_rwlock_wrlock(&sb->treeLock);
+    pthread_mutex_lock(&sb->nameLock);
+    int budget = RECLAIM_BATCH;
+    while (trees != NULL && budget > 0) {
+        struct Directory *dir = trees;
+        while (dir->children != NULL) {
+            dir = dir->children;
+        }
+        for (; dir->numFiles > 0 && budget > 0; budget--) {
+            removeNameEntry(sb, dir->files[--dir->numFiles]);
+        }
+        if (dir->numFiles > 0) {
+            break;
+        }
+        // Always the first child of its parent, or a tree's top
+        if (dir == trees) {
+            trees = dir->nextSibling;
+        } else {
+            dir->parent->children = dir->nextSibling;
+        }
+        freeDirectory(dir);
+        budget--;
+    }
+    pthread_mutex_unlock(&sb->nameLock);
+    pthread_rwlock_unlock(&sb->treeLock);
+
+    if (trees == NULL) {
+        return false;
+    }
+    struct Directory *last = trees;
+    while (last->nextSibling != NULL) {
+        last = last->nextSibling;
+    }
+    pthread_mutex_lock(&reclaimer->lock);
+    last->nextSibling = reclaimer->detached;
+    reclaimer->detached = trees;
+    pthread_mutex_unlock(&reclaimer->lock);
+    return true;
+}
+
+// Free a batch of catalog orphans. Returns true while orphans remain.
+static int reclaimOrphans(struct Superblock *sb) {
+    uint32_t freed[RECLAIM_BATCH];
+    pthread_mutex_lock(&sb->catalogLock);
+    struct Image *img = sb->catalog;
+    if (img == NULL || img->super->orphans == 0) {
+        pthread_mutex_unlock(&sb->catalogLock);
+        return false;
+    }
+    uint32_t numFreed = imageReclaimOrphans(img, RECLAIM_BATCH, freed);
+    // Cached blocks go before the inode numbers can be handed out again
+    if (sb->cache != NULL && numFreed > 0) {
+        qsort(freed, numFreed, sizeof(uint32_t), compareInos);
+        cacheDropFiles(sb->cache, freed, numFreed);
+    }
+    int more = img->super->orphans != 0;
+    pthread_mutex_unlock(&sb->catalogLock);
+    return more;
+}
+
+// Delete up to *budget host entries in or below `name` (relative to directory dirFd),
+// depth first, and `name` itself once it is empty. Returns true when it is gone.
+static int removeHostTree(int dirFd, const char *name, int *budget) {
+    if (unlinkat(dirFd, name, 0) == 0 || errno == ENOENT) {
+        (*budget)--;
+        return true;
+    }
+    int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    int empty = true, complete = false;
+    while (*budget > 0) {
+        struct dirent *entry = readdir(dir);
+        if (entry == NULL) {
+            complete = true;
+            break;
+        }
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            empty &= removeHostTree(dirfd(dir), entry->d_name, budget);
+        }
+    }
+    closedir(dir);
+    if (!complete || !empty) {
+        return false;
+    }
+    (*budget)--;
+    return unlinkat(dirFd, name, AT_REMOVEDIR) == 0;
+}
+
+// Delete a batch of what the host trash holds, and the trash itself once it is empty.
+// Returns true while it holds more.
+static int reclaimTrash(struct Superblock *sb) {
+    struct Reclaimer *reclaimer = sb->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    int trash = reclaimer->trash;
+    reclaimer->trash = false;
+    pthread_mutex_unlock(&reclaimer->lock);
+    if (!trash) {
+        return false;
+    }
+    // Entries that cannot be deleted are left for the next wake rather than retried
+    int budget = RECLAIM_BATCH;
+    if (removeHostTree(AT_FDCWD, HOST_TRASH_DIR, &budget) || budget > 0) {
+        return false;
+    }
+    pthread_mutex_lock(&reclaimer->lock);
+    reclaimer->trash = true;
+    pthread_mutex_unlock(&reclaimer->lock);
+    return true;
+}
+
+// One batch of each kind of work; returns true while any is left
+static int reclaimBatch(struct Superblock *sb) {
+    int more = reclaimDetached(sb);
+    more |= reclaimOrphans(sb);
+    more |= reclaimTrash(sb);
+    return more;
+}
+
+static void *reclaimerMain(void *arg) {
+    struct Superblock *sb = arg;
+    struct Reclaimer *reclaimer = sb->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    while (!reclaimer->stop) {
+        if (!reclaimer->pending) {
+            pthread_cond_wait(&reclaimer->wake, &reclaimer->lock);
+            continue;
+        }
+        reclaimer->pending = false;
+        pthread_mutex_unlock(&reclaimer->lock);
+        while (reclaimBatch(sb) && !__atomic_load_n(&reclaimer->stop, __ATOMIC_RELAXED)) {
+            usleep(RECLAIM_PAUSE_US);
+        }
+        pthread_mutex_lock(&reclaimer->lock);
+    }
+    pthread_mutex_unlock(&reclaimer->lock);
+    return NULL;
+}
+
+// Open-file table
+
+static void lockEntries(struct Directory *dir, int write);
+
+// The open file behind handle `fd`, with sb->treeLock held shared and the file's directory
+// locked (exclusively when `write` is set); NULL, holding nothing, when the handle is not
+// open. Removing a file needs its directory exclusively, so the handle cannot be closed
+// under the caller by anything but another use of the same handle.
+static struct OpenFile *lockHandle(struct Superblock *sb, int fd, int write) {
+    if (fd >= 0 && fd < MAX_OPEN_FILES) {
+        struct OpenFile *file = &sb->openFiles[fd];
+        pthread_rwlock_rdlock(&sb->treeLock);
+        pthread_mutex_lock(&sb->handleLock);
+        struct Inode *inode = file->inode;
+        pthread_mutex_unlock(&sb->handleLock);
+
+        // The inode stays in its directory's slabs while the tree lock is held
+        if (inode != NULL) {
+            lockEntries(inode->parent, write);
+            pthread_mutex_lock(&sb->handleLock);
+            int open = file->inode == inode;
+            pthread_mutex_unlock(&sb->handleLock);
+            if (open) {
+                return file;
+            }
+            pthread_rwlock_unlock(&inode->parent->lock);
+        }
+        pthread_rwlock_unlock(&sb->treeLock);
+    }
+    fprintf(output(), "Invalid file handle %d.\n", fd);
+    return NULL;
+}
+
+static void unlockHandle(struct Superblock *sb, struct OpenFile *file) {
+    pthread_rwlock_unlock(&file->inode->parent->lock);
+    pthread_rwlock_unlock(&sb->treeLock);
+}
+
+static void releaseOpenFile(struct Superblock *sb, struct OpenFile *file) {
+    if (file->hostFd >= 0) {
+        close(file->hostFd);
+    }
+    file->inode = NULL;
+    file->hostFd = -1;
+    sb->numOpenFiles--;
+}
+
+// Close every handle on a file that is about to be removed
+static void closeHandlesOf(struct Superblock *sb, struct Inode *inode) {
+    pthread_mutex_lock(&sb->handleLock);
+    for (int fd = 0; fd < MAX_OPEN_FILES && sb->numOpenFiles > 0; fd++) {
+        if (sb->openFiles[fd].inode == inode) {
+            releaseOpenFile(sb, &sb->openFiles[fd]);
+        }
+    }
+    pthread_mutex_unlock(&sb->handleLock);
+}
+
+// Repoint handles on `oldPath` (a file, or every file of a directory) to `newPath`
+static void renameHandles(struct Superblock *sb, const char *oldPath, const char *newPath) {
+    size_t oldLen = strlen(oldPath);
+    pthread_mutex_lock(&sb->handleLock);
+    for (int fd = 0; fd < MAX_OPEN_FILES && sb->numOpenFiles > 0; fd++) {
+        struct OpenFile *file = &sb->openFiles[fd];
+        if (file->inode != NULL && strncmp(file->path, oldPath, oldLen) == 0
+                && (file->path[oldLen] == '\0' || file->path[oldLen] == '/')) {
+            char renamed[HOST_PATH_LENGTH];
+            snprintf(renamed, sizeof(renamed), "%s%s", newPath, file->path + oldLen);
+            strcpy(file->path, renamed);
+        }
+    }
+    pthread_mutex_unlock(&sb->handleLock);
+}
+
+// Catalog helpers
+
+// Add a directory under `parent` (NULL only for the root) to the in-memory catalog;
+// returns its position or -1
+static int addDirectoryEntry(struct Superblock *sb, struct Directory *parent, const char *dirName, uint32_t ino) {
+    if (sb->numDirs == sb->capDirs) {
+        int cap = sb->capDirs ? sb->capDirs * 2 : 16;
+        struct Directory **grown = realloc(sb->directories, cap * sizeof(struct Directory *));
+        if (grown == NULL) {
+            fprintf(output(), "Memory allocation failed.\n");
+            return -1;
+        }
+        sb->directories = grown;
+        sb->capDirs = cap;
+    }
+    struct Directory *newDir = calloc(1, sizeof(struct Directory));
+    if (newDir == NULL) {
+        fprintf(output(), "Memory allocation failed.\n");
+        return -1;
+    }
+    strcpy(newDir->name, dirName);
+    newDir->ino = ino;
+    newDir->mtime = (int64_t)time(NULL);
+    newDir->parent = parent;
+    pthread_rwlock_init(&newDir->lock, NULL);
+    if (parent != NULL && addDentry(sb, newDir) != 0) {
+        fprintf(output(), "Memory allocation failed.\n");
+        freeDirectory(newDir);
+        return -1;
+    }
+    if (parent != NULL) {
+        newDir->nextSibling = parent->children;
+        parent->children = newDir;
+    }
+    newDir->pos = sb->numDirs;
+    sb->directories[sb->numDirs++] = newDir;
+    return newDir->pos;
+}
+
+// Drop `dir` from sb->directories by moving the last directory into its place
+static void takeDirectoryPosition(struct Superblock *sb, struct Directory *dir) {
+    struct Directory *last = sb->directories[--sb->numDirs];
+    last->pos = dir->pos;
+    sb->directories[dir->pos] = last;
+}
+
+// Take a directory out of the catalog and free it; its files must already be gone
+static void removeDirectoryEntry(struct Superblock *sb, struct Directory *dir) {
+    removeDentry(sb, dir);
+    struct Directory **link = &dir->parent->children;
+    while (*link != dir) {
+        link = &(*link)->nextSibling;
+    }
+    *link = dir->nextSibling;
+    takeDirectoryPosition(sb, dir);
+    freeDirectory(dir);
+}
+
+// Add a file to directories[dirPos] in the in-memory catalog
+static struct Inode *addFileEntry(struct Superblock *sb, int dirPos, const char *fileName, uint32_t ino) {
+    struct Directory *dir = sb->directories[dirPos];
+
+    if (dir->numFiles == dir->capFiles) {
+        int cap = dir->capFiles ? dir->capFiles * 2 : 16;
+        // The arrays that did grow keep their contents, so a failure changes nothing
+        struct Inode **grown = realloc(dir->files, cap * sizeof(struct Inode *));
+        if (grown != NULL) {
+            dir->files = grown;
+        }
+        uint32_t *hashes = realloc(dir->fileHashes, cap * sizeof(uint32_t));
+        if (hashes != NULL) {
+            dir->fileHashes = hashes;
+        }
+        uint64_t *keys = realloc(dir->fileKeys, cap * sizeof(uint64_t));
+        if (keys != NULL) {
+            dir->fileKeys = keys;
+        }
+        if (grown == NULL || hashes == NULL || keys == NULL) {
+            fprintf(output(), "Memory allocation failed.\n");
+            return NULL;
+        }
+        dir->capFiles = cap;
+    }
+
+    // Take a new Inode from the directory's slabs
+    struct Inode *newFile = allocInode(dir);
+    if (newFile == NULL) {
+        fprintf(output(), "Memory allocation failed.\n");
+        return NULL;
+    }
+
+    // Initialize the new Inode instance
+    strcpy(newFile->name, fileName);
+    newFile->size = 0;
+    newFile->mtime = (int64_t)time(NULL);
+    newFile->ino = ino;
+    newFile->parent = dir;
+
+    // Add the file to the directory and its indexes
+    placeFile(dir, dir->numFiles++, newFile);
+    pthread_mutex_lock(&sb->nameLock);
+    int indexed = indexFile(dir, dir->numFiles - 1) == 0 && addNameEntry(sb, newFile) == 0;
+    if (indexed) {
+        sb->totalFiles++;
+    }
+    pthread_mutex_unlock(&sb->nameLock);
+    if (!indexed) {
+        fprintf(output(), "Memory allocation failed.\n");
+        dir->numFiles--;
+        rebuildFileIndex(dir);
+        freeInode(dir, newFile);
+        return NULL;
+    }
+    return newFile;
+}
+
+// Read a directory's entries from the catalog: its files, and its subdirectories as
+// not-yet-loaded entries. Only this directory's own list is walked.
+static int loadDirectory(struct Superblock *sb, struct Directory *dir) {
+    if (dir->loaded || sb->catalog == NULL) {
+        return 0;
+    }
+    struct Image *img = sb->catalog;
+    uint32_t first = img->inodes[dir->ino].firstChild;
+    uint32_t ino = first;
+    for (uint32_t seen = 0; ino != 0 && seen < img->super->numInodes; seen++) {
+        struct DiskInode *inode = ino < img->super->numInodes ? &img->inodes[ino] : NULL;
+        if (inode == NULL || !(inode->flags & IMAGE_INODE_USED) || inode->parent != dir->ino) {
+            fprintf(output(), "Catalog entry %u of directory '%s' is damaged.\n", ino, dir->name);
+            break;
+        }
+        if (inode->flags & IMAGE_INODE_DIR) {
+            int pos = addDirectoryEntry(sb, dir, inode->name, ino);
+            if (pos < 0) {
+                return -1;
+            }
+            sb->directories[pos]->mtime = inode->mtime;
+        } else {
+            struct Inode *file = addFileEntry(sb, dir->pos, inode->name, ino);
+            if (file == NULL) {
+                return -1;
+            }
+            file->size = (int64_t)imageDataOf(img, ino)->size;
+            file->mtime = inode->mtime;
+        }
+        ino = inode->nextSibling != first ? inode->nextSibling : 0;
+    }
+    dir->loaded = true;
+    return 0;
+}
+
+// Load every directory, for operations that span the whole namespace
+static int loadAllDirectories(struct Superblock *sb) {
+    // Loading appends the subdirectories it finds, so this reaches all of them
+    for (int i = 0; i < sb->numDirs; i++) {
+        if (loadDirectory(sb, sb->directories[i]) != 0) {
+            return -1;
+        }
+    }
+    // Directories made from now on start loaded, so this holds until the namespace is
+    // read afresh from the catalog
+    sb->allLoaded = true;
+    return 0;
+}
+
+// Locking
+//
+// Concurrent callers (the server's worker threads) coordinate through two levels of
+// reader/writer locks. sb->treeLock covers the shape of the tree: operations that add,
+// remove, rename or load directories hold it exclusively and need nothing else. All the
+// others hold it shared and lock the directories they use, shared to read their entries
+// and exclusively to change them, in sb->directories order when there are two (positions
+// only change while the tree lock is held exclusively, so all its holders see the same
+// order). State common to every directory has a mutex of its own, taken only for the
+// moment it is touched and never together with another: nameLock for the global name
+// index, catalogLock for the catalog and its journal, handleLock for the open-file table.
+// The reclaimer holds the tree lock exclusively while it frees each batch of a detached
+// tree.
+
+// Take sb->treeLock and resolve `count` paths into positions[] (-1 for a path that does
+// not exist). The lock is held shared, unless a path reaches a directory that is not
+// loaded yet: then it is held exclusively while the directories are loaded, and kept that
+// way until the caller releases it.
+static void lockTree(struct Superblock *sb, const char *paths[], int count, int positions[]) {
+    int unloaded = false;
+    pthread_rwlock_rdlock(&sb->treeLock);
+    for (int k = 0; k < count; k++) {
+        positions[k] = findDirectory(sb, paths[k], false);
+        unloaded |= positions[k] == DIR_UNLOADED;
+    }
+    if (!unloaded) {
+        return;
+    }
+    pthread_rwlock_unlock(&sb->treeLock);
+    pthread_rwlock_wrlock(&sb->treeLock);
+    for (int k = 0; k < count; k++) {
+        positions[k] = findDirectory(sb, paths[k], true);
+    }
+}
+
+static void lockEntries(struct Directory *dir, int write) {
+    if (write) {
+        pthread_rwlock_wrlock(&dir->lock);
+    } else {
+        pthread_rwlock_rdlock(&dir->lock);
+    }
+}
+
+// Resolve `path` and lock the directory it names, exclusively when `write` is set.
+// Returns NULL, holding nothing, when there is no such directory.
+static struct Directory *lockDirectory(struct Superblock *sb, const char *path, int write) {
+    int pos;
+    lockTree(sb, &path, 1, &pos);
+    if (pos < 0) {
+        pthread_rwlock_unlock(&sb->treeLock);
+        return NULL;
+    }
+    lockEntries(sb->directories[pos], write);
+    return sb->directories[pos];
+}
+
+static void unlockDirectory(struct Superblock *sb, struct Directory *dir) {
+    pthread_rwlock_unlock(&dir->lock);
+    pthread_rwlock_unlock(&sb->treeLock);
+}
+
+// Function definitions
+
+//INITIALISE THE SUPERBLOCK
+// Returns -1 when the root directory cannot be allocated
+int initSuperblock(struct Superblock *sb) {
+    sb->totalFiles = 0;
+    sb->numDirs = 0;
+    sb->capDirs = 0;
+    sb->directories = NULL;
+    sb->dentries = NULL;
+    sb->dirNames = NULL;
+    sb->numDentryBuckets = 0;
+    sb->allLoaded = false;
+    sb->nameBuckets = NULL;
+    sb->numNameBuckets = 0;
+    sb->image = NULL;
+    sb->catalog = NULL;
+    sb->cache = NULL;
+    sb->nextHostIno = 1;
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        sb->openFiles[fd].inode = NULL;
+        sb->openFiles[fd].hostFd = -1;
+    }
+    sb->numOpenFiles = 0;
+    pthread_rwlock_init(&sb->treeLock, NULL);
+    pthread_mutex_init(&sb->nameLock, NULL);
+    pthread_mutex_init(&sb->catalogLock, NULL);
+    pthread_mutex_init(&sb->handleLock, NULL);
+    sb->stats = NULL;
+    sb->statsEnabled = false;
+    sb->tracer = NULL;
+    sb->tracing = false;
+    // A trash left behind by an earlier run is emptied once the reclaimer first runs
+    sb->reclaimer = calloc(1, sizeof(struct Reclaimer));
+    if (sb->reclaimer == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&sb->reclaimer->lock, NULL);
+    pthread_cond_init(&sb->reclaimer->wake, NULL);
+    sb->reclaimer->trash = true;
+
+    if (addDirectoryEntry(sb, NULL, "", 0) != 0) {
+        return -1;
+    }
+    sb->directories[0]->loaded = true;
+    sb->cwd = sb->directories[0];
+    updateCurrentDirectory(sb);
+    return 0;
+}
+
+//PRINT BUFFER CACHE STATISTICS
+void printCacheStats(struct Superblock *sb) {
+    struct BufferCache *cache = sb->cache;
+    if (cache == NULL) {
+        fprintf(output(), "Buffer cache is disabled%s.\n", sb->image != NULL ? " (image mode reads the mapping directly)" : "");
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    unsigned long lookups = cache->hits + cache->misses;
+    fprintf(output(), "Buffer cache: %zu/%zu blocks (%zu dirty)\n", cache->numBlocks, cache->maxBlocks, cache->numDirty);
+    fprintf(output(), "Hits: %lu  Misses: %lu  Hit rate: %.1f%%\n", cache->hits, cache->misses,
+           lookups ? 100.0 * cache->hits / lookups : 0.0);
+    fprintf(output(), "Evictions: %lu  Write-backs: %lu\n", cache->evictions, cache->writebacks);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//ENABLE OR DISABLE OPERATION STATISTICS
+// The counters survive being disabled and carry on when statistics are enabled again.
+// Returns -1 when they cannot be allocated.
+int fsStatsEnable(struct Superblock *sb, int enabled) {
+    if (enabled && __atomic_load_n(&sb->stats, __ATOMIC_ACQUIRE) == NULL) {
+        struct FsStats *stats = calloc(1, sizeof(struct FsStats));
+        struct FsStats *none = NULL;
+        if (stats == NULL) {
+            return -1;
+        }
+        if (!__atomic_compare_exchange_n(&sb->stats, &none, stats, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(stats); // another thread got there first
+        }
+    }
+    __atomic_store_n(&sb->statsEnabled, enabled != 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//RESET OPERATION STATISTICS
+void fsStatsReset(struct Superblock *sb) {
+    struct FsStats *stats = __atomic_load_n(&sb->stats, __ATOMIC_ACQUIRE);
+    if (stats == NULL) {
+        return;
+    }
+    for (int op = 0; op < STATS_NUM_OPS; op++) {
+        struct OpCounters *counters = &stats->ops[op];
+        __atomic_store_n(&counters->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counters->errors, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counters->bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counters->totalNanos, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counters->maxNanos, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            __atomic_store_n(&counters->histogram[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+//PRINT OPERATION STATISTICS
+// A table of the operations called so far, with latency percentiles in microseconds, or
+// with `json` a single line holding every counter and each operation's non-empty
+// histogram buckets as [lowest latency in nanoseconds, calls] pairs
+void printOperationStats(struct Superblock *sb, int json) {
+    int enabled = __atomic_load_n(&sb->statsEnabled, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&sb->stats, __ATOMIC_ACQUIRE) == NULL) {
+        if (json) {
+            fprintf(output(), "{\"enabled\":false,\"operations\":[]}\n");
+        } else {
+            fprintf(output(), "Operation statistics are disabled.\n");
+        }
+        return;
+    }
+
+    struct OpCounters *counters = malloc(sizeof(struct OpCounters));
+    if (counters == NULL) {
+        return;
+    }
+    FILE *out = output();
+    if (json) {
+        fprintf(out, "{\"enabled\":%s,\"operations\":[", enabled ? "true" : "false");
+    } else {
+        fprintf(out, "Operation statistics (%s):\n", enabled ? "enabled" : "disabled");
+        fprintf(out, "%-16s %10s %8s %14s %10s %10s %10s %10s %10s %10s\n", "Operation", "Calls", "Errors", "Bytes",
+                "Mean us", "p50 us", "p90 us", "p99 us", "p99.9 us", "Max us");
+    }
+    int shown = 0;
+    for (int op = 0; op < STATS_NUM_OPS; op++) {
+        statsSnapshot(sb, op, counters);
+        if (json) {
+            fprintf(out, "%s{\"name\":\"%s\",\"calls\":%llu,\"errors\":%llu,\"bytes\":%llu,\"totalNs\":%llu,\"maxNs\":%llu,"
+                    "\"p50Ns\":%llu,\"p90Ns\":%llu,\"p99Ns\":%llu,\"p999Ns\":%llu,\"histogram\":[",
+                    op > 0 ? "," : "", statsNames[op], (unsigned long long)counters->calls,
+                    (unsigned long long)counters->errors, (unsigned long long)counters->bytes,
+                    (unsigned long long)counters->totalNanos, (unsigned long long)counters->maxNanos,
+                    (unsigned long long)statsPercentile(counters, 0.5), (unsigned long long)statsPercentile(counters, 0.9),
+                    (unsigned long long)statsPercentile(counters, 0.99), (unsigned long long)statsPercentile(counters, 0.999));
+            int first = true;
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                if (counters->histogram[b] > 0) {
+                    fprintf(out, "%s[%llu,%llu]", first ? "" : ",", (unsigned long long)statsBucketLow(b),
+                            (unsigned long long)counters->histogram[b]);
+                    first = false;
+                }
+            }
+            fprintf(out, "]}");
+            continue;
+        }
+        if (counters->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%-16s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", statsNames[op],
+                (unsigned long long)counters->calls, (unsigned long long)counters->errors,
+                (unsigned long long)counters->bytes, counters->totalNanos / 1000.0 / counters->calls,
+                statsPercentile(counters, 0.5) / 1000.0, statsPercentile(counters, 0.9) / 1000.0,
+                statsPercentile(counters, 0.99) / 1000.0, statsPercentile(counters, 0.999) / 1000.0,
+                counters->maxNanos / 1000.0);
+        shown++;
+    }
+    if (json) {
+        fprintf(out, "]}\n");
+    } else if (shown == 0) {
+        fprintf(out, "No operations recorded yet.\n");
+    }
+    free(counters);
+}
+
+static const char *traceOpNames[FS_NUM_OPS] = {
+    "createFile", "makeDirectory", "echo", "readFile", "prefetchFiles", "listFiles",
+    "changeDirectory", "copyFiles", "renameFile", "renameDirectory", "findFile",
+    "removeFiles", "removeDirectory", "fsOpen", "fsRead", "fsPread", "fsWrite", "fsPwrite",
+    "fsAppend", "fsSeek", "fsTruncate", "fsClose", "fsSync", "fsListDirectory"
+};
+
+//START RECORDING A TRACE
+// Every operation from now on is appended to a new trace file at `path` until fsTraceStop
+// or closeFileSystem; see operation traces for what a record holds
+int fsTraceStart(struct Superblock *sb, const char *path) {
+    struct Tracer *tracer = __atomic_load_n(&sb->tracer, __ATOMIC_ACQUIRE);
+    if (tracer == NULL) {
+        struct Tracer *none = NULL;
+        tracer = calloc(1, sizeof(struct Tracer));
+        if (tracer == NULL) {
+            fprintf(output(), "Memory allocation failed.\n");
+            return -1;
+        }
+        pthread_mutex_init(&tracer->lock, NULL);
+        if (!__atomic_compare_exchange_n(&sb->tracer, &none, tracer, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_destroy(&tracer->lock); // another thread got there first
+            free(tracer);
+            tracer = none;
+        }
+    }
+
+    pthread_mutex_lock(&tracer->lock);
+    if (tracer->file != NULL) {
+        pthread_mutex_unlock(&tracer->lock);
+        fprintf(output(), "A trace is already being recorded.\n");
+        return -1;
+    }
+    struct TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.started = (int64_t)time(NULL);
+    FILE *file = fopen(path, "wb");
+    char *buffer = malloc(TRACE_BUFFER);
+    if (file == NULL || buffer == NULL || setvbuf(file, buffer, _IOFBF, TRACE_BUFFER) != 0
+            || fwrite(&header, sizeof(header), 1, file) != 1) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(buffer);
+        pthread_mutex_unlock(&tracer->lock);
+        fprintf(output(), "Failed to create trace file '%s'.\n", path);
+        return -1;
+    }
+    tracer->file = file;
+    tracer->buffer = buffer;
+    tracer->startNanos = monotonicNanos();
+    tracer->lastNanos = 0;
+    tracer->records = 0;
+    __atomic_store_n(&sb->tracing, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tracer->lock);
+    fprintf(output(), "Recording a trace to '%s'.\n", path);
+    return 0;
+}
+
+// Close the trace being recorded. Returns the number of records, -1 when the trace could
+// not be written out in full, or -2 when none was being recorded.
+static long traceFinish(struct Superblock *sb, struct Tracer *tracer) {
+    __atomic_store_n(&sb->tracing, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&tracer->lock);
+    if (tracer->file == NULL) {
+        pthread_mutex_unlock(&tracer->lock);
+        return -2;
+    }
+    int failed = ferror(tracer->file);
+    failed |= fclose(tracer->file) != 0;
+    free(tracer->buffer);
+    tracer->file = NULL;
+    tracer->buffer = NULL;
+    long records = (long)tracer->records;
+    pthread_mutex_unlock(&tracer->lock);
+    return failed ? -1 : records;
+}
+
+//STOP RECORDING A TRACE
+int fsTraceStop(struct Superblock *sb) {
+    struct Tracer *tracer = __atomic_load_n(&sb->tracer, __ATOMIC_ACQUIRE);
+    long records = tracer != NULL ? traceFinish(sb, tracer) : -2;
+    if (records == -2) {
+        fprintf(output(), "No trace is being recorded.\n");
+        return -1;
+    }
+    if (records < 0) {
+        fprintf(output(), "Failed to write the trace.\n");
+        return -1;
+    }
+    fprintf(output(), "Trace stopped after %ld operations.\n", records);
+    return 0;
+}
+
+//OPEN A TRACE FOR READING
+struct FsTrace *fsTraceOpen(const char *path) {
+    struct FsTrace *trace = calloc(1, sizeof(struct FsTrace));
+    if (trace == NULL) {
+        fprintf(output(), "Memory allocation failed.\n");
+        return NULL;
+    }
+    trace->file = fopen(path, "rb");
+    struct TraceHeader header;
+    if (trace->file == NULL || fread(&header, sizeof(header), 1, trace->file) != 1
+            || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) {
+        fprintf(output(), "'%s' is not a trace.\n", path);
+        fsTraceClose(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+static int traceReadVarint(FILE *file, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(file);
+        if (byte == EOF) {
+            return -1;
+        }
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int traceReadSigned(FILE *file, int64_t *value) {
+    uint64_t raw;
+    if (traceReadVarint(file, &raw) != 0) {
+        return -1;
+    }
+    *value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+    return 0;
+}
+
+// Read string `k` of a record into the trace's own buffers; strings[k] is NULL if the call
+// was given NULL
+static int traceReadString(struct FsTrace *trace, int k, char **string) {
+    uint64_t length;
+    if (traceReadVarint(trace->file, &length) != 0 || length > TRACE_MAX_STRING + 1) {
+        return -1;
+    }
+    *string = NULL;
+    if (length-- == 0) {
+        return 0;
+    }
+    if (length + 1 > trace->capacities[k]) {
+        char *grown = realloc(trace->buffers[k], length + 1);
+        if (grown == NULL) {
+            return -1;
+        }
+        trace->buffers[k] = grown;
+        trace->capacities[k] = length + 1;
+    }
+    if (fread(trace->buffers[k], 1, length, trace->file) != length) {
+        return -1;
+    }
+    trace->buffers[k][length] = '\0';
+    *string = trace->buffers[k];
+    return 0;
+}
+
+//READ THE NEXT TRACE RECORD
+// Returns 1 with `record` filled in, 0 at the end of the trace, or -1 if it is damaged
+int fsTraceNext(struct FsTrace *trace, struct FsTraceRecord *record) {
+    int op = getc(trace->file);
+    if (op == EOF) {
+        return 0;
+    }
+    uint64_t thread, latency, numNumbers, numStrings;
+    int64_t delta, result;
+    if (op >= FS_NUM_OPS || traceReadVarint(trace->file, &thread) != 0 || thread > UINT32_MAX
+            || traceReadSigned(trace->file, &delta) != 0 || traceReadVarint(trace->file, &latency) != 0
+            || traceReadSigned(trace->file, &result) != 0 || traceReadVarint(trace->file, &numNumbers) != 0
+            || numNumbers > FS_TRACE_MAX_NUMBERS) {
+        return -1;
+    }
+    for (uint64_t k = 0; k < numNumbers; k++) {
+        if (traceReadSigned(trace->file, &record->numbers[k]) != 0) {
+            return -1;
+        }
+    }
+    if (traceReadVarint(trace->file, &numStrings) != 0 || numStrings > INT_MAX / sizeof(size_t)) {
+        return -1;
+    }
+    if ((int)numStrings > trace->capStrings) {
+        char **buffers = realloc(trace->buffers, numStrings * sizeof(char *));
+        if (buffers == NULL) {
+            return -1;
+        }
+        trace->buffers = buffers;
+        size_t *capacities = realloc(trace->capacities, numStrings * sizeof(size_t));
+        if (capacities == NULL) {
+            return -1;
+        }
+        trace->capacities = capacities;
+        char **strings = realloc(trace->strings, numStrings * sizeof(char *));
+        if (strings == NULL) {
+            return -1;
+        }
+        trace->strings = strings;
+        for (int k = trace->capStrings; k < (int)numStrings; k++) {
+            trace->buffers[k] = NULL;
+            trace->capacities[k] = 0;
+        }
+        trace->capStrings = (int)numStrings;
+    }
+    for (int k = 0; k < (int)numStrings; k++) {
+        if (traceReadString(trace, k, &trace->strings[k]) != 0) {
+            return -1;
+        }
+    }
+    trace->time += (uint64_t)delta;
+    record->op = op;
+    record->thread = (uint32_t)thread;
+    record->time = trace->time;
+    record->latency = latency;
+    record->result = (long)result;
+    record->numNumbers = (int)numNumbers;
+    record->numStrings = (int)numStrings;
+    record->strings = trace->strings;
+    return 1;
+}
+
+//CLOSE A TRACE OPENED FOR READING
+void fsTraceClose(struct FsTrace *trace) {
+    if (trace->file != NULL) {
+        fclose(trace->file);
+    }
+    for (int k = 0; k < trace->capStrings; k++) {
+        free(trace->buffers[k]);
+    }
+    free(trace->buffers);
+    free(trace->capacities);
+    free(trace->strings);
+    free(trace);
+}
+
+//NAME OF A TRACE OPERATION
+// The library call it records
+const char *fsTraceOpName(int op) {
+    return op >= 0 && op < FS_NUM_OPS ? traceOpNames[op] : "unknown";
+}
+
+// Attach an opened image or catalog: the root's entries are read on first use
+static void attachCatalog(struct Superblock *sb, struct Image *img) {
+    sb->catalog = img;
+    sb->directories[0]->ino = 0;
+    sb->directories[0]->mtime = img->inodes[0].mtime;
+    sb->directories[0]->loaded = false;
+    sb->allLoaded = false;
+    journalStartCommitter(sb);
+    // Orphans left by an earlier run are freed in the background
+    if (img->super->orphans != 0) {
+        reclaimerWake(sb);
+    }
+}
+
+//MOUNT A DISK IMAGE
+// Subsequent operations keep their data in the image instead of the host file system.
+// Mounting only maps the image: each directory is read from its on-disk entry list the
+// first time a path reaches it, so the time to mount does not grow with the namespace.
+int mountImage(struct Superblock *sb, const char *path) {
+    struct Image *img = imageOpen(path, 0);
+    if (img == NULL) {
+        return -1;
+    }
+    sb->image = img;
+    attachCatalog(sb, img);
+
+    fprintf(output(), "Mounted image '%s' (%u directories, %u files).\n", path, img->super->numDirs, img->super->numFiles);
+    return 0;
+}
+
+//MOUNT A HOST-MODE CATALOG
+// File data stays in host files; names, directories and sizes are kept in the catalog
+// file at `path` (created if missing), so they survive restarts.
+int mountCatalog(struct Superblock *sb, const char *path) {
+    struct Image *img = imageOpen(path, IMAGE_CATALOG);
+    if (img == NULL) {
+        return -1;
+    }
+    attachCatalog(sb, img);
+    return 0;
+}
+
+//COMPRESS FILE CONTENTS
+// While enabled, files whose contents are replaced whole (echo) are stored compressed in
+// the image; files already written keep their form until they are next replaced.
+// Compression needs an image: host files stay plain so other programs can read them.
+int fsSetCompression(struct Superblock *sb, int enabled) {
+    if (sb->image == NULL) {
+        fprintf(output(), "Compression needs a disk image.\n");
+        return -1;
+    }
+    pthread_mutex_lock(&sb->catalogLock);
+    sb->image->compress = enabled != 0;
+    pthread_mutex_unlock(&sb->catalogLock);
+    return 0;
+}
+
+//DEDUPLICATE FILE BLOCKS
+// While enabled, every full block that echo writes is first looked up by fingerprint,
+// and a block already in the image with the same contents is shared instead of written
+// again. Needs an image formatted with share counts (version 6 or later).
+int fsSetDedup(struct Superblock *sb, int enabled) {
+    if (sb->image == NULL || sb->image->shares == NULL) {
+        fprintf(output(), sb->image == NULL ? "Deduplication needs a disk image.\n"
+                : "Deduplication needs an image formatted with block share counts (version 6).\n");
+        return -1;
+    }
+    int status = 0;
+    pthread_mutex_lock(&sb->catalogLock);
+    if (enabled && sb->image->dedup == NULL) {
+        status = dedupBuild(sb->image);
+    } else if (!enabled) {
+        dedupDestroy(sb->image->dedup);
+        sb->image->dedup = NULL;
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    return status;
+}
+
+//UNMOUNT THE DISK IMAGE
+// Also releases a host-mode catalog
+void unmountImage(struct Superblock *sb) {
+    // Orphans not freed yet stay in the image for the next mount
+    reclaimerStop(sb);
+    if (sb->catalog != NULL) {
+        journalStopCommitter(sb);
+        imageClose(sb->catalog);
+        sb->catalog = NULL;
+        sb->image = NULL;
+    }
+}
+
+// Create `fileName` in `dir`, which the caller holds exclusively
+static int createFileLocked(struct Superblock *sb, struct Directory *dir, const char *dirName, const char *fileName) {
+    if (!validName(fileName)) {
+        fprintf(output(), "Invalid file name '%s'.\n", fileName);
+        return -1;
+    }
+    if (findFileInDirectory(dir, fileName) >= 0) {
+        fprintf(output(), "File '%s' already exists in directory '%s'.\n", fileName, dirName);
+        return -1;
+    }
+
+    uint32_t ino;
+    if (catalogAllocInode(sb, fileName, dir->ino, 0, &ino) != 0) {
+        fprintf(output(), "Failed to create file '%s'.\n", fileName);
+        return -1;
+    }
+    if (sb->image == NULL) {
+        // Construct the full path
+        char fullPath[HOST_PATH_LENGTH];
+        hostFilePath(dir, fileName, fullPath, sizeof(fullPath));
+
+        // Open the file for writing
+        FILE *file = fopen(fullPath, "w");
+        if (file == NULL) {
+            fprintf(output(), "Failed to create file '%s'.\n", fileName);
+            catalogFreeInode(sb, ino);
+            return -1;
+        }
+
+        // Close the file
+        fclose(file);
+    }
+
+    if (addFileEntry(sb, dir->pos, fileName, ino) == NULL) {
+        catalogFreeInode(sb, ino);
+        return -1;
+    }
+
+    fprintf(output(), "File '%s' created in directory '%s'.\n", fileName, dirName);
+    return 0;
+}
+
+//CREATE A FILE
+int createFile(struct Superblock *sb, const char *dirName, const char *fileName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_CREATE, dirName, fileName, NULL);
+    journalOperation(sb);
+    // Find the directory
+    struct Directory *dir = lockDirectory(sb, dirName, true);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_CREATE, start, -1, 0);
+    }
+    int status = createFileLocked(sb, dir, dirName, fileName);
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_CREATE, start, status, 0);
+}
+
+
+
+// Called with sb->treeLock held exclusively
+static int makeDirectoryLocked(struct Superblock *sb, const char *dirName) {
+    // Split the path into the parent and the new name
+    char parentPath[MAX_PATH_LENGTH];
+    const char *slash = strrchr(dirName, '/');
+    const char *leaf = slash != NULL ? slash + 1 : dirName;
+    size_t parentLen = slash == NULL ? 0 : (slash == dirName ? 1 : (size_t)(slash - dirName));
+    if (parentLen >= sizeof(parentPath) || !validName(leaf) || strlen(leaf) >= MAX_DIR_NAME_LENGTH) {
+        fprintf(output(), "Invalid directory name '%s'.\n", dirName);
+        return -1;
+    }
+    memcpy(parentPath, dirName, parentLen);
+    parentPath[parentLen] = '\0';
+
+    int p = findDirectory(sb, parentPath, true);
+    if (p < 0) {
+        fprintf(output(), "Directory '%s' not found.\n", parentPath);
+        return -1;
+    }
+    struct Directory *parent = sb->directories[p];
+    if (lookupDentry(sb, parent, leaf) != NULL) {
+        fprintf(output(), "Directory '%s' already exists.\n", dirName);
+        return -1;
+    }
+    char path[HOST_PATH_LENGTH];
+    hostFilePath(parent, leaf, path, sizeof(path));
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        fprintf(output(), "Path '%s' is too long.\n", dirName);
+        return -1;
+    }
+
+    uint32_t ino;
+    if (catalogAllocInode(sb, leaf, parent->ino, IMAGE_INODE_DIR, &ino) != 0) {
+        fprintf(output(), "Failed to create directory '%s'.\n", dirName);
+        return -1;
+    }
+
+    // Create the directory
+    if (sb->image == NULL && mkdir(path, 0777) != 0) { // 0777 gives full permissions, adjust as needed
+        fprintf(output(), "Failed to create directory '%s'.\n", dirName);
+        catalogFreeInode(sb, ino);
+        return -1;
+    }
+    int pos = addDirectoryEntry(sb, parent, leaf, ino);
+    if (pos < 0) {
+        if (sb->image == NULL) {
+            rmdir(path);
+        }
+        catalogFreeInode(sb, ino);
+        return -1;
+    }
+    sb->directories[pos]->loaded = true; // nothing to read for a new directory
+    fprintf(output(), "Directory '%s' created.\n", dirName);
+    return 0;
+}
+
+//CREATE A DIRECTORY
+// `dirName` is a path; every directory above the new one must already exist
+int makeDirectory(struct Superblock *sb, const char *dirName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_MKDIR, dirName, NULL, NULL);
+    journalOperation(sb);
+    pthread_rwlock_wrlock(&sb->treeLock);
+    int status = makeDirectoryLocked(sb, dirName);
+    pthread_rwlock_unlock(&sb->treeLock);
+    return statsDone(sb, STATS_MKDIR, start, status, 0);
+}
+
+// Replace a file's contents; the caller holds `dir` exclusively
+static int echoLocked(struct Superblock *sb, struct Directory *dir, const char *dirName, const char *fileName, const char *content) {
+    // Search for the file in the directory
+    int j = findFileInDirectory(dir, fileName);
+    if (j < 0) {
+        fprintf(output(), "File '%s' not found in directory '%s'.\n", fileName, dirName);
+        return -1;
+    }
+    struct Inode *inode = dir->files[j];
+
+    if (sb->image != NULL) {
+        // Replace the contents in the image
+        size_t len = strlen(content);
+        pthread_mutex_lock(&sb->catalogLock);
+        imageMakeRoom(sb->image, len);
+        imageTruncate(sb->image, inode->ino, 0);
+        size_t written = sb->image->compress ? imageWriteCompressed(sb->image, inode->ino, content, len)
+                       : sb->image->dedup != NULL ? imageWriteDeduped(sb->image, inode->ino, content, len)
+                       : imageWrite(sb->image, inode->ino, 0, content, len);
+        pthread_mutex_unlock(&sb->catalogLock);
+        inode->size = (int64_t)written;
+        catalogFileChanged(sb, inode);
+        if (written != len) {
+            fprintf(output(), "Failed to write file '%s' in directory '%s': image full.\n", fileName, dirName);
+            return -1;
+        }
+        fprintf(output(), "Content written to file '%s' in directory '%s'.\n", fileName, dirName);
+        return 0;
+    }
+
+    // Construct the full path to the file
+    char fullPath[HOST_PATH_LENGTH];
+    hostFilePath(dir, fileName, fullPath, sizeof(fullPath));
+
+    // Write content to the file
+    if (hostWriteFile(sb, inode, fullPath, content, strlen(content)) != 0) {
+        fprintf(output(), "Failed to open file '%s' in directory '%s'.\n", fileName, dirName);
+        return -1;
+    }
+
+    fprintf(output(), "Content written to file '%s' in directory '%s'.\n", fileName, dirName);
+    return 0;
+}
+
+//WRITE CONTENT ONTO A FILE
+int echo(struct Superblock *sb, const char *dirName, const char *fileName, const char *content) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_ECHO, dirName, fileName, content);
+    journalOperation(sb);
+    // Find the directory
+    struct Directory *dir = lockDirectory(sb, dirName, true);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_ECHO, start, -1, 0);
+    }
+    int status = echoLocked(sb, dir, dirName, fileName, content);
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_ECHO, start, status, strlen(content));
+}
+
+//READ A FILE'S CONTENTS
+int readFile(struct Superblock *sb, const char *dirName, const char *fileName) {
+    return readFileRange(sb, dirName, fileName, 0, -1);
+}
+
+//PREFETCH FILES
+// Starts reading several files of one directory into memory ahead of readFile, as one
+// batch of host I/O. Names that do not exist are skipped; reading them reports it.
+int prefetchFiles(struct Superblock *sb, const char *dirName, const char *fileNames[], int count) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_PREFETCH, dirName, NULL, NULL);
+    traceNames(fileNames, count);
+    if (sb->image != NULL) {
+        // The image is mapped; its pages are read as they are touched
+        return statsDone(sb, STATS_PREFETCH, start, 0, 0);
+    }
+    struct IoRequest *reqs = malloc(count * sizeof(struct IoRequest));
+    if (reqs == NULL) {
+        return statsDone(sb, STATS_PREFETCH, start, -1, 0);
+    }
+    struct Directory *dir = lockDirectory(sb, dirName, false);
+    if (dir == NULL) {
+        free(reqs);
+        return statsDone(sb, STATS_PREFETCH, start, -1, 0);
+    }
+    int queued = 0;
+    for (int k = 0; k < count; k++) {
+        int j = findFileInDirectory(dir, fileNames[k]);
+        if (j >= 0) {
+            reqs[queued].op = IO_PREFETCH;
+            reqs[queued].inode = dir->files[j];
+            hostFilePath(dir, fileNames[k], reqs[queued].path, sizeof(reqs[queued].path));
+            queued++;
+        }
+    }
+    ioRunBatch(sb, reqs, queued);
+    unlockDirectory(sb, dir);
+    free(reqs);
+    return statsDone(sb, STATS_PREFETCH, start, 0, 0);
+}
+
+//READ PART OF A FILE
+// Writes `length` bytes starting at `offset` (length < 0 reads to the end of the file)
+// straight to the output's descriptor, bypassing stdio so the bytes are copied at most once.
+int readFileRange(struct Superblock *sb, const char *dirName, const char *fileName, long offset, long length) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_READ_FILE, dirName, fileName, NULL);
+    traceNumber(offset);
+    traceNumber(length);
+    // Find the directory
+    struct Directory *dir = lockDirectory(sb, dirName, false);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_READ, start, -1, 0);
+    }
+
+    // Check if the file exists in the directory
+    int j = findFileInDirectory(dir, fileName);
+    if (j < 0 || offset < 0) {
+        if (j < 0) {
+            fprintf(output(), "File '%s' not found in directory '%s'.\n", fileName, dirName);
+        } else {
+            fprintf(output(), "Invalid offset %ld.\n", offset);
+        }
+        unlockDirectory(sb, dir);
+        return statsDone(sb, STATS_READ, start, -1, 0);
+    }
+    uint64_t span = length < 0 ? UINT64_MAX : (uint64_t)length;
+
+    // Anything already printed must come out before the file contents
+    FILE *out = output();
+    fflush(out);
+
+    long written;
+    if (sb->image != NULL) {
+        written = imageReadRange(sb->image, dir->files[j]->ino, (uint64_t)offset, span, fileno(out));
+    } else {
+        // Construct the full file path
+        char filePath[HOST_PATH_LENGTH];
+        hostFilePath(dir, fileName, filePath, sizeof(filePath));
+        written = hostReadRange(sb, dir->files[j], filePath, (uint64_t)offset, span, fileno(out));
+    }
+    unlockDirectory(sb, dir);
+    if (written < 0) {
+        fprintf(output(), "Failed to read file '%s'.\n", fileName);
+        return statsDone(sb, STATS_READ, start, -1, 0);
+    }
+    return statsDone(sb, STATS_READ, start, 0, (uint64_t)written);
+}
+
+//LIST FILES IN A DIRECTORY
+// Subdirectories are listed first, with a trailing '/'
+int listFiles(struct Superblock *sb, const char *dirName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_LIST, dirName, NULL, NULL);
+    fprintf(output(), "Attempting to list files in directory '%s'\n", dirName);
+    struct Directory *dir = lockDirectory(sb, dirName, false);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_LIST, start, -1, 0);
+    }
+    fprintf(output(), "Directory '%s' found\n", dirName);
+    fprintf(output(), "Files in directory '%s':\n", dirName);
+    for (struct Directory *child = dir->children; child != NULL; child = child->nextSibling) {
+        fprintf(output(), "- %s/\n", child->name);
+    }
+    for (int j = 0; j < dir->numFiles; j++) {
+        fprintf(output(), "- %s\n", dir->files[j]->name);
+    }
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_LIST, start, 0, 0);
+}
+
+// Paged listings
+
+static void fillDirEntry(struct FsDirEntry *entry, const char *name, int type, uint64_t size, int64_t mtime) {
+    strcpy(entry->name, name);
+    entry->type = type;
+    entry->size = size;
+    entry->mtime = mtime;
+}
+
+// Sorted listings order entries by name, and a file before a directory of the same name
+static int dirEntryCompare(const char *name, int type, const char *otherName, int otherType) {
+    int order = strcmp(name, otherName);
+    return order != 0 ? order : type - otherType;
+}
+
+static void swapDirEntries(struct FsDirEntry *a, struct FsDirEntry *b) {
+    struct FsDirEntry held = *a;
+    *a = *b;
+    *b = held;
+}
+
+// Restore the max-heap property below heap[at]
+static void dirHeapSiftDown(struct FsDirEntry *heap, int count, int at) {
+    for (;;) {
+        int largest = at;
+        for (int child = 2 * at + 1; child <= 2 * at + 2 && child < count; child++) {
+            if (dirEntryCompare(heap[child].name, heap[child].type, heap[largest].name, heap[largest].type) > 0) {
+                largest = child;
+            }
+        }
+        if (largest == at) {
+            return;
+        }
+        swapDirEntries(&heap[at], &heap[largest]);
+        at = largest;
+    }
+}
+
+// Offer an entry to a page being sorted: `entries` is a max-heap of the `max` smallest
+// entries after the cursor seen so far
+static void offerDirEntry(struct FsDirCursor *cursor, struct FsDirEntry *entries, int max, int *count,
+                          const char *name, int type, uint64_t size, int64_t mtime) {
+    if (dirEntryCompare(name, type, cursor->lastName, cursor->lastType) <= 0) {
+        return; // already returned
+    }
+    if (*count == max) {
+        if (dirEntryCompare(name, type, entries[0].name, entries[0].type) >= 0) {
+            return;
+        }
+        fillDirEntry(&entries[0], name, type, size, mtime);
+        dirHeapSiftDown(entries, max, 0);
+        return;
+    }
+    int at = (*count)++;
+    fillDirEntry(&entries[at], name, type, size, mtime);
+    while (at > 0 && dirEntryCompare(entries[at].name, entries[at].type, entries[(at - 1) / 2].name, entries[(at - 1) / 2].type) > 0) {
+        swapDirEntries(&entries[at], &entries[(at - 1) / 2]);
+        at = (at - 1) / 2;
+    }
+}
+
+// Next page in name order: one pass over the directory keeps the smallest `max` names
+// after the cursor, so a page costs O(n log max) and never needs the whole directory sorted.
+// The cursor is the last name returned, so entries added or removed between pages do not
+// shift the ones still to come. Files whose name keys already place them before the cursor
+// or after a full page are passed over without visiting their inodes.
+static int listSortedPage(struct Directory *dir, struct FsDirCursor *cursor, struct FsDirEntry *entries, int max) {
+    int count = 0;
+    for (struct Directory *child = dir->children; child != NULL; child = child->nextSibling) {
+        offerDirEntry(cursor, entries, max, &count, child->name, FS_ENTRY_DIR, 0, child->mtime);
+    }
+    uint64_t after = nameKey(cursor->lastName);
+    for (int j = 0; j < dir->numFiles; j++) {
+        uint64_t key = dir->fileKeys[j];
+        if (key < after || (count == max && key > nameKey(entries[0].name))) {
+            continue;
+        }
+        struct Inode *file = dir->files[j];
+        offerDirEntry(cursor, entries, max, &count, file->name, FS_ENTRY_FILE, (uint64_t)file->size, file->mtime);
+    }
+
+    // Heapsort what was kept into ascending order
+    for (int end = count - 1; end > 0; end--) {
+        swapDirEntries(&entries[0], &entries[end]);
+        dirHeapSiftDown(entries, end, 0);
+    }
+    if (count > 0) {
+        strcpy(cursor->lastName, entries[count - 1].name);
+        cursor->lastType = entries[count - 1].type;
+    }
+    return count;
+}
+
+// Next page in directory order: subdirectories, then files. The cursor is a position, so
+// entries added or removed between pages may be skipped or returned twice.
+static int listUnsortedPage(struct Directory *dir, struct FsDirCursor *cursor, struct FsDirEntry *entries, int max) {
+    uint64_t numChildren = 0;
+    int count = 0;
+    for (struct Directory *child = dir->children; child != NULL; child = child->nextSibling, numChildren++) {
+        if (numChildren >= cursor->next && count < max) {
+            fillDirEntry(&entries[count++], child->name, FS_ENTRY_DIR, 0, child->mtime);
+        }
+    }
+    uint64_t pos = cursor->next + (uint64_t)count;
+    while (count < max && pos >= numChildren && pos - numChildren < (uint64_t)dir->numFiles) {
+        struct Inode *file = dir->files[pos - numChildren];
+        fillDirEntry(&entries[count++], file->name, FS_ENTRY_FILE, (uint64_t)file->size, file->mtime);
+        pos++;
+    }
+    cursor->next = pos;
+    return count;
+}
+
+//LIST A DIRECTORY A PAGE AT A TIME
+// Fills up to `max` entries, each with its type, size and modification time so callers
+// need no further lookups, starting where the cursor left off and moving it past them.
+// Returns the number of entries, 0 once the listing is complete, or -1.
+int fsListDirectory(struct Superblock *sb, const char *dirName, struct FsDirCursor *cursor, struct FsDirEntry *entries, int max) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_LIST_PAGE, dirName, traceKeep(cursor->lastName), NULL);
+    traceNumber(cursor->flags);
+    traceNumber(max);
+    traceNumber((int64_t)cursor->next);
+    traceNumber(cursor->lastType);
+    if (max <= 0) {
+        return statsDone(sb, STATS_LIST_PAGE, start, -1, 0);
+    }
+    struct Directory *dir = lockDirectory(sb, dirName, false);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_LIST_PAGE, start, -1, 0);
+    }
+    int count = (cursor->flags & FS_LIST_SORTED) ? listSortedPage(dir, cursor, entries, max)
+                                                 : listUnsortedPage(dir, cursor, entries, max);
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_LIST_PAGE, start, count, 0);
+}
+
+//CHANGE DIRECTORY
+// Moves the attached session, if there is one, and sb->cwd otherwise
+int changeDirectory(struct Superblock *sb, const char *dirName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_CD, dirName, NULL, NULL);
+    if (currentSession != NULL) {
+        struct Directory *dir = lockDirectory(sb, dirName, false);
+        if (dir == NULL) {
+            fprintf(output(), "Directory '%s' not found.\n", dirName);
+            return statsDone(sb, STATS_CD, start, -1, 0);
+        }
+        currentSession->cwd[0] = '/';
+        directoryPath(dir, currentSession->cwd + 1, sizeof(currentSession->cwd) - 1);
+        unlockDirectory(sb, dir);
+        fprintf(output(), "Changed directory to '%s'\n", currentSession->cwd);
+        return statsDone(sb, STATS_CD, start, 0, 0);
+    }
+
+    pthread_rwlock_wrlock(&sb->treeLock);
+    int i = findDirectory(sb, dirName, true);
+    if (i >= 0) {
+        // Update the current directory path
+        sb->cwd = sb->directories[i];
+        updateCurrentDirectory(sb);
+    }
+    pthread_rwlock_unlock(&sb->treeLock);
+    if (i < 0) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_CD, start, -1, 0);
+    }
+    fprintf(output(), "Changed directory to '%s'\n", sb->currentDirectory);
+    return statsDone(sb, STATS_CD, start, 0, 0);
+}
+
+// Copy one file inside the image; called with both directories held exclusively
+static int copyImageFile(struct Superblock *sb, struct Directory *src, struct Directory *dest,
+                         const char *srcDir, const char *destDir, const char *fileName) {
+    // Find the source file
+    int srcFileIndex = findFileInDirectory(src, fileName);
+    if (srcFileIndex < 0) {
+        fprintf(output(), "File '%s' not found in directory '%s'.\n", fileName, srcDir);
+        return -1;
+    }
+    struct Inode *srcFile = src->files[srcFileIndex];
+
+    // An existing file of the same name is overwritten rather than listed twice
+    int destFileIndex = findFileInDirectory(dest, fileName);
+    int replacing = destFileIndex >= 0;
+
+    uint32_t ino = replacing ? dest->files[destFileIndex]->ino : 0;
+    pthread_mutex_lock(&sb->catalogLock);
+    imageMakeRoom(sb->image, 0);
+    if (!replacing) {
+        ino = imageAllocInode(sb->image, fileName, dest->ino, 0);
+    }
+    int failed = ino == 0 || (ino != srcFile->ino && imageShare(sb->image, srcFile->ino, ino) != 0);
+    if (failed && ino != 0 && !replacing) {
+        imageFreeInode(sb->image, ino);
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (failed) {
+        fprintf(output(), "Failed to create file '%s' in directory '%s'.\n", fileName, destDir);
+        return -1;
+    }
+    struct Inode *destFile = replacing ? dest->files[destFileIndex] : addFileEntry(sb, dest->pos, fileName, ino);
+    if (destFile == NULL) {
+        catalogFreeInode(sb, ino);
+        return -1;
+    }
+    destFile->size = srcFile->size;
+    catalogFileChanged(sb, destFile);
+    fprintf(output(), "File '%s' copied from directory '%s' to directory '%s'.\n", fileName, srcDir, destDir);
+    return 0;
+}
+
+// Called with both directories locked: `dest` exclusively, and `src` too in image mode.
+// Host files are copied as one batch; a name given twice is copied once.
+static int copyFilesLocked(struct Superblock *sb, struct Directory *src, struct Directory *dest,
+                           const char *srcDir, const char *destDir, const char *fileNames[], int count, uint64_t *copied) {
+    int status = 0;
+    if (sb->image != NULL) {
+        for (int k = 0; k < count; k++) {
+            if (copyImageFile(sb, src, dest, srcDir, destDir, fileNames[k]) != 0) {
+                status = -1;
+                continue;
+            }
+            *copied += (uint64_t)dest->files[findFileInDirectory(dest, fileNames[k])]->size;
+        }
+        return status;
+    }
+
+    struct IoRequest *reqs = malloc(count * sizeof(struct IoRequest));
+    if (reqs == NULL) {
+        return -1;
+    }
+    int queued = 0;
+    for (int k = 0; k < count; k++) {
+        // Find the source file
+        int srcFileIndex = findFileInDirectory(src, fileNames[k]);
+        if (srcFileIndex < 0) {
+            fprintf(output(), "File '%s' not found in directory '%s'.\n", fileNames[k], srcDir);
+            status = -1;
+            continue;
+        }
+        struct Inode *srcFile = src->files[srcFileIndex];
+        int repeated = false;
+        for (int r = 0; r < queued && !repeated; r++) {
+            repeated = reqs[r].inode == srcFile;
+        }
+        if (repeated) {
+            continue;
+        }
+
+        // An existing file of the same name is overwritten rather than listed twice
+        struct IoRequest *req = &reqs[queued];
+        int destFileIndex = findFileInDirectory(dest, fileNames[k]);
+        if (destFileIndex >= 0) {
+            req->destIno = dest->files[destFileIndex]->ino;
+        } else if (catalogAllocInode(sb, fileNames[k], dest->ino, 0, &req->destIno) != 0) {
+            fprintf(output(), "Failed to create file '%s' in directory '%s'.\n", fileNames[k], destDir);
+            status = -1;
+            continue;
+        }
+        req->op = IO_COPY;
+        req->inode = srcFile;
+        hostFilePath(src, fileNames[k], req->path, sizeof(req->path));
+        hostFilePath(dest, fileNames[k], req->destPath, sizeof(req->destPath));
+        queued++;
+    }
+    ioRunBatch(sb, reqs, queued);
+
+    for (int r = 0; r < queued; r++) {
+        struct Inode *srcFile = reqs[r].inode;
+        const char *fileName = srcFile->name;
+        int destFileIndex = findFileInDirectory(dest, fileName);
+        int replacing = destFileIndex >= 0;
+        if (reqs[r].result < 0) {
+            fprintf(output(), "Failed to copy file '%s' to directory '%s'.\n", fileName, destDir);
+            if (!replacing) {
+                catalogFreeInode(sb, reqs[r].destIno);
+            }
+            status = -1;
+            continue;
+        }
+
+        // Update the directory structure in the superblock; the copy gets its own
+        // Inode so that renaming or removing one entry never touches the other
+        struct Inode *destFile = replacing ? dest->files[destFileIndex] : addFileEntry(sb, dest->pos, fileName, reqs[r].destIno);
+        if (destFile == NULL) {
+            catalogFreeInode(sb, reqs[r].destIno);
+            status = -1;
+            continue;
+        }
+        destFile->size = reqs[r].result > 0 ? (int64_t)reqs[r].result : srcFile->size;
+        catalogFileChanged(sb, destFile);
+        *copied += (uint64_t)destFile->size;
+        fprintf(output(), "File '%s' copied from directory '%s' to directory '%s'.\n", fileName, srcDir, destDir);
+    }
+    free(reqs);
+    return status;
+}
+
+//COPY FILES FROM ONE DIRECTORY TO ANOTHER
+// Host files are copied in parallel, as one batch
+int copyFiles(struct Superblock *sb, const char *srcDir, const char *destDir, const char *fileNames[], int count) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_COPY, srcDir, destDir, NULL);
+    traceNames(fileNames, count);
+    journalOperation(sb);
+    const char *paths[2] = {srcDir, destDir};
+    int pos[2];
+    lockTree(sb, paths, 2, pos);
+    if (pos[0] < 0 || pos[1] < 0) {
+        pthread_rwlock_unlock(&sb->treeLock);
+        if (pos[0] < 0) {
+            for (int k = 0; k < count; k++) {
+                fprintf(output(), "File '%s' not found in directory '%s'.\n", fileNames[k], srcDir);
+            }
+        } else {
+            fprintf(output(), "Directory '%s' not found.\n", destDir);
+        }
+        return statsDone(sb, STATS_COPY, start, -1, 0);
+    }
+
+    // An image copy rewrites the source's inode as well, so then both are held exclusively
+    struct Directory *src = sb->directories[pos[0]], *dest = sb->directories[pos[1]];
+    int srcWrite = sb->image != NULL;
+    if (src == dest) {
+        lockEntries(dest, true);
+    } else if (pos[0] < pos[1]) {
+        lockEntries(src, srcWrite);
+        lockEntries(dest, true);
+    } else {
+        lockEntries(dest, true);
+        lockEntries(src, srcWrite);
+    }
+    uint64_t copied = 0;
+    int status = copyFilesLocked(sb, src, dest, srcDir, destDir, fileNames, count, &copied);
+    if (src != dest) {
+        pthread_rwlock_unlock(&src->lock);
+    }
+    unlockDirectory(sb, dest);
+    return statsDone(sb, STATS_COPY, start, status, copied);
+}
+
+//COPY FILE & ITS CONTENTS FROM ONE DIRECTORY TO ANOTHER
+int copyFile(struct Superblock *sb, const char *srcDir, const char *destDir, const char *fileName) {
+    return copyFiles(sb, srcDir, destDir, &fileName, 1);
+}
+
+// Called with `dir` held exclusively
+static int renameFileLocked(struct Superblock *sb, struct Directory *dir, const char *dirName, const char *oldFileName, const char *newFileName) {
+    int j = findFileInDirectory(dir, oldFileName);
+    if (j < 0) {
+        fprintf(output(), "File '%s' not found in directory '%s'.\n", oldFileName, dirName);
+        return -1;
+    }
+    if (!validName(newFileName)) {
+        fprintf(output(), "Invalid file name '%s'.\n", newFileName);
+        return -1;
+    }
+    if (findFileInDirectory(dir, newFileName) >= 0) {
+        fprintf(output(), "File '%s' already exists in directory '%s'.\n", newFileName, dirName);
+        return -1;
+    }
+
+    if (sb->image == NULL) {
+        // Rename the file on disk
+        char oldPath[HOST_PATH_LENGTH];
+        char newPath[HOST_PATH_LENGTH];
+        hostFilePath(dir, oldFileName, oldPath, sizeof(oldPath));
+        hostFilePath(dir, newFileName, newPath, sizeof(newPath));
+
+        // Dirty blocks still point at the old path
+        if (sb->cache != NULL) {
+            cacheSyncFile(sb->cache, dir->files[j]->ino, true, false);
+        }
+
+        if (rename(oldPath, newPath) != 0) {
+            fprintf(output(), "Failed to rename file '%s' to '%s' on disk.\n", oldFileName, newFileName);
+            return -1;
+        }
+    }
+
+    // Update the file's name in metadata and move it to its new index slot
+    catalogRenameInode(sb, dir->files[j]->ino, newFileName);
+    nameIndexRemove(&dir->fileIndex, dir->fileHashes[j], j);
+    pthread_mutex_lock(&sb->nameLock);
+    removeNameEntry(sb, dir->files[j]);
+    strcpy(dir->files[j]->name, newFileName);
+    placeFile(dir, j, dir->files[j]);
+    indexFile(dir, j);
+    addNameEntry(sb, dir->files[j]);
+    pthread_mutex_unlock(&sb->nameLock);
+    char oldPath[HOST_PATH_LENGTH], newPath[HOST_PATH_LENGTH];
+    hostFilePath(dir, oldFileName, oldPath, sizeof(oldPath));
+    hostFilePath(dir, newFileName, newPath, sizeof(newPath));
+    renameHandles(sb, oldPath, newPath);
+
+    fprintf(output(), "File '%s' renamed to '%s' in directory '%s'.\n", oldFileName, newFileName, dirName);
+    return 0;
+}
+
+// RENAME A FILE
+int renameFile(struct Superblock *sb, const char *dirName, const char *oldFileName, const char *newFileName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_RENAME, dirName, oldFileName, newFileName);
+    journalOperation(sb);
+    struct Directory *dir = lockDirectory(sb, dirName, true);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_RENAME, start, -1, 0);
+    }
+    int status = renameFileLocked(sb, dir, dirName, oldFileName, newFileName);
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_RENAME, start, status, 0);
+}
+
+//FIND A FILE
+
+// A file that matched a find pattern
+struct FindMatch {
+    int dir;
+    int file;
+};
+
+// One worker's share of a find: a contiguous range of sb->directories
+struct FindTask {
+    struct Superblock *sb;
+    const char *pattern;
+    int firstDir;
+    int lastDir; // exclusive
+    struct FindMatch *matches;
+    int numMatches;
+    int capMatches;
+};
+
+static int isPattern(const char *name) {
+    return strpbrk(name, "*?[") != NULL;
+}
+
+static void addFindMatch(struct FindTask *task, int dir, int file) {
+    if (task->numMatches == task->capMatches) {
+        int cap = task->capMatches ? task->capMatches * 2 : 16;
+        struct FindMatch *grown = realloc(task->matches, cap * sizeof(struct FindMatch));
+        if (grown == NULL) {
+            return;
+        }
+        task->matches = grown;
+        task->capMatches = cap;
+    }
+    task->matches[task->numMatches].dir = dir;
+    task->matches[task->numMatches].file = file;
+    task->numMatches++;
+}
+
+// Match every file of the task's directory range against the pattern. When the pattern
+// starts with literal characters, the name keys are checked four at a time first and only
+// the files whose names start the same way are matched in full.
+static void *findWorker(void *arg) {
+    struct FindTask *task = arg;
+    uint64_t want = 0, mask = 0;
+    int filtered = patternKey(task->pattern, &want, &mask);
+    for (int i = task->firstDir; i < task->lastDir; i++) {
+        struct Directory *dir = task->sb->directories[i];
+        int j = 0;
+        for (; filtered && j + 4 <= dir->numFiles; j += 4) {
+            for (unsigned int hits = keyMatches4(dir->fileKeys + j, want, mask); hits != 0; hits &= hits - 1) {
+                int k = j + __builtin_ctz(hits);
+                if (fnmatch(task->pattern, dir->files[k]->name, 0) == 0) {
+                    addFindMatch(task, i, k);
+                }
+            }
+        }
+        for (; j < dir->numFiles; j++) {
+            if ((dir->fileKeys[j] & mask) == want && fnmatch(task->pattern, dir->files[j]->name, 0) == 0) {
+                addFindMatch(task, i, j);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Scan directories [firstDir, lastDir) for the pattern, splitting large scans across threads.
+// Matches are returned in directory order regardless of how the work was split.
+static struct FindTask scanForPattern(struct Superblock *sb, int firstDir, int lastDir, const char *pattern) {
+    struct FindTask tasks[FIND_MAX_THREADS];
+    pthread_t threads[FIND_MAX_THREADS];
+    int started[FIND_MAX_THREADS] = {0};
+
+    int filesInRange = 0;
+    for (int i = firstDir; i < lastDir; i++) {
+        filesInRange += sb->directories[i]->numFiles;
+    }
+
+    int numThreads = 1;
+    if (filesInRange >= FIND_PARALLEL_MIN_FILES) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = cpus < 1 ? 1 : (cpus > FIND_MAX_THREADS ? FIND_MAX_THREADS : (int)cpus);
+        if (numThreads > lastDir - firstDir) {
+            numThreads = lastDir - firstDir;
+        }
+    }
+
+    // Cut the range into contiguous partitions holding roughly equal numbers of files
+    int next = firstDir;
+    int seen = 0;
+    for (int t = 0; t < numThreads; t++) {
+        struct FindTask *task = &tasks[t];
+        memset(task, 0, sizeof(*task));
+        task->sb = sb;
+        task->pattern = pattern;
+        task->firstDir = next;
+        int target = (int)((long)filesInRange * (t + 1) / numThreads);
+        while (next < lastDir && (seen < target || t == numThreads - 1 || next == task->firstDir)) {
+            seen += sb->directories[next]->numFiles;
+            next++;
+        }
+        task->lastDir = next;
+    }
+
+    // The calling thread takes the first partition itself
+    for (int t = 1; t < numThreads; t++) {
+        started[t] = pthread_create(&threads[t], NULL, findWorker, &tasks[t]) == 0;
+        if (!started[t]) {
+            findWorker(&tasks[t]);
+        }
+    }
+    findWorker(&tasks[0]);
+
+    // Merge the per-thread results in partition order
+    for (int t = 1; t < numThreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+        for (int m = 0; m < tasks[t].numMatches; m++) {
+            addFindMatch(&tasks[0], tasks[t].matches[m].dir, tasks[t].matches[m].file);
+        }
+        free(tasks[t].matches);
+    }
+    return tasks[0];
+}
+
+static void printDirectoryMatch(const struct Directory *dir) {
+    char path[MAX_PATH_LENGTH];
+    directoryPath(dir, path, sizeof(path));
+    fprintf(output(), "Directory '/%s' found.\n", path);
+}
+
+static int compareMatchDirs(const void *a, const void *b) {
+    return ((const struct FindMatch *)a)->dir - ((const struct FindMatch *)b)->dir;
+}
+
+// Find files (and, across the whole namespace, directories) whose name matches `pattern`.
+// `pattern` may be an exact name or a glob ("log*", "*.txt", "a?c"); `dirName` limits the
+// search to one directory, or is NULL / "*" to search everywhere.
+int findFile(struct Superblock *sb, const char *dirName, const char *pattern) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_FIND, dirName, pattern, NULL);
+    int found = 0;
+    int everywhere = dirName == NULL || strcmp(dirName, "*") == 0;
+    int exact = !isPattern(pattern);
+    int firstDir = 0, lastDir = 0;
+
+    if (everywhere) {
+        // Every directory may hold a match: load the missing ones with the tree to
+        // ourselves. A pattern then holds them all shared (in order) while scanning; an
+        // exact name locks only the directories the name index points to (below).
+        pthread_rwlock_rdlock(&sb->treeLock);
+        if (sb->catalog != NULL && !sb->allLoaded) {
+            pthread_rwlock_unlock(&sb->treeLock);
+            pthread_rwlock_wrlock(&sb->treeLock);
+            if (loadAllDirectories(sb) != 0) {
+                pthread_rwlock_unlock(&sb->treeLock);
+                return statsDone(sb, STATS_FIND, start, -1, 0);
+            }
+        }
+        for (int i = 0; i < sb->numDirs && !exact; i++) {
+            lockEntries(sb->directories[i], false);
+        }
+        lastDir = exact ? 0 : sb->numDirs;
+    } else {
+        struct Directory *dir = lockDirectory(sb, dirName, false);
+        if (dir == NULL) {
+            fprintf(output(), "Directory '%s' not found.\n", dirName);
+            return statsDone(sb, STATS_FIND, start, -1, 0);
+        }
+        firstDir = dir->pos;
+        lastDir = firstDir + 1;
+    }
+
+    struct FindTask result;
+    memset(&result, 0, sizeof(result));
+
+    if (exact) {
+        // Exact names never scan: one directory probe, or one bucket of each global index
+        if (!everywhere) {
+            int j = findFileInDirectory(sb->directories[firstDir], pattern);
+            if (j >= 0) {
+                addFindMatch(&result, firstDir, j);
+            }
+        } else {
+            struct FindTask dirs;
+            memset(&dirs, 0, sizeof(dirs));
+            size_t b = hashName(pattern) & (sb->numDentryBuckets - 1);
+            for (struct Directory *dir = sb->numDentryBuckets ? sb->dirNames[b] : NULL; dir != NULL; dir = dir->nameNext) {
+                if (strcmp(dir->name, pattern) == 0) {
+                    addFindMatch(&dirs, dir->pos, -1);
+                }
+            }
+            if (dirs.numMatches > 1) {
+                qsort(dirs.matches, dirs.numMatches, sizeof(struct FindMatch), compareMatchDirs);
+            }
+            for (int m = 0; m < dirs.numMatches; m++) {
+                printDirectoryMatch(sb->directories[dirs.matches[m].dir]);
+                found++;
+            }
+            free(dirs.matches);
+
+            // The bucket names the directories to lock; each is probed again under its
+            // lock, since the file may have gone in between
+            pthread_mutex_lock(&sb->nameLock);
+            b = hashName(pattern) & (sb->numNameBuckets - 1);
+            for (struct Inode *inode = sb->numNameBuckets ? sb->nameBuckets[b] : NULL; inode != NULL; inode = inode->nameNext) {
+                if (strcmp(inode->name, pattern) == 0 && !inode->parent->detached) {
+                    addFindMatch(&result, inode->parent->pos, -1);
+                }
+            }
+            pthread_mutex_unlock(&sb->nameLock);
+            if (result.numMatches > 1) {
+                qsort(result.matches, result.numMatches, sizeof(struct FindMatch), compareMatchDirs);
+            }
+            int kept = 0;
+            for (int m = 0; m < result.numMatches; m++) {
+                struct Directory *dir = sb->directories[result.matches[m].dir];
+                lockEntries(dir, false);
+                int j = findFileInDirectory(dir, pattern);
+                if (j < 0) {
+                    pthread_rwlock_unlock(&dir->lock);
+                    continue;
+                }
+                result.matches[kept].dir = dir->pos;
+                result.matches[kept++].file = j;
+            }
+            result.numMatches = kept;
+        }
+    } else {
+        result = scanForPattern(sb, firstDir, lastDir, pattern);
+        if (everywhere) {
+            for (int i = 1; i < sb->numDirs; i++) {
+                if (fnmatch(pattern, sb->directories[i]->name, 0) == 0) {
+                    printDirectoryMatch(sb->directories[i]);
+                    found++;
+                }
+            }
+        }
+    }
+
+    for (int m = 0; m < result.numMatches; m++) {
+        struct Directory *dir = sb->directories[result.matches[m].dir];
+        char path[MAX_PATH_LENGTH];
+        directoryPath(dir, path, sizeof(path));
+        fprintf(output(), "File '%s' found in directory '/%s'.\n", dir->files[result.matches[m].file]->name, path);
+        found++;
+        if (exact && everywhere) {
+            pthread_rwlock_unlock(&dir->lock);
+        }
+    }
+    free(result.matches);
+    for (int i = firstDir; i < lastDir; i++) {
+        pthread_rwlock_unlock(&sb->directories[i]->lock);
+    }
+    pthread_rwlock_unlock(&sb->treeLock);
+
+    if (!found) {
+        fprintf(output(), "File '%s' not found.\n", pattern);
+        return statsDone(sb, STATS_FIND, start, -1, 0);
+    }
+    return statsDone(sb, STATS_FIND, start, 0, 0);
+}
+
+//PRINT LATEST DIRECTORY ACCESSED
+void printCurrentDirectoryPath(const char *currentDir) {
+    fprintf(output(), "Current directory path: %s\n", currentDir);
+}
+
+// Add `dir` and every directory below it to *list, children before their parents,
+// loading them on the way
+static int collectTree(struct Superblock *sb, struct Directory *dir, struct Directory ***list, int *count, int *cap) {
+    if (loadDirectory(sb, dir) != 0) {
+        return -1;
+    }
+    for (struct Directory *child = dir->children; child != NULL; child = child->nextSibling) {
+        if (collectTree(sb, child, list, count, cap) != 0) {
+            return -1;
+        }
+    }
+    if (*count == *cap) {
+        int newCap = *cap == 0 ? 16 : *cap * 2;
+        struct Directory **grown = realloc(*list, newCap * sizeof(struct Directory *));
+        if (grown == NULL) {
+            return -1;
+        }
+        *list = grown;
+        *cap = newCap;
+    }
+    (*list)[(*count)++] = dir;
+    return 0;
+}
+
+// A directory keeps only the first `kept` entries of its files[]
+static void keepFiles(struct Directory *dir, int kept) {
+    if (dir != NULL && kept != dir->numFiles) {
+        dir->numFiles = kept;
+        rebuildFileIndex(dir);
+    }
+}
+
+// Unlink the host files of every directory in dirs[], IO_BATCH_MAX at a time, and drop
+// the files that went from the catalog. Files that could not be removed stay listed.
+static int removeTreeFiles(struct Superblock *sb, struct Directory **dirs, int numDirs) {
+    struct IoRequest *reqs = malloc(IO_BATCH_MAX * sizeof(struct IoRequest));
+    if (reqs == NULL) {
+        return -1;
+    }
+    int status = 0, d = 0, j = 0;
+    struct Directory *current = NULL; // directory whose files[] is being compacted
+    int kept = 0;
+    while (true) {
+        int count = 0;
+        while (d < numDirs && count < IO_BATCH_MAX) {
+            if (j == dirs[d]->numFiles) {
+                d++;
+                j = 0;
+                continue;
+            }
+            // Cached blocks go first, or write-back could bring the file back
+            struct Inode *file = dirs[d]->files[j++];
+            if (sb->cache != NULL) {
+                cacheSyncFile(sb->cache, file->ino, false, true);
+            }
+            reqs[count].op = IO_UNLINK;
+            reqs[count].inode = file;
+            hostFilePath(dirs[d], file->name, reqs[count].path, sizeof(reqs[count].path));
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+        ioRunBatch(sb, reqs, count);
+
+        // Results come back in directory order, so each directory is compacted in place
+        for (int r = 0; r < count; r++) {
+            struct Inode *file = reqs[r].inode;
+            if (file->parent != current) {
+                keepFiles(current, kept);
+                current = file->parent;
+                kept = 0;
+            }
+            if (reqs[r].result != 0) {
+                fprintf(output(), "Failed to remove file '%s'.\n", reqs[r].path);
+                placeFile(current, kept++, file);
+                status = -1;
+                continue;
+            }
+            catalogFreeInode(sb, file->ino);
+            removeNameEntry(sb, file);
+            closeHandlesOf(sb, file);
+            sb->totalFiles--;
+            freeInode(current, file);
+        }
+    }
+    keepFiles(current, kept);
+    free(reqs);
+    return status;
+}
+
+// Host mode, when the tree cannot be moved to the trash: remove `dir`, its subdirectories
+// and all of their files in place, every file first (as batches of host unlinks), then
+// the directories, deepest first
+static int removeTree(struct Superblock *sb, struct Directory *dir) {
+    struct Directory **dirs = NULL;
+    int numDirs = 0, capDirs = 0;
+    if (collectTree(sb, dir, &dirs, &numDirs, &capDirs) != 0) {
+        free(dirs);
+        return -1;
+    }
+
+    int status = removeTreeFiles(sb, dirs, numDirs);
+
+    // Delete the directories themselves from the file system and the Superblock; their
+    // inodes go with their slabs
+    for (int d = 0; d < numDirs && status == 0; d++) {
+        char path[HOST_PATH_LENGTH];
+        directoryPath(dirs[d], path, sizeof(path));
+        if (remove(path) != 0) {
+            fprintf(output(), "Failed to remove directory '%s'.\n", path);
+            status = -1;
+            break;
+        }
+        catalogFreeInode(sb, dirs[d]->ino);
+        if (sb->cwd == dirs[d]) {
+            sb->cwd = dirs[d]->parent;
+        }
+        removeDirectoryEntry(sb, dirs[d]);
+    }
+    free(dirs);
+    return status;
+}
+
+// Take `dir` and every directory below it out of sb->directories and the dentry cache,
+// marking them detached; returns the number of files they hold
+static int detachDirectories(struct Superblock *sb, struct Directory *dir) {
+    int files = dir->numFiles;
+    dir->detached = true;
+    removeDentry(sb, dir);
+    takeDirectoryPosition(sb, dir);
+    for (struct Directory *child = dir->children; child != NULL; child = child->nextSibling) {
+        files += detachDirectories(sb, child);
+    }
+    return files;
+}
+
+// Detach the tree under `top` from the namespace and queue it for the reclaimer. Costs
+// one step per directory that has been loaded, and none per file. Called with
+// sb->treeLock held exclusively.
+static void detachTree(struct Superblock *sb, struct Directory *top) {
+    struct Directory **link = &top->parent->children;
+    while (*link != top) {
+        link = &(*link)->nextSibling;
+    }
+    *link = top->nextSibling;
+    int files = detachDirectories(sb, top);
+    pthread_mutex_lock(&sb->nameLock);
+    sb->totalFiles -= files;
+    pthread_mutex_unlock(&sb->nameLock);
+
+    // One pass over the open-file table closes every handle on the tree's files
+    pthread_mutex_lock(&sb->handleLock);
+    for (int fd = 0; fd < MAX_OPEN_FILES && sb->numOpenFiles > 0; fd++) {
+        struct OpenFile *file = &sb->openFiles[fd];
+        if (file->inode != NULL && file->inode->parent->detached) {
+            releaseOpenFile(sb, file);
+        }
+    }
+    pthread_mutex_unlock(&sb->handleLock);
+    if (sb->cwd->detached) {
+        sb->cwd = top->parent;
+    }
+
+    struct Reclaimer *reclaimer = sb->reclaimer;
+    pthread_mutex_lock(&reclaimer->lock);
+    top->nextSibling = reclaimer->detached;
+    reclaimer->detached = top;
+    pthread_mutex_unlock(&reclaimer->lock);
+    reclaimerWake(sb);
+}
+
+// Drop the whole namespace from memory after the catalog changed underneath it (a
+// rollback): the root's subdirectories are detached like removed trees, its files are
+// freed, and everything is read again from the catalog on first use. Called with
+// sb->treeLock held exclusively.
+static void detachNamespace(struct Superblock *sb) {
+    struct Directory *root = sb->directories[0];
+    while (root->children != NULL) {
+        detachTree(sb, root->children);
+    }
+    pthread_mutex_lock(&sb->handleLock);
+    for (int fd = 0; fd < MAX_OPEN_FILES && sb->numOpenFiles > 0; fd++) {
+        if (sb->openFiles[fd].inode != NULL && sb->openFiles[fd].inode->parent == root) {
+            releaseOpenFile(sb, &sb->openFiles[fd]);
+        }
+    }
+    pthread_mutex_unlock(&sb->handleLock);
+    pthread_mutex_lock(&sb->nameLock);
+    for (int j = 0; j < root->numFiles; j++) {
+        removeNameEntry(sb, root->files[j]);
+        freeInode(root, root->files[j]);
+    }
+    sb->totalFiles -= root->numFiles;
+    pthread_mutex_unlock(&sb->nameLock);
+    root->numFiles = 0;
+    rebuildFileIndex(root);
+    root->loaded = false;
+    sb->allLoaded = false;
+    root->mtime = sb->catalog->inodes[0].mtime;
+}
+
+//REMOVE A DIRECTORY
+// Subdirectories are removed along with it. The tree leaves the namespace at once and
+// the background reclaimer frees its files afterwards (see deferred deletion).
+int removeDirectory(struct Superblock *sb, const char *dirName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_RMDIR, dirName, NULL, NULL);
+    journalOperation(sb);
+    pthread_rwlock_wrlock(&sb->treeLock);
+    // Find the directory
+    int i = findDirectory(sb, dirName, true);
+    if (i <= 0) {
+        pthread_rwlock_unlock(&sb->treeLock);
+        if (i < 0) {
+            fprintf(output(), "Directory '%s' not found.\n", dirName);
+        } else {
+            fprintf(output(), "Cannot remove the root directory.\n");
+        }
+        return statsDone(sb, STATS_RMDIR, start, -1, 0);
+    }
+
+    // The current directory may be inside the tree; it falls back to the nearest survivor
+    struct Directory *dir = sb->directories[i];
+    int status = 0;
+    char path[HOST_PATH_LENGTH];
+    directoryPath(dir, path, sizeof(path));
+    if (sb->image == NULL && hostTrash(sb, path) != 0) {
+        status = removeTree(sb, dir);
+    } else {
+        catalogOrphanInode(sb, dir->ino);
+        detachTree(sb, dir);
+    }
+    updateCurrentDirectory(sb);
+    pthread_rwlock_unlock(&sb->treeLock);
+    if (status != 0) {
+        return statsDone(sb, STATS_RMDIR, start, -1, 0);
+    }
+
+    fprintf(output(), "Directory '%s' removed.\n", dirName);
+    return statsDone(sb, STATS_RMDIR, start, 0, 0);
+}
+
+// Called with `dir` held exclusively. The host files are unlinked as one batch before
+// anything else changes, so a failure leaves that file's metadata untouched; a name
+// given twice is removed once. Each removed file's catalog inode, and in image mode its
+// data, is left for the reclaimer.
+static int removeFilesLocked(struct Superblock *sb, struct Directory *dir, const char *dirName, const char *fileNames[], int count) {
+    struct IoRequest *reqs = malloc(count * sizeof(struct IoRequest));
+    if (reqs == NULL) {
+        return -1;
+    }
+
+    int status = 0, queued = 0;
+    for (int k = 0; k < count; k++) {
+        int j = findFileInDirectory(dir, fileNames[k]);
+        if (j < 0) {
+            fprintf(output(), "File '%s' not found in directory '%s'.\n", fileNames[k], dirName);
+            status = -1;
+            continue;
+        }
+        int repeated = false;
+        for (int r = 0; r < queued && !repeated; r++) {
+            repeated = reqs[r].inode == dir->files[j];
+        }
+        if (repeated) {
+            continue;
+        }
+        reqs[queued].op = IO_UNLINK;
+        reqs[queued].inode = dir->files[j];
+        reqs[queued].result = 0;
+        if (sb->image == NULL) {
+            if (sb->cache != NULL) {
+                cacheSyncFile(sb->cache, dir->files[j]->ino, false, true);
+            }
+            hostFilePath(dir, fileNames[k], reqs[queued].path, sizeof(reqs[queued].path));
+        }
+        queued++;
+    }
+    if (sb->image == NULL) {
+        ioRunBatch(sb, reqs, queued);
+    }
+
+    int orphaned = false;
+    for (int r = 0; r < queued; r++) {
+        struct Inode *file = reqs[r].inode;
+        if (reqs[r].result != 0) {
+            fprintf(output(), "Failed to remove file '%s' from directory '%s'.\n", file->name, dirName);
+            status = -1;
+            continue;
+        }
+        catalogOrphanInode(sb, file->ino);
+        orphaned = sb->catalog != NULL;
+        pthread_mutex_lock(&sb->nameLock);
+        removeNameEntry(sb, file);
+        sb->totalFiles--;
+        pthread_mutex_unlock(&sb->nameLock);
+        closeHandlesOf(sb, file);
+        detachFile(dir, findFileInDirectory(dir, file->name));
+        fprintf(output(), "File '%s' removed from directory '%s'.\n", file->name, dirName);
+        freeInode(dir, file);
+    }
+    if (orphaned) {
+        reclaimerWake(sb);
+    }
+    free(reqs);
+    return status;
+}
+
+//REMOVE FILES
+// Removes several files of one directory, unlinking their host files as one batch
+int removeFiles(struct Superblock *sb, const char *dirName, const char *fileNames[], int count) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_REMOVE, dirName, NULL, NULL);
+    traceNames(fileNames, count);
+    journalOperation(sb);
+    struct Directory *dir = lockDirectory(sb, dirName, true);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_REMOVE, start, -1, 0);
+    }
+    int status = removeFilesLocked(sb, dir, dirName, fileNames, count);
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_REMOVE, start, status, 0);
+}
+
+//REMOVE A FILE
+int removeFile(struct Superblock *sb, const char *dirName, const char *fileName) {
+    return removeFiles(sb, dirName, &fileName, 1);
+}
+
+// Called with sb->treeLock held exclusively
+static int renameDirectoryLocked(struct Superblock *sb, const char *oldDirName, const char *newDirName) {
+    int i = findDirectory(sb, oldDirName, true);
+    if (i < 0) {
+        fprintf(output(), "Directory '%s' not found.\n", oldDirName);
+        return -1;
+    }
+    if (i == 0) {
+        fprintf(output(), "Cannot rename the root directory.\n");
+        return -1;
+    }
+    struct Directory *dir = sb->directories[i];
+    if (!validName(newDirName) || strlen(newDirName) >= MAX_DIR_NAME_LENGTH) {
+        fprintf(output(), "Invalid directory name '%s'.\n", newDirName);
+        return -1;
+    }
+    if (lookupDentry(sb, dir->parent, newDirName) != NULL) {
+        fprintf(output(), "Directory '%s' already exists.\n", newDirName);
+        return -1;
+    }
+
+    char oldPath[HOST_PATH_LENGTH];
+    char newPath[HOST_PATH_LENGTH];
+    directoryPath(dir, oldPath, sizeof(oldPath));
+    hostFilePath(dir->parent, newDirName, newPath, sizeof(newPath));
+    if (strlen(newPath) >= MAX_PATH_LENGTH) {
+        fprintf(output(), "Path '%s' is too long.\n", newPath);
+        return -1;
+    }
+
+    if (sb->image == NULL) {
+        // Dirty blocks of every file inside still point at the old path
+        if (sb->cache != NULL) {
+            cacheFlushAll(sb->cache);
+        }
+
+        // Rename the directory on disk
+        if (rename(oldPath, newPath) != 0) {
+            fprintf(output(), "Failed to rename directory '%s' to '%s' on disk.\n", oldDirName, newDirName);
+            return -1;
+        }
+    }
+
+    // Update the directory name in metadata and its dentry
+    catalogRenameInode(sb, dir->ino, newDirName);
+    removeDentry(sb, dir);
+    strcpy(dir->name, newDirName);
+    addDentry(sb, dir);
+    renameHandles(sb, oldPath, newPath);
+    updateCurrentDirectory(sb);
+
+    fprintf(output(), "Directory '%s' renamed to '%s'.\n", oldDirName, newDirName);
+    return 0;
+}
+
+//RENAME A DIRECTORY
+// `newDirName` is the new last component; the directory stays under the same parent
+int renameDirectory(struct Superblock *sb, const char *oldDirName, const char *newDirName) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_RENAME_DIR, oldDirName, newDirName, NULL);
+    journalOperation(sb);
+    pthread_rwlock_wrlock(&sb->treeLock);
+    int status = renameDirectoryLocked(sb, oldDirName, newDirName);
+    pthread_rwlock_unlock(&sb->treeLock);
+    return statsDone(sb, STATS_RENAME_DIR, start, status, 0);
+}
+
+// Truncate an open file; the caller holds its directory exclusively
+static int truncateLocked(struct Superblock *sb, struct OpenFile *file, long size) {
+    if (size < 0) {
+        fprintf(output(), "Invalid size %ld.\n", size);
+        return -1;
+    }
+
+    if (sb->image != NULL) {
+        static const unsigned char zeros[IMAGE_BLOCK_SIZE];
+        uint32_t ino = file->inode->ino;
+        pthread_mutex_lock(&sb->catalogLock);
+        uint64_t pos = imageDataOf(sb->image, ino)->size;
+        imageMakeRoom(sb->image, (uint64_t)size > pos ? (uint64_t)size - pos : 0);
+        if ((uint64_t)size <= pos && imageTruncate(sb->image, ino, (uint64_t)size) != 0) {
+            pthread_mutex_unlock(&sb->catalogLock);
+            fprintf(output(), "Failed to truncate file '%s': image full.\n", file->inode->name);
+            return -1;
+        }
+        while (pos < (uint64_t)size) {
+            size_t chunk = (uint64_t)size - pos < IMAGE_BLOCK_SIZE ? (size_t)((uint64_t)size - pos) : IMAGE_BLOCK_SIZE;
+            size_t written = imageWrite(sb->image, ino, pos, zeros, chunk);
+            pos += written;
+            if (written != chunk) {
+                pthread_mutex_unlock(&sb->catalogLock);
+                file->inode->size = (int64_t)pos;
+                fprintf(output(), "Failed to truncate file '%s': image full.\n", file->inode->name);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&sb->catalogLock);
+        file->inode->size = (int64_t)size;
+        catalogFileChanged(sb, file->inode);
+        return 0;
+    }
+
+    if (hostTruncate(sb, file, (uint64_t)size) != 0) {
+        fprintf(output(), "Failed to truncate file '%s'.\n", file->inode->name);
+        return -1;
+    }
+    return 0;
+}
+
+// Open a file of `dir`, which the caller holds (exclusively for FS_CREATE or FS_TRUNCATE)
+static int openLocked(struct Superblock *sb, struct Directory *dir, const char *dirName, const char *fileName, int flags) {
+    int j = findFileInDirectory(dir, fileName);
+    if (j < 0 && (flags & FS_CREATE)) {
+        if (createFileLocked(sb, dir, dirName, fileName) != 0) {
+            return -1;
+        }
+        j = findFileInDirectory(dir, fileName);
+    }
+    if (j < 0) {
+        fprintf(output(), "File '%s' not found in directory '%s'.\n", fileName, dirName);
+        return -1;
+    }
+
+    pthread_mutex_lock(&sb->handleLock);
+    int fd = 0;
+    while (fd < MAX_OPEN_FILES && sb->openFiles[fd].inode != NULL) {
+        fd++;
+    }
+    if (fd == MAX_OPEN_FILES) {
+        pthread_mutex_unlock(&sb->handleLock);
+        fprintf(output(), "Too many open files.\n");
+        return -1;
+    }
+    struct OpenFile *file = &sb->openFiles[fd];
+    hostFilePath(dir, fileName, file->path, sizeof(file->path));
+    file->hostFd = -1;
+    if (sb->image == NULL && sb->cache == NULL) {
+        file->hostFd = open(file->path, O_RDWR);
+        if (file->hostFd < 0) {
+            pthread_mutex_unlock(&sb->handleLock);
+            fprintf(output(), "Failed to open file '%s'.\n", fileName);
+            return -1;
+        }
+    }
+    file->inode = dir->files[j];
+    file->flags = flags & FS_APPEND;
+    file->offset = 0;
+    sb->numOpenFiles++;
+    pthread_mutex_unlock(&sb->handleLock);
+
+    if ((flags & FS_TRUNCATE) && truncateLocked(sb, file, 0) != 0) {
+        pthread_mutex_lock(&sb->handleLock);
+        releaseOpenFile(sb, file);
+        pthread_mutex_unlock(&sb->handleLock);
+        return -1;
+    }
+    return fd;
+}
+
+//OPEN A FILE
+// Returns a handle for the file, or -1. FS_CREATE creates a missing file, FS_TRUNCATE
+// empties it and FS_APPEND makes every fsWrite append.
+int fsOpen(struct Superblock *sb, const char *dirName, const char *fileName, int flags) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_OPEN, dirName, fileName, NULL);
+    traceNumber(flags);
+    int changes = (flags & (FS_CREATE | FS_TRUNCATE)) != 0;
+    if (changes) {
+        journalOperation(sb);
+    }
+    struct Directory *dir = lockDirectory(sb, dirName, changes);
+    if (dir == NULL) {
+        fprintf(output(), "Directory '%s' not found.\n", dirName);
+        return statsDone(sb, STATS_OPEN, start, -1, 0);
+    }
+    int fd = openLocked(sb, dir, dirName, fileName, flags);
+    unlockDirectory(sb, dir);
+    return statsDone(sb, STATS_OPEN, start, fd, 0);
+}
+
+// Read from an open file whose directory the caller holds
+static long preadLocked(struct Superblock *sb, struct OpenFile *file, void *buf, size_t len, long offset) {
+    if (offset < 0) {
+        fprintf(output(), "Invalid offset %ld.\n", offset);
+        return -1;
+    }
+    if (sb->image != NULL) {
+        return (long)imageReadAt(sb->image, file->inode->ino, (uint64_t)offset, buf, len);
+    }
+    return hostPread(sb, file, buf, len, (uint64_t)offset);
+}
+
+//READ FROM A FILE HANDLE AT AN OFFSET
+long fsPread(struct Superblock *sb, int fd, void *buf, size_t len, long offset) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_PREAD, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber((int64_t)len);
+    traceNumber(offset);
+    struct OpenFile *file = lockHandle(sb, fd, false);
+    if (file == NULL) {
+        return statsDone(sb, STATS_HANDLE_READ, start, -1, 0);
+    }
+    long got = preadLocked(sb, file, buf, len, offset);
+    unlockHandle(sb, file);
+    return statsDone(sb, STATS_HANDLE_READ, start, got, got > 0 ? (uint64_t)got : 0);
+}
+
+//READ FROM A FILE HANDLE
+long fsRead(struct Superblock *sb, int fd, void *buf, size_t len) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_READ, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber((int64_t)len);
+    struct OpenFile *file = lockHandle(sb, fd, false);
+    if (file == NULL) {
+        return statsDone(sb, STATS_HANDLE_READ, start, -1, 0);
+    }
+    long got = preadLocked(sb, file, buf, len, (long)file->offset);
+    if (got > 0) {
+        file->offset += (uint64_t)got;
+    }
+    unlockHandle(sb, file);
+    return statsDone(sb, STATS_HANDLE_READ, start, got, got > 0 ? (uint64_t)got : 0);
+}
+
+// Write to an open file whose directory the caller holds exclusively
+static long pwriteLocked(struct Superblock *sb, struct OpenFile *file, const void *data, size_t len, long offset) {
+    if (offset < 0) {
+        fprintf(output(), "Invalid offset %ld.\n", offset);
+        return -1;
+    }
+
+    if (sb->image != NULL) {
+        pthread_mutex_lock(&sb->catalogLock);
+        imageMakeRoom(sb->image, len);
+        size_t written = imageWrite(sb->image, file->inode->ino, (uint64_t)offset, data, len);
+        pthread_mutex_unlock(&sb->catalogLock);
+        if ((uint64_t)offset + written > (uint64_t)file->inode->size) {
+            file->inode->size = (int64_t)(offset + written);
+        }
+        if (written > 0) {
+            catalogFileChanged(sb, file->inode);
+        }
+        if (written != len) {
+            fprintf(output(), "Failed to write file '%s': image full.\n", file->inode->name);
+            return written > 0 ? (long)written : -1;
+        }
+        return (long)written;
+    }
+
+    long written = hostPwrite(sb, file, data, len, (uint64_t)offset);
+    if (written < 0) {
+        fprintf(output(), "Failed to write file '%s'.\n", file->inode->name);
+    }
+    return written;
+}
+
+//WRITE TO A FILE HANDLE AT AN OFFSET
+// Only the bytes written change; a write past the end grows the file (any gap reads as zeros).
+long fsPwrite(struct Superblock *sb, int fd, const void *data, size_t len, long offset) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_PWRITE, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber((int64_t)len);
+    traceNumber(offset);
+    journalOperation(sb);
+    struct OpenFile *file = lockHandle(sb, fd, true);
+    if (file == NULL) {
+        return statsDone(sb, STATS_HANDLE_WRITE, start, -1, 0);
+    }
+    long written = pwriteLocked(sb, file, data, len, offset);
+    unlockHandle(sb, file);
+    return statsDone(sb, STATS_HANDLE_WRITE, start, written, written > 0 ? (uint64_t)written : 0);
+}
+
+//APPEND TO A FILE HANDLE
+// Writes at the end of the file and leaves the handle's offset after the new data
+long fsAppend(struct Superblock *sb, int fd, const void *data, size_t len) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_APPEND, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber((int64_t)len);
+    journalOperation(sb);
+    struct OpenFile *file = lockHandle(sb, fd, true);
+    if (file == NULL) {
+        return statsDone(sb, STATS_HANDLE_WRITE, start, -1, 0);
+    }
+    long end = file->inode->size;
+    long written = pwriteLocked(sb, file, data, len, end);
+    if (written > 0) {
+        file->offset = (uint64_t)(end + written);
+    }
+    unlockHandle(sb, file);
+    return statsDone(sb, STATS_HANDLE_WRITE, start, written, written > 0 ? (uint64_t)written : 0);
+}
+
+//WRITE TO A FILE HANDLE
+long fsWrite(struct Superblock *sb, int fd, const void *data, size_t len) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_WRITE, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber((int64_t)len);
+    journalOperation(sb);
+    struct OpenFile *file = lockHandle(sb, fd, true);
+    if (file == NULL) {
+        return statsDone(sb, STATS_HANDLE_WRITE, start, -1, 0);
+    }
+    long offset = (file->flags & FS_APPEND) ? file->inode->size : (long)file->offset;
+    long written = pwriteLocked(sb, file, data, len, offset);
+    if (written > 0) {
+        file->offset = (uint64_t)(offset + written);
+    }
+    unlockHandle(sb, file);
+    return statsDone(sb, STATS_HANDLE_WRITE, start, written, written > 0 ? (uint64_t)written : 0);
+}
+
+//MOVE A FILE HANDLE'S OFFSET
+// whence is SEEK_SET, SEEK_CUR or SEEK_END; returns the new offset, or -1
+long fsSeek(struct Superblock *sb, int fd, long offset, int whence) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_SEEK, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber(offset);
+    traceNumber(whence);
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        fprintf(output(), "Invalid seek origin %d.\n", whence);
+        return statsDone(sb, STATS_SEEK, start, -1, 0);
+    }
+    struct OpenFile *file = lockHandle(sb, fd, false);
+    if (file == NULL) {
+        return statsDone(sb, STATS_SEEK, start, -1, 0);
+    }
+    long base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (long)file->offset : file->inode->size;
+    if (base + offset >= 0) {
+        file->offset = (uint64_t)(base + offset);
+    }
+    unlockHandle(sb, file);
+    if (base + offset < 0) {
+        fprintf(output(), "Invalid offset %ld.\n", base + offset);
+        return statsDone(sb, STATS_SEEK, start, -1, 0);
+    }
+    return statsDone(sb, STATS_SEEK, start, base + offset, 0);
+}
+
+//TRUNCATE A FILE HANDLE
+// Shrinks the file, or grows it with zeros, to `size` bytes; the offset is left alone
+int fsTruncate(struct Superblock *sb, int fd, long size) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_TRUNCATE, NULL, NULL, NULL);
+    traceNumber(fd);
+    traceNumber(size);
+    journalOperation(sb);
+    struct OpenFile *file = lockHandle(sb, fd, true);
+    if (file == NULL) {
+        return statsDone(sb, STATS_TRUNCATE, start, -1, 0);
+    }
+    int status = truncateLocked(sb, file, size);
+    unlockHandle(sb, file);
+    return statsDone(sb, STATS_TRUNCATE, start, status, 0);
+}
+
+//CLOSE A FILE HANDLE
+int fsClose(struct Superblock *sb, int fd) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_CLOSE, NULL, NULL, NULL);
+    traceNumber(fd);
+    pthread_mutex_lock(&sb->handleLock);
+    int open = fd >= 0 && fd < MAX_OPEN_FILES && sb->openFiles[fd].inode != NULL;
+    if (open) {
+        releaseOpenFile(sb, &sb->openFiles[fd]);
+    }
+    pthread_mutex_unlock(&sb->handleLock);
+    if (!open) {
+        fprintf(output(), "Invalid file handle %d.\n", fd);
+        return statsDone(sb, STATS_CLOSE, start, -1, 0);
+    }
+    return statsDone(sb, STATS_CLOSE, start, 0, 0);
+}
+
+// Snapshot store of the mounted image, opened on first use; NULL (with a message) when
+// there is no image or the store cannot be opened. Called with sb->catalogLock held.
+static struct SnapshotStore *snapshotStore(struct Superblock *sb, int create) {
+    if (sb->image == NULL) {
+        fprintf(output(), "Snapshots need a disk image.\n");
+        return NULL;
+    }
+    if (sb->image->snapshots == NULL && create && snapshotAttach(sb->image, true) != 0) {
+        fprintf(output(), "Failed to open the snapshot store.\n");
+    }
+    return sb->image->snapshots;
+}
+
+// Position of snapshot `name` in the mounted image's store, with a message when there is
+// none. Called with sb->catalogLock held.
+static int findSnapshot(struct Superblock *sb, const char *name) {
+    struct SnapshotStore *store = snapshotStore(sb, false);
+    int s = snapshotFind(store, name);
+    if (s < 0 && sb->image != NULL) {
+        fprintf(output(), "Snapshot '%s' not found.\n", name);
+    }
+    return s;
+}
+
+//TAKE A SNAPSHOT
+// Freezes the image as it is now under `name`, in O(1) (see snapshots): it can be listed,
+// read and rolled back to until it is deleted.
+int fsSnapshot(struct Superblock *sb, const char *name) {
+    if (!validName(name) || strlen(name) >= MAX_FILE_NAME_LENGTH) {
+        fprintf(output(), "Invalid snapshot name '%s'.\n", name);
+        return -1;
+    }
+    pthread_mutex_lock(&sb->catalogLock);
+    struct SnapshotStore *store = snapshotStore(sb, true);
+    int status = -1;
+    if (store != NULL && snapshotFind(store, name) >= 0) {
+        fprintf(output(), "Snapshot '%s' already exists.\n", name);
+    } else if (store != NULL && journalCommit(sb->image) == 0) {
+        status = snapshotCreate(sb->image, name);
+        if (status != 0) {
+            int full = true;
+            for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+                full &= store->maps[s] != NULL;
+            }
+            if (full) {
+                fprintf(output(), "The image already has %d snapshots.\n", MAX_SNAPSHOTS);
+            } else {
+                fprintf(output(), "Failed to take snapshot '%s'.\n", name);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (status == 0) {
+        fprintf(output(), "Snapshot '%s' taken.\n", name);
+    }
+    return status;
+}
+
+//LIST SNAPSHOTS
+// Oldest first, with when each was taken and how many metadata blocks it holds copies of
+int fsListSnapshots(struct Superblock *sb) {
+    pthread_mutex_lock(&sb->catalogLock);
+    if (sb->image == NULL) {
+        pthread_mutex_unlock(&sb->catalogLock);
+        fprintf(output(), "Snapshots need a disk image.\n");
+        return -1;
+    }
+    struct SnapshotStore *store = sb->image->snapshots;
+    int order[MAX_SNAPSHOTS], count = 0;
+    for (int s = 0; store != NULL && s < MAX_SNAPSHOTS; s++) {
+        if (store->maps[s] == NULL) {
+            continue;
+        }
+        int at = count++;
+        while (at > 0 && store->header.snapshots[order[at - 1]].sequence > store->header.snapshots[s].sequence) {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = s;
+    }
+    if (count == 0) {
+        fprintf(output(), "No snapshots.\n");
+    }
+    for (int k = 0; k < count; k++) {
+        struct DiskSnapshot *entry = &store->header.snapshots[order[k]];
+        uint32_t copied = 0;
+        for (uint32_t block = 0; block < store->header.metaBlocks; block++) {
+            copied += store->maps[order[k]][block] != 0;
+        }
+        char when[32] = "-";
+        time_t created = (time_t)entry->created;
+        struct tm local;
+        if (localtime_r(&created, &local) != NULL) {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+        }
+        fprintf(output(), "- %s  taken %s, %u metadata block%s copied\n", entry->name, when, copied, copied == 1 ? "" : "s");
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    return 0;
+}
+
+//LIST A DIRECTORY OF A SNAPSHOT
+// Paths start at the snapshot's root, whatever the current directory is
+int fsSnapshotListDirectory(struct Superblock *sb, const char *name, const char *dirName) {
+    pthread_mutex_lock(&sb->catalogLock);
+    int s = findSnapshot(sb, name);
+    struct Image *img = sb->image;
+    uint32_t dir;
+    if (s < 0 || journalCommit(img) != 0 || snapshotFindDirectory(img, s, dirName, &dir) != 0) {
+        pthread_mutex_unlock(&sb->catalogLock);
+        if (s >= 0) {
+            fprintf(output(), "Directory '%s' not found in snapshot '%s'.\n", dirName, name);
+        }
+        return -1;
+    }
+    fprintf(output(), "Files in directory '%s' of snapshot '%s':\n", dirName, name);
+    struct DiskInode inode;
+    int status = snapshotInode(img, s, dir, &inode);
+    uint32_t first = inode.firstChild, ino = status == 0 ? first : 0;
+    for (uint32_t seen = 0; ino != 0 && seen < img->super->numInodes; seen++) {
+        if ((status = snapshotInode(img, s, ino, &inode)) != 0) {
+            break;
+        }
+        fprintf(output(), "- %.*s%s\n", MAX_FILE_NAME_LENGTH, inode.name, (inode.flags & IMAGE_INODE_DIR) ? "/" : "");
+        ino = inode.nextSibling != first ? inode.nextSibling : 0;
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (status != 0) {
+        fprintf(output(), "Failed to read snapshot '%s'.\n", name);
+    }
+    return status;
+}
+
+//READ A FILE OF A SNAPSHOT
+// Writes the file's contents as the snapshot saw them to the output's descriptor
+int fsSnapshotReadFile(struct Superblock *sb, const char *name, const char *dirName, const char *fileName) {
+    pthread_mutex_lock(&sb->catalogLock);
+    int s = findSnapshot(sb, name);
+    struct Image *img = sb->image;
+    uint32_t dir, ino = 0;
+    struct DiskInode inode;
+    if (s >= 0 && journalCommit(img) == 0 && snapshotFindDirectory(img, s, dirName, &dir) == 0) {
+        ino = snapshotFindEntry(img, s, dir, fileName, false);
+    }
+    if (ino == 0 || snapshotInode(img, s, ino, &inode) != 0
+            || (inode.dataIno != 0 && snapshotInode(img, s, inode.dataIno, &inode) != 0)) {
+        pthread_mutex_unlock(&sb->catalogLock);
+        if (s >= 0) {
+            fprintf(output(), "File '%s' not found in directory '%s' of snapshot '%s'.\n", fileName, dirName, name);
+        }
+        return -1;
+    }
+    // The blocks it reads are pinned for as long as the snapshot exists
+    FILE *out = output();
+    fflush(out);
+    long written = imageReadInode(img, &inode, 0, UINT64_MAX, fileno(out));
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (written < 0) {
+        fprintf(output(), "Failed to read file '%s'.\n", fileName);
+        return -1;
+    }
+    return 0;
+}
+
+//ROLL BACK TO A SNAPSHOT
+// Makes the image what it was when snapshot `name` was taken. The cost is one journaled
+// change of the metadata blocks changed since then; every snapshot, this one included,
+// stays. Open handles are closed and each directory is read again on first use.
+int fsRollback(struct Superblock *sb, const char *name) {
+    pthread_rwlock_wrlock(&sb->treeLock);
+    pthread_mutex_lock(&sb->catalogLock);
+    int s = findSnapshot(sb, name);
+    struct Image *img = sb->image;
+    int status = -1;
+    if (s >= 0 && journalCommit(img) == 0 && snapshotRestore(img, s) == 0) {
+        // Snapshots that share the blocks being replaced get copies of them first
+        status = journalCommit(img) == 0 && snapshotRepin(img) == 0 ? 0 : -1;
+        if (img->dedup != NULL) {
+            dedupDestroy(img->dedup);
+            img->dedup = NULL;
+            dedupBuild(img);
+        }
+    }
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (s >= 0 && status == 0) {
+        detachNamespace(sb);
+    }
+    updateCurrentDirectory(sb);
+    pthread_rwlock_unlock(&sb->treeLock);
+    if (s < 0) {
+        return -1;
+    }
+    if (status != 0) {
+        fprintf(output(), "Failed to roll back to snapshot '%s'.\n", name);
+        return -1;
+    }
+    fprintf(output(), "Rolled back to snapshot '%s'.\n", name);
+    return 0;
+}
+
+//DELETE A SNAPSHOT
+// Frees the metadata copies and the data blocks only it was keeping
+int fsDeleteSnapshot(struct Superblock *sb, const char *name) {
+    pthread_mutex_lock(&sb->catalogLock);
+    int s = findSnapshot(sb, name);
+    int status = s >= 0 && journalCommit(sb->image) == 0 ? snapshotDelete(sb->image, s) : -1;
+    pthread_mutex_unlock(&sb->catalogLock);
+    if (s < 0) {
+        return -1;
+    }
+    if (status != 0) {
+        fprintf(output(), "Failed to delete snapshot '%s'.\n", name);
+        return -1;
+    }
+    fprintf(output(), "Snapshot '%s' deleted.\n", name);
+    return 0;
+}
+
+//MAKE METADATA DURABLE
+// Commits the open journal group now instead of waiting for it to fill
+int fsSync(struct Superblock *sb) {
+    uint64_t start = statsStart(sb);
+    traceBegin(FS_OP_SYNC, NULL, NULL, NULL);
+    if (sb->catalog == NULL) {
+        return statsDone(sb, STATS_SYNC, start, 0, 0);
+    }
+    pthread_mutex_lock(&sb->catalogLock);
+    int status = journalCommit(sb->catalog);
+    pthread_mutex_unlock(&sb->catalogLock);
+    return statsDone(sb, STATS_SYNC, start, status, 0);
+}
+
+//ATTACH A SESSION TO THE CALLING THREAD
+// Until it is detached (NULL), the thread's output and relative paths are the session's
+void fsAttachSession(struct FsSession *session) {
+    currentSession = session;
+}
+
+//OUTPUT STREAM OF THE CALLING THREAD
+// The attached session's stream, or standard output
+FILE *fsOutput(void) {
+    return output();
+}
+
+//CURRENT DIRECTORY OF THE CALLING THREAD
+const char *fsWorkingDirectory(struct Superblock *sb) {
+    return currentSession != NULL ? currentSession->cwd : sb->currentDirectory;
+}
+
+//SHUT DOWN
+// Close open handles, finish pending deletions, write back cached data, release the
+// image and free the catalog
+void closeFileSystem(struct Superblock *sb) {
+    if (sb->tracer != NULL) {
+        if (traceFinish(sb, sb->tracer) == -1) {
+            fprintf(output(), "Failed to write the trace.\n");
+        }
+        pthread_mutex_destroy(&sb->tracer->lock);
+        free(sb->tracer->callers);
+        free(sb->tracer);
+        sb->tracer = NULL;
+    }
+    for (int fd = 0; fd < MAX_OPEN_FILES && sb->numOpenFiles > 0; fd++) {
+        if (sb->openFiles[fd].inode != NULL) {
+            releaseOpenFile(sb, &sb->openFiles[fd]);
+        }
+    }
+    reclaimerStop(sb);
+    while (reclaimBatch(sb)) {
+        // without pausing: nothing else is running
+    }
+    if (sb->cache != NULL) {
+        cacheDestroy(sb->cache);
+        sb->cache = NULL;
+    }
+    unmountImage(sb);
+
+    // Free the in-memory catalog
+    for (int i = 0; i < sb->numDirs; i++) {
+        freeDirectory(sb->directories[i]);
+    }
+    free(sb->directories);
+    free(sb->dentries);
+    free(sb->dirNames);
+    free(sb->nameBuckets);
+    free(sb->stats);
+    sb->directories = NULL;
+    sb->dentries = NULL;
+    sb->dirNames = NULL;
+    sb->nameBuckets = NULL;
+    sb->numDirs = 0;
+    sb->totalFiles = 0;
+    sb->cwd = NULL;
+    sb->stats = NULL;
+    sb->statsEnabled = false;
+    pthread_rwlock_destroy(&sb->treeLock);
+    pthread_mutex_destroy(&sb->nameLock);
+    pthread_mutex_destroy(&sb->catalogLock);
+    pthread_mutex_destroy(&sb->handleLock);
+    pthread_mutex_destroy(&sb->reclaimer->lock);
+    pthread_cond_destroy(&sb->reclaimer->wake);
+    free(sb->reclaimer);
+    sb->reclaimer = NULL;
+}
@@ -0,0 +1,273 @@
+//mini-FileSystem library interface
+// Link filesystem.c (or libminifs.a) and drive the file system through these calls
+// instead of the interactive menu in main.c.
+
+#ifndef FILESYSTEM_H
+#define FILESYSTEM_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+//define MACROS
+
+#define MAX_FILE_NAME_LENGTH 50
+#define MAX_FILE_CONTENT_LENGTH 1000
+#define MAX_DIR_NAME_LENGTH 50 // one path component
+#define MAX_PATH_LENGTH 256 // a directory's full path
+
+// Buffer cache size used by the command line tool unless -c says otherwise
+#define CACHE_DEFAULT_MIB 32
+
+// Open-file table
+#define MAX_OPEN_FILES 256
+#define FS_CREATE 1 // fsOpen: create the file if it does not exist
+#define FS_TRUNCATE 2 // fsOpen: empty the file
+#define FS_APPEND 4 // fsWrite always writes at the end of the file
+
+// Paged directory listings
+#define FS_LIST_SORTED 1 // FsDirCursor flag: entries come in name order
+#define FS_ENTRY_FILE 0
+#define FS_ENTRY_DIR 1
+
+// Operation traces (see fsTraceStart). Each operation is listed with the numbers, then the
+// strings, its records hold; the result is what the call returned.
+#define FS_OP_CREATE 0 // createFile: dir, name
+#define FS_OP_MKDIR 1 // makeDirectory: dir
+#define FS_OP_ECHO 2 // echo: dir, name, content
+#define FS_OP_READ_FILE 3 // readFileRange (and readFile): offset, length; dir, name
+#define FS_OP_PREFETCH 4 // prefetchFiles: dir, name...
+#define FS_OP_LIST 5 // listFiles: dir
+#define FS_OP_CD 6 // changeDirectory: dir
+#define FS_OP_COPY 7 // copyFiles (and copyFile): srcDir, destDir, name...
+#define FS_OP_RENAME 8 // renameFile: dir, oldName, newName
+#define FS_OP_RENAME_DIR 9 // renameDirectory: oldDir, newDir
+#define FS_OP_FIND 10 // findFile: dir, pattern
+#define FS_OP_REMOVE 11 // removeFiles (and removeFile): dir, name...
+#define FS_OP_RMDIR 12 // removeDirectory: dir
+#define FS_OP_OPEN 13 // fsOpen: flags; dir, name
+#define FS_OP_READ 14 // fsRead: fd, length
+#define FS_OP_PREAD 15 // fsPread: fd, length, offset
+#define FS_OP_WRITE 16 // fsWrite: fd, length (the data itself is not kept)
+#define FS_OP_PWRITE 17 // fsPwrite: fd, length, offset
+#define FS_OP_APPEND 18 // fsAppend: fd, length
+#define FS_OP_SEEK 19 // fsSeek: fd, offset, whence
+#define FS_OP_TRUNCATE 20 // fsTruncate: fd, size
+#define FS_OP_CLOSE 21 // fsClose: fd
+#define FS_OP_SYNC 22 // fsSync
+#define FS_OP_LIST_PAGE 23 // fsListDirectory: flags, max, cursor next, cursor lastType; dir, cursor lastName
+#define FS_NUM_OPS 24
+#define FS_TRACE_MAX_NUMBERS 4
+
+#define HOST_PATH_LENGTH (MAX_PATH_LENGTH + MAX_FILE_NAME_LENGTH + 2) // 2 for '/' and null terminator
+
+#define true 1
+#define false 0
+
+// Forward declarations
+struct Inode;
+struct Image; // mounted disk image, private to filesystem.c
+struct BufferCache; // host-mode buffer cache, private to filesystem.c
+struct InodeSlab; // block of inodes owned by a directory, private to filesystem.c
+struct FsStats; // per-operation counters and latency histograms, private to filesystem.c
+struct Reclaimer; // background thread freeing removed files and directories, private to filesystem.c
+struct Tracer; // operation trace being recorded, private to filesystem.c
+struct FsTrace; // operation trace being read back, private to filesystem.c
+
+//Name index
+// Open-addressing hash table mapping a name to its position in an owner's array.
+// Slots hold the position, HASH_EMPTY or HASH_DELETED (tombstone left by a removal).
+// The table doubles whenever it would become more than half full.
+struct NameIndex {
+    int size; // number of slots, a power of two (0 until the first insert)
+    int used;
+    int tombstones;
+    int *slots;
+};
+
+//Directory
+// Directories form a tree under the root, which is always sb->directories[0] and has
+// an empty name and no parent.
+struct Directory {
+    char name[MAX_DIR_NAME_LENGTH]; // last component of the path
+    uint32_t ino; // inode number in the image or catalog (0 for the root, and without a catalog)
+    int pos; // position in sb->directories
+    struct Directory *parent;
+    struct Directory *children; // subdirectories, linked through nextSibling
+    struct Directory *nextSibling;
+    struct Directory *dentryNext; // next directory in the same dentry cache bucket
+    struct Directory *nameNext; // next directory in the same sb->dirNames bucket
+    int numFiles;
+    int capFiles;
+    struct Inode **files; // grows by doubling
+    uint32_t *fileHashes; // hash of each name in files[], at the same positions
+    uint64_t *fileKeys; // first 8 bytes of each name, big-endian (see name keys in filesystem.c)
+    struct NameIndex fileIndex; // file name -> position in files[]
+    struct InodeSlab *slabs; // where this directory's inodes live
+    struct Inode *freeInodes; // inodes of removed files, ready for reuse
+    int loaded; // false until its entries have been read from the catalog
+    int detached; // removed, and waiting for the reclaimer to free it
+    int64_t mtime; // when it was created, seconds since the epoch (0 when not known)
+    pthread_rwlock_t lock; // shared to read the entries, exclusive to change them
+};
+
+//Open file
+// A slot of the open-file table; a file handle is the slot's position
+struct OpenFile {
+    struct Inode *inode; // NULL while the slot is free
+    int flags; // FS_APPEND
+    uint64_t offset; // where the next fsRead/fsWrite starts
+    int hostFd; // host mode without a cache: the open host file, otherwise -1
+    char path[HOST_PATH_LENGTH]; // "Dir/name", kept current across renames
+};
+
+//Superblock
+struct Superblock {
+    //file system metadata
+    int totalFiles;
+    int numDirs;
+    int capDirs;
+    struct Directory **directories; // grows by doubling
+    struct Directory **dentries; // (parent, name) -> directory, chained through dentryNext
+    struct Directory **dirNames; // directory name -> every directory with that name, chained through nameNext
+    size_t numDentryBuckets; // of both tables: a power of two, grown to stay at or above numDirs
+    int allLoaded; // every directory's entries have been read from the catalog
+    struct Inode **nameBuckets; // file name -> every inode with that name, chained through nameNext
+    size_t numNameBuckets; // a power of two, grown to stay at or above totalFiles
+    struct Directory *cwd; // relative paths start here
+    char currentDirectory[MAX_PATH_LENGTH + 1]; // cwd's full path, "/" for the root
+    struct Image *image; // mounted disk image, or NULL to pass through to the host file system
+    struct Image *catalog; // where names and sizes persist: the image, a host-mode catalog file, or NULL
+    struct BufferCache *cache; // host-mode data cache, or NULL when disabled
+    uint32_t nextHostIno; // next file number handed out in host mode without a catalog
+    struct OpenFile openFiles[MAX_OPEN_FILES]; // file handles index this table
+    int numOpenFiles;
+    pthread_rwlock_t treeLock; // exclusive to add, remove, rename or load directories
+    pthread_mutex_t nameLock; // nameBuckets and totalFiles
+    pthread_mutex_t catalogLock; // the catalog, its journal and nextHostIno
+    pthread_mutex_t handleLock; // openFiles and numOpenFiles
+    struct FsStats *stats; // allocated when statistics are first enabled, kept until shutdown
+    int statsEnabled; // operations are timed and counted only while this is set
+    struct Reclaimer *reclaimer;
+    struct Tracer *tracer; // allocated when a trace is first started, kept until shutdown
+    int tracing; // operations are recorded only while this is set
+};
+
+//Directory entry filled in by fsListDirectory
+struct FsDirEntry {
+    char name[MAX_FILE_NAME_LENGTH];
+    int type; // FS_ENTRY_FILE or FS_ENTRY_DIR
+    uint64_t size; // 0 for directories
+    int64_t mtime; // seconds since the epoch, 0 when not known
+};
+
+//Directory listing cursor
+// Zero it and set `flags` to start a listing, then pass it to every fsListDirectory call
+// for the following pages.
+struct FsDirCursor {
+    int flags; // FS_LIST_SORTED
+    uint64_t next; // unsorted: position of the next entry, subdirectories first
+    char lastName[MAX_FILE_NAME_LENGTH]; // sorted: the last entry returned ("" before the first page)
+    int lastType;
+};
+
+//Session
+// A client sharing the file system with others (see the server in main.c). While a
+// session is attached to a thread, that thread's messages and file contents go to `out`
+// and its relative paths start at `cwd` instead of sb->cwd.
+struct FsSession {
+    FILE *out;
+    char cwd[MAX_PATH_LENGTH + 1]; // absolute path, "/" for the root
+};
+
+//Trace record filled in by fsTraceNext
+struct FsTraceRecord {
+    int op; // FS_OP_*
+    uint32_t thread; // who made the call: a session (server client), or a thread without one; from 1
+    uint64_t time; // when the call started, nanoseconds after the trace did
+    uint64_t latency; // nanoseconds
+    long result;
+    int numNumbers;
+    int64_t numbers[FS_TRACE_MAX_NUMBERS];
+    int numStrings;
+    char **strings; // owned by the trace, valid until the next fsTraceNext (NULL where the call had NULL)
+};
+
+// Definition of struct Inode
+struct Inode {
+    //metadata
+    char name[MAX_FILE_NAME_LENGTH];
+    int64_t size;
+    int64_t mtime; // last change to the contents, seconds since the epoch (0 when not known)
+    uint32_t ino; // inode number in the image or catalog, otherwise handed out from nextHostIno
+    struct Directory *parent;
+    struct Inode *nameNext; // next inode in the same name bucket (or on the free list)
+};
+
+// Function declarations
+
+int initSuperblock(struct Superblock *sb);
+int mountImage(struct Superblock *sb, const char *path);
+int mountCatalog(struct Superblock *sb, const char *path);
+void unmountImage(struct Superblock *sb);
+int fsSetCompression(struct Superblock *sb, int enabled);
+int fsSetDedup(struct Superblock *sb, int enabled);
+int fsSnapshot(struct Superblock *sb, const char *name);
+int fsListSnapshots(struct Superblock *sb);
+int fsSnapshotListDirectory(struct Superblock *sb, const char *name, const char *dirName);
+int fsSnapshotReadFile(struct Superblock *sb, const char *name, const char *dirName, const char *fileName);
+int fsRollback(struct Superblock *sb, const char *name);
+int fsDeleteSnapshot(struct Superblock *sb, const char *name);
+struct BufferCache *cacheCreate(size_t budget);
+void cacheDestroy(struct BufferCache *cache);
+void printCacheStats(struct Superblock *sb);
+int fsStatsEnable(struct Superblock *sb, int enabled);
+void fsStatsReset(struct Superblock *sb);
+void printOperationStats(struct Superblock *sb, int json);
+int fsTraceStart(struct Superblock *sb, const char *path);
+int fsTraceStop(struct Superblock *sb);
+struct FsTrace *fsTraceOpen(const char *path);
+int fsTraceNext(struct FsTrace *trace, struct FsTraceRecord *record);
+void fsTraceClose(struct FsTrace *trace);
+const char *fsTraceOpName(int op);
+int createFile(struct Superblock *sb, const char *dirName, const char *fileName);
+int makeDirectory(struct Superblock *sb, const char *dirName);
+int echo(struct Superblock *sb, const char *dirName, const char *fileName, const char *content);
+int readFile(struct Superblock *sb, const char *dirName, const char *fileName);
+int readFileRange(struct Superblock *sb, const char *dirName, const char *fileName, long offset, long length);
+int prefetchFiles(struct Superblock *sb, const char *dirName, const char *fileNames[], int count);
+int listFiles(struct Superblock *sb, const char *dirName);
+int fsListDirectory(struct Superblock *sb, const char *dirName, struct FsDirCursor *cursor, struct FsDirEntry *entries, int max);
+int changeDirectory(struct Superblock *sb, const char *dirName) ;
+int copyFile(struct Superblock *sb, const char *srcDir, const char *destDir, const char *fileName) ;
+int copyFiles(struct Superblock *sb, const char *srcDir, const char *destDir, const char *fileNames[], int count);
+int renameFile(struct Superblock *sb, const char *dirName, const char *oldFileName, const char *newFileName);
+int renameDirectory(struct Superblock *sb, const char *oldDirName, const char *newDirName);
+int findFile(struct Superblock *sb, const char *dirName, const char *pattern);
+void printCurrentDirectoryPath(const char *currentDir) ;
+int removeDirectory(struct Superblock *sb, const char *dirName);
+int removeFile(struct Superblock *sb, const char *dirName, const char *fileName) ;
+int removeFiles(struct Superblock *sb, const char *dirName, const char *fileNames[], int count);
+int fsSync(struct Superblock *sb);
+void fsAttachSession(struct FsSession *session);
+FILE *fsOutput(void);
+const char *fsWorkingDirectory(struct Superblock *sb);
+void closeFileSystem(struct Superblock *sb);
+
+// File handles: fsRead/fsWrite move the handle's offset, fsPread/fsPwrite do not.
+// Byte counts are returned as long; -1 means failure. Every call may run concurrently
+// with others, but one handle should be used by one thread at a time.
+int fsOpen(struct Superblock *sb, const char *dirName, const char *fileName, int flags);
+long fsRead(struct Superblock *sb, int fd, void *buf, size_t len);
+long fsPread(struct Superblock *sb, int fd, void *buf, size_t len, long offset);
+long fsWrite(struct Superblock *sb, int fd, const void *data, size_t len);
+long fsPwrite(struct Superblock *sb, int fd, const void *data, size_t len, long offset);
+long fsAppend(struct Superblock *sb, int fd, const void *data, size_t len);
+long fsSeek(struct Superblock *sb, int fd, long offset, int whence);
+int fsTruncate(struct Superblock *sb, int fd, long size);
+int fsClose(struct Superblock *sb, int fd);
+
+#endif
@@ -0,0 +1,1031 @@
+//mini-FileSystem command line tool: the interactive menu, batch mode and server mode
+
+#define _GNU_SOURCE // accept4
+#include "filesystem.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+
+//define MACROS
+
+// Host mode keeps its namespace in this file unless -m says otherwise
+#define CATALOG_DEFAULT_PATH ".minifs.catalog"
+
+// Batch mode
+#define BATCH_MAX_LINE 4096
+#define BATCH_MAX_WORDS 256
+#define LIST_PAGE_ENTRIES 256 // entries fetched per fsListDirectory call by ls -l
+
+// Server mode
+#define SERVER_BACKLOG 128
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_THREADS 64
+
+
+//BATCH MODE
+// Commands are read one per line, in the same form as the menu lists them:
+//   ls [-l [-U]] [Dir]...  cd Dir                 pwd
+//   touch file...          mkdir Dir...           rm file...          rmdir Dir...
+//   cp file... Dir         mv file newname        mvdir Dir newname
+//   cat [-o offset] [-n length] file...           echo content... > file
+//   echo content... >> file
+//   find [Dir] pattern     cache                  sync
+//   stats [json|reset|on|off]                     trace start file   trace stop
+//   snapshot create|rollback|rm name              snapshot list
+//   snapshot ls name [Dir]...                     snapshot cat name file...
+// Dir is a path, absolute ("/a/b") or relative to the current directory ("b", "../c").
+// A file is written "Dir/name", or just "name" for a file in the current directory.
+// Double quotes group words ("two  spaces"), and '#' starts a comment.
+
+// Split a command line into words in place; returns the number of words
+static int splitCommand(char *line, char *words[], int maxWords) {
+    int count = 0;
+    char *src = line, *dst = line;
+
+    while (*src != '\0') {
+        while (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r') {
+            src++;
+        }
+        if (*src == '\0' || *src == '#') {
+            break;
+        }
+        if (count == maxWords) {
+            return -1;
+        }
+        words[count++] = dst;
+        int quoted = false;
+        while (*src != '\0' && (quoted || (*src != ' ' && *src != '\t' && *src != '\n' && *src != '\r'))) {
+            if (*src == '"') {
+                quoted = !quoted;
+                src++;
+                continue;
+            }
+            *dst++ = *src++;
+        }
+        if (*src != '\0') {
+            src++;
+        }
+        *dst++ = '\0';
+    }
+    return count;
+}
+
+// Split "Dir/name" into its parts; a bare name is taken from the current directory
+static int splitFilePath(const char *path, char *dirName, char *fileName) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dirName, ".");
+        slash = path - 1;
+    } else if (slash == path) {
+        strcpy(dirName, "/");
+    } else {
+        if (slash - path >= MAX_PATH_LENGTH) {
+            fprintf(fsOutput(), "Directory name too long in '%s'.\n", path);
+            return -1;
+        }
+        memcpy(dirName, path, slash - path);
+        dirName[slash - path] = '\0';
+    }
+    if (strlen(slash + 1) == 0 || strlen(slash + 1) >= MAX_FILE_NAME_LENGTH) {
+        fprintf(fsOutput(), "Invalid file name in '%s'.\n", path);
+        return -1;
+    }
+    strcpy(fileName, slash + 1);
+    return 0;
+}
+
+// Files named on a command line, split into directory and name
+struct FileList {
+    int count;
+    char dirs[BATCH_MAX_WORDS][MAX_PATH_LENGTH];
+    char names[BATCH_MAX_WORDS][MAX_FILE_NAME_LENGTH];
+    const char *nameOf[BATCH_MAX_WORDS]; // names[], in the form the library takes them
+};
+
+// Split `count` paths into `files`; bad ones are reported and left out. Returns -1 if
+// there were any.
+static int splitFilePaths(char *paths[], int count, struct FileList *files) {
+    int status = 0;
+    files->count = 0;
+    for (int w = 0; w < count; w++) {
+        int f = files->count;
+        if (splitFilePath(paths[w], files->dirs[f], files->names[f]) != 0) {
+            status = -1;
+            continue;
+        }
+        files->nameOf[f] = files->names[f];
+        files->count++;
+    }
+    return status;
+}
+
+// Number of files from `first` on that are in the same directory: the library takes
+// them in one call, so their host I/O can run as one batch
+static int sameDirectoryRun(const struct FileList *files, int first) {
+    int run = 1;
+    while (first + run < files->count && strcmp(files->dirs[first + run], files->dirs[first]) == 0) {
+        run++;
+    }
+    return run;
+}
+
+// Words 1..count-1 must be valid names of at most `limit` characters
+static int checkNames(int count, char *words[], int limit) {
+    for (int w = 1; w < count; w++) {
+        if (strlen(words[w]) >= (size_t)limit) {
+            fprintf(fsOutput(), "Name too long: '%s'.\n", words[w]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Append content to an existing file through a file handle
+static int appendContent(struct Superblock *sb, const char *dirName, const char *fileName, const char *content) {
+    int fd = fsOpen(sb, dirName, fileName, FS_APPEND);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t len = strlen(content);
+    long written = fsWrite(sb, fd, content, len);
+    fsClose(sb, fd);
+    if (written != (long)len) {
+        return -1;
+    }
+    fprintf(fsOutput(), "Content appended to file '%s' in directory '%s'.\n", fileName, dirName);
+    return 0;
+}
+
+// ls -l: one line per entry with its type, size and modification time, in name order
+// unless `sorted` is false. The directory is read a page at a time.
+static int listLong(struct Superblock *sb, const char *dirName, int sorted) {
+    struct FsDirEntry entries[LIST_PAGE_ENTRIES];
+    struct FsDirCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.flags = sorted ? FS_LIST_SORTED : 0;
+
+    FILE *out = fsOutput();
+    int count;
+    while ((count = fsListDirectory(sb, dirName, &cursor, entries, LIST_PAGE_ENTRIES)) > 0) {
+        for (int k = 0; k < count; k++) {
+            char when[32] = "-";
+            time_t mtime = (time_t)entries[k].mtime;
+            struct tm local;
+            if (mtime != 0 && localtime_r(&mtime, &local) != NULL) {
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &local);
+            }
+            int isDir = entries[k].type == FS_ENTRY_DIR;
+            fprintf(out, "%c %12llu %16s %s%s\n", isDir ? 'd' : '-', (unsigned long long)entries[k].size, when,
+                    entries[k].name, isDir ? "/" : "");
+        }
+    }
+    return count;
+}
+
+// Read the rest of the input line (after skipping leading blanks) as file content
+static void readContent(char *content, int size) {
+    content[0] = '\0';
+    scanf(" ");
+    if (fgets(content, size, stdin) != NULL) {
+        content[strcspn(content, "\n")] = '\0';
+    }
+}
+
+//RUN ONE COMMAND
+// Returns 0 when every part of the command succeeded
+static int runCommand(struct Superblock *sb, int count, char *words[]) {
+    char dirName[MAX_PATH_LENGTH], fileName[MAX_FILE_NAME_LENGTH];
+    const char *cmd = words[0];
+    int status = 0;
+
+    if (strcmp(cmd, "ls") == 0) {
+        int w = 1, longFormat = false, sorted = true;
+        for (; w < count && words[w][0] == '-' && words[w][1] != '\0'; w++) {
+            if (strcmp(words[w], "-l") == 0) {
+                longFormat = true;
+            } else if (strcmp(words[w], "-U") == 0) {
+                sorted = false;
+            } else {
+                return -1;
+            }
+        }
+        if (checkNames(count - w + 1, words + w - 1, MAX_PATH_LENGTH) != 0) {
+            return -1;
+        }
+        if (w == count) {
+            return longFormat ? listLong(sb, ".", sorted) : listFiles(sb, ".");
+        }
+        for (; w < count; w++) {
+            status |= longFormat ? listLong(sb, words[w], sorted) : listFiles(sb, words[w]);
+        }
+    } else if (strcmp(cmd, "cd") == 0 && count == 2) {
+        if (checkNames(count, words, MAX_PATH_LENGTH) != 0) {
+            return -1;
+        }
+        status = changeDirectory(sb, words[1]);
+    } else if (strcmp(cmd, "pwd") == 0 && count == 1) {
+        printCurrentDirectoryPath(fsWorkingDirectory(sb));
+    } else if ((strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "rmdir") == 0) && count >= 2) {
+        if (checkNames(count, words, MAX_PATH_LENGTH) != 0) {
+            return -1;
+        }
+        for (int w = 1; w < count; w++) {
+            status |= cmd[0] == 'm' ? makeDirectory(sb, words[w]) : removeDirectory(sb, words[w]);
+        }
+    } else if (strcmp(cmd, "touch") == 0 && count >= 2) {
+        for (int w = 1; w < count; w++) {
+            if (splitFilePath(words[w], dirName, fileName) != 0) {
+                status = -1;
+                continue;
+            }
+            status |= createFile(sb, dirName, fileName);
+        }
+    } else if (strcmp(cmd, "rm") == 0 && count >= 2) {
+        struct FileList files;
+        status = splitFilePaths(words + 1, count - 1, &files);
+        for (int f = 0, run; f < files.count; f += run) {
+            run = sameDirectoryRun(&files, f);
+            status |= removeFiles(sb, files.dirs[f], files.nameOf + f, run);
+        }
+    } else if (strcmp(cmd, "cp") == 0 && count >= 3) {
+        const char *destDir = words[count - 1];
+        if (strlen(destDir) >= MAX_PATH_LENGTH) {
+            fprintf(fsOutput(), "Name too long: '%s'.\n", destDir);
+            return -1;
+        }
+        struct FileList files;
+        status = splitFilePaths(words + 1, count - 2, &files);
+        for (int f = 0, run; f < files.count; f += run) {
+            run = sameDirectoryRun(&files, f);
+            status |= copyFiles(sb, files.dirs[f], destDir, files.nameOf + f, run);
+        }
+    } else if (strcmp(cmd, "mv") == 0 && count == 3) {
+        if (splitFilePath(words[1], dirName, fileName) != 0 || strlen(words[2]) >= MAX_FILE_NAME_LENGTH) {
+            return -1;
+        }
+        status = renameFile(sb, dirName, fileName, words[2]);
+    } else if (strcmp(cmd, "mvdir") == 0 && count == 3) {
+        if (checkNames(2, words, MAX_PATH_LENGTH) != 0 || strlen(words[2]) >= MAX_DIR_NAME_LENGTH) {
+            return -1;
+        }
+        status = renameDirectory(sb, words[1], words[2]);
+    } else if (strcmp(cmd, "cat") == 0 && count >= 2) {
+        long offset = 0, length = -1;
+        int w = 1;
+        for (; w + 1 < count && words[w][0] == '-'; w += 2) {
+            if (strcmp(words[w], "-o") == 0) {
+                offset = atol(words[w + 1]);
+            } else if (strcmp(words[w], "-n") == 0) {
+                length = atol(words[w + 1]);
+            } else {
+                break;
+            }
+        }
+        if (w == count) {
+            return -1;
+        }
+        // Each run of files in one directory is prefetched together, then printed in order
+        struct FileList files;
+        status = splitFilePaths(words + w, count - w, &files);
+        for (int f = 0, run; f < files.count; f += run) {
+            run = sameDirectoryRun(&files, f);
+            if (run > 1) {
+                prefetchFiles(sb, files.dirs[f], files.nameOf + f, run);
+            }
+            for (int k = f; k < f + run; k++) {
+                status |= readFileRange(sb, files.dirs[k], files.names[k], offset, length);
+                fprintf(fsOutput(), "\n"); // keep the status line off the file's last line
+            }
+        }
+    } else if (strcmp(cmd, "echo") == 0 && count >= 3
+               && (strcmp(words[count - 2], ">") == 0 || strcmp(words[count - 2], ">>") == 0)) {
+        char content[MAX_FILE_CONTENT_LENGTH];
+        size_t used = 0;
+        content[0] = '\0';
+        for (int w = 1; w < count - 2; w++) {
+            int n = snprintf(content + used, sizeof(content) - used, "%s%s", w > 1 ? " " : "", words[w]);
+            if (n < 0 || used + n >= sizeof(content)) {
+                fprintf(fsOutput(), "Content too long.\n");
+                return -1;
+            }
+            used += n;
+        }
+        if (splitFilePath(words[count - 1], dirName, fileName) != 0) {
+            return -1;
+        }
+        if (words[count - 2][1] == '\0') {
+            status = echo(sb, dirName, fileName, content);
+        } else {
+            status = appendContent(sb, dirName, fileName, content);
+        }
+    } else if (strcmp(cmd, "find") == 0 && (count == 2 || count == 3)) {
+        status = findFile(sb, count == 3 ? words[1] : NULL, words[count - 1]);
+    } else if (strcmp(cmd, "cache") == 0 && count == 1) {
+        printCacheStats(sb);
+    } else if (strcmp(cmd, "sync") == 0 && count == 1) {
+        status = fsSync(sb);
+    } else if (strcmp(cmd, "stats") == 0 && count <= 2) {
+        // Plain "stats" prints the table, "stats json" the machine-readable dump
+        const char *arg = count == 2 ? words[1] : "";
+        if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+            status = fsStatsEnable(sb, arg[1] == 'n');
+        } else if (strcmp(arg, "reset") == 0) {
+            fsStatsReset(sb);
+        } else if (count == 1 || strcmp(arg, "json") == 0) {
+            printOperationStats(sb, count == 2);
+        } else {
+            fprintf(fsOutput(), "Unknown stats argument '%s'.\n", arg);
+            status = -1;
+        }
+    } else if (strcmp(cmd, "trace") == 0 && count == 3 && strcmp(words[1], "start") == 0) {
+        status = fsTraceStart(sb, words[2]);
+    } else if (strcmp(cmd, "trace") == 0 && count == 2 && strcmp(words[1], "stop") == 0) {
+        status = fsTraceStop(sb);
+    } else if (strcmp(cmd, "snapshot") == 0 && count >= 2) {
+        // Paths inside a snapshot start at its root
+        const char *sub = words[1];
+        if (count >= 3 && strlen(words[2]) >= MAX_FILE_NAME_LENGTH) {
+            fprintf(fsOutput(), "Name too long: '%s'.\n", words[2]);
+            return -1;
+        }
+        if (strcmp(sub, "list") == 0 && count == 2) {
+            status = fsListSnapshots(sb);
+        } else if (strcmp(sub, "create") == 0 && count == 3) {
+            status = fsSnapshot(sb, words[2]);
+        } else if (strcmp(sub, "rollback") == 0 && count == 3) {
+            status = fsRollback(sb, words[2]);
+        } else if (strcmp(sub, "rm") == 0 && count == 3) {
+            status = fsDeleteSnapshot(sb, words[2]);
+        } else if (strcmp(sub, "ls") == 0 && count >= 3) {
+            if (checkNames(count, words, MAX_PATH_LENGTH) != 0) {
+                return -1;
+            }
+            if (count == 3) {
+                return fsSnapshotListDirectory(sb, words[2], "/");
+            }
+            for (int w = 3; w < count; w++) {
+                status |= fsSnapshotListDirectory(sb, words[2], words[w]);
+            }
+        } else if (strcmp(sub, "cat") == 0 && count >= 4) {
+            struct FileList files;
+            status = splitFilePaths(words + 3, count - 3, &files);
+            for (int f = 0; f < files.count; f++) {
+                status |= fsSnapshotReadFile(sb, words[2], files.dirs[f], files.names[f]);
+                fprintf(fsOutput(), "\n"); // keep the status line off the file's last line
+            }
+        } else {
+            fprintf(fsOutput(), "Unknown snapshot command '%s'.\n", sub);
+            status = -1;
+        }
+    } else {
+        fprintf(fsOutput(), "Unknown command or wrong arguments: '%s'.\n", cmd);
+        status = -1;
+    }
+    return status == 0 ? 0 : -1;
+}
+
+// Run one script line, reporting "[line] ok|failed command" after the command's own output.
+// Returns 0 when it succeeded, 1 when it failed and -1 when the line holds no command.
+static int runLine(struct Superblock *sb, char *line, int lineNumber) {
+    char *words[BATCH_MAX_WORDS];
+    int count = splitCommand(line, words, BATCH_MAX_WORDS);
+    if (count == 0) {
+        return -1;
+    }
+    int status = count < 0 ? -1 : runCommand(sb, count, words);
+    fprintf(fsOutput(), "[%d] %s %s\n", lineNumber, status == 0 ? "ok" : "failed", count < 0 ? "(too many words)" : words[0]);
+    return status == 0 ? 0 : 1;
+}
+
+// Report a line longer than BATCH_MAX_LINE - 2 characters: none of it runs, since what
+// followed the cut could otherwise run as a command of its own
+static void rejectLongLine(int lineNumber) {
+    fprintf(fsOutput(), "[%d] failed (line too long)\n", lineNumber);
+}
+
+//RUN A BATCH OF COMMANDS
+// Executes every command from `in` back to back, printing "[line] ok|failed command"
+// after each one and a summary at the end. Returns the number of failed commands.
+static int runBatch(struct Superblock *sb, FILE *in) {
+    char line[BATCH_MAX_LINE];
+    int lineNumber = 0, commands = 0, failures = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fgets(line, sizeof(line), in) != NULL) {
+        size_t len = strlen(line);
+        int c;
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n' && (c = getc(in)) != EOF) {
+            while (c != '\n' && c != EOF) {
+                c = getc(in);
+            }
+            rejectLongLine(++lineNumber);
+            commands++;
+            failures++;
+            continue;
+        }
+        int status = runLine(sb, line, ++lineNumber);
+        if (status >= 0) {
+            commands++;
+            failures += status;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Batch complete: %d commands, %d failed, %.3f s (%.0f commands/s).\n",
+           commands, failures, seconds, seconds > 0 ? commands / seconds : 0.0);
+    return failures;
+}
+
+//SERVER MODE
+// With -s the file system is served over a Unix domain socket to any number of clients.
+// A client sends batch-mode commands, one per line, and gets back each command's output
+// followed by its "[line] ok|failed command" line. The main thread accepts connections
+// and waits for input with epoll; a connection with input is queued for a pool of worker
+// threads, and EPOLLONESHOT keeps it with one worker until its complete lines have run.
+// Every connection has its own session, so its output goes back to it and cd only moves
+// that client. Commands from different clients run in parallel, serialised only by the
+// library's locks (per directory, and the whole tree for mkdir, rmdir and mvdir).
+
+//Client connection
+struct Connection {
+    int fd;
+    FILE *out; // buffered writer on the socket, flushed after each batch of lines
+    struct FsSession session;
+    char input[BATCH_MAX_LINE]; // received bytes not yet run
+    size_t used;
+    int lineNumber;
+    int discarding; // dropping the rest of a line too long for input[]
+    struct Connection *queueNext; // next connection waiting for a worker
+    struct Connection *prevOpen; // every open connection, to close them at shutdown
+    struct Connection *nextOpen;
+};
+
+//Server
+struct Server {
+    struct Superblock *sb;
+    int listenFd;
+    int epollFd;
+    pthread_mutex_t lock; // the queue and the list of open connections
+    pthread_cond_t ready; // a connection was queued, or the server is stopping
+    struct Connection *queueHead;
+    struct Connection *queueTail;
+    struct Connection *connections;
+    int stop;
+};
+
+static volatile sig_atomic_t serverStopping = false;
+
+static void stopServer(int sig) {
+    (void)sig;
+    serverStopping = true;
+}
+
+// Forget a connection and hang up on it
+static void closeConnection(struct Server *server, struct Connection *conn) {
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    pthread_mutex_lock(&server->lock);
+    if (conn->prevOpen != NULL) {
+        conn->prevOpen->nextOpen = conn->nextOpen;
+    } else {
+        server->connections = conn->nextOpen;
+    }
+    if (conn->nextOpen != NULL) {
+        conn->nextOpen->prevOpen = conn->prevOpen;
+    }
+    pthread_mutex_unlock(&server->lock);
+    fclose(conn->out); // closes conn->fd too
+    free(conn);
+}
+
+// Read what the client sent and run every complete line in it. A line too long for the
+// buffer fails as a whole: it gets one status line and the rest of it is dropped as it
+// arrives, up to its newline. Returns -1 once the client has hung up.
+static int serveConnection(struct Server *server, struct Connection *conn) {
+    ssize_t got = recv(conn->fd, conn->input + conn->used, sizeof(conn->input) - 1 - conn->used, MSG_DONTWAIT);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        return -1;
+    }
+    if (got > 0) {
+        conn->used += (size_t)got;
+    }
+
+    fsAttachSession(&conn->session);
+    size_t start = 0;
+    while (start < conn->used) {
+        char *newline = memchr(conn->input + start, '\n', conn->used - start);
+        if (newline == NULL) {
+            if (conn->discarding) {
+                start = conn->used;
+            } else if (start == 0 && conn->used == sizeof(conn->input) - 1) {
+                rejectLongLine(++conn->lineNumber);
+                conn->discarding = true;
+                start = conn->used;
+            }
+            break; // wait for the rest of the line
+        }
+        size_t len = (size_t)(newline - (conn->input + start));
+        if (conn->discarding) {
+            conn->discarding = false;
+        } else {
+            conn->input[start + len] = '\0';
+            runLine(server->sb, conn->input + start, ++conn->lineNumber);
+        }
+        start += len + 1;
+    }
+    fsAttachSession(NULL);
+    memmove(conn->input, conn->input + start, conn->used - start);
+    conn->used -= start;
+
+    return fflush(conn->out) == 0 ? 0 : -1;
+}
+
+// Worker thread: serve queued connections until the server stops
+static void *serverWorker(void *arg) {
+    struct Server *server = arg;
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (server->queueHead == NULL && !server->stop) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        struct Connection *conn = server->queueHead;
+        if (conn == NULL) {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+        server->queueHead = conn->queueNext;
+        if (server->queueHead == NULL) {
+            server->queueTail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        if (serveConnection(server, conn) != 0) {
+            closeConnection(server, conn);
+            continue;
+        }
+        // Hand the connection back to epoll for its next input. Re-arming under the lock the
+        // main thread queues it with orders this worker's updates before the next one's.
+        struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn};
+        pthread_mutex_lock(&server->lock);
+        int rearmed = epoll_ctl(server->epollFd, EPOLL_CTL_MOD, conn->fd, &event) == 0;
+        pthread_mutex_unlock(&server->lock);
+        if (!rearmed) {
+            closeConnection(server, conn);
+        }
+    }
+}
+
+// Accept one client and start watching it
+static void acceptConnection(struct Server *server) {
+    int fd = accept4(server->listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct Connection *conn = calloc(1, sizeof(struct Connection));
+    FILE *out = conn != NULL ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        free(conn);
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->out = out;
+    conn->session.out = out;
+    strcpy(conn->session.cwd, "/");
+
+    pthread_mutex_lock(&server->lock);
+    conn->nextOpen = server->connections;
+    if (server->connections != NULL) {
+        server->connections->prevOpen = conn;
+    }
+    server->connections = conn;
+    pthread_mutex_unlock(&server->lock);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn};
+    if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        closeConnection(server, conn);
+    }
+}
+
+//RUN THE SERVER
+// Serves clients on the socket at `path` with `numThreads` workers until SIGINT or SIGTERM.
+// Returns 0 after a clean shutdown.
+static int runServer(struct Superblock *sb, const char *path, int numThreads) {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.sb = sb;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier server is replaced; any other file is not
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listenFd < 0 || bind(server.listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(server.listenFd, SERVER_BACKLOG) != 0) {
+        printf("Failed to listen on '%s'.\n", path);
+        if (server.listenFd >= 0) {
+            close(server.listenFd);
+        }
+        return -1;
+    }
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listenEvent = {.events = EPOLLIN, .data.ptr = NULL};
+    if (server.epollFd < 0 || epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &listenEvent) != 0) {
+        printf("Failed to listen on '%s'.\n", path);
+        close(server.listenFd);
+        unlink(path);
+        return -1;
+    }
+
+    // Clients that hang up mid-reply must not kill the server; SIGINT and SIGTERM stop it
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    pthread_t workers[SERVER_MAX_THREADS];
+    int started = 0;
+    while (started < numThreads && pthread_create(&workers[started], NULL, serverWorker, &server) == 0) {
+        started++;
+    }
+    printf("Serving on '%s' with %d worker threads.\n", path, started);
+    fflush(stdout);
+
+    while (!serverStopping && started > 0) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int n = epoll_wait(server.epollFd, events, SERVER_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            struct Connection *conn = events[e].data.ptr;
+            if (conn == NULL) {
+                acceptConnection(&server);
+                continue;
+            }
+            pthread_mutex_lock(&server.lock);
+            conn->queueNext = NULL;
+            if (server.queueTail != NULL) {
+                server.queueTail->queueNext = conn;
+            } else {
+                server.queueHead = conn;
+            }
+            server.queueTail = conn;
+            pthread_cond_signal(&server.ready);
+            pthread_mutex_unlock(&server.lock);
+        }
+    }
+
+    // Let the workers finish what is queued, then hang up on everyone
+    pthread_mutex_lock(&server.lock);
+    server.stop = true;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    while (server.connections != NULL) {
+        closeConnection(&server, server.connections);
+    }
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.ready);
+    close(server.epollFd);
+    close(server.listenFd);
+    unlink(path);
+    printf("Server stopped.\n");
+    return 0;
+}
+
+//MAIN PROGRAM
+int main(int argc, char *argv[]) {
+
+    //initialise superblock
+    struct Superblock sb;
+    if (initSuperblock(&sb) != 0) {
+        return 1;
+    }
+
+    // -i <image> keeps everything inside a disk image instead of the host file system;
+    // -m <catalog> is where host mode remembers its directories and files ("-" forgets them at exit);
+    // -z stores files written with echo compressed and -D deduplicates their blocks (images only);
+    // -c <MiB> sizes the host-mode buffer cache (0 disables it);
+    // -b <script> runs commands from a file ("-" for standard input) instead of the menu;
+    // -s <socket> serves clients on a Unix domain socket with -t <threads> workers;
+    // -T <trace> records every operation to a trace file (replay it with fsbench -r)
+    const char *imagePath = NULL;
+    const char *tracePath = NULL;
+    const char *catalogPath = CATALOG_DEFAULT_PATH;
+    const char *batchPath = NULL;
+    const char *socketPath = NULL;
+    long cacheMiB = CACHE_DEFAULT_MIB;
+    int compress = false, dedup = false;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = cpus < 1 ? 1 : (cpus > SERVER_MAX_THREADS ? SERVER_MAX_THREADS : (int)cpus);
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-i") == 0 && a + 1 < argc) {
+            imagePath = argv[++a];
+        } else if (strcmp(argv[a], "-m") == 0 && a + 1 < argc) {
+            catalogPath = argv[++a];
+        } else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc) {
+            cacheMiB = atol(argv[++a]);
+        } else if (strcmp(argv[a], "-z") == 0) {
+            compress = true;
+        } else if (strcmp(argv[a], "-D") == 0) {
+            dedup = true;
+        } else if (strcmp(argv[a], "-b") == 0 && a + 1 < argc) {
+            batchPath = argv[++a];
+        } else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc) {
+            socketPath = argv[++a];
+        } else if (strcmp(argv[a], "-T") == 0 && a + 1 < argc) {
+            tracePath = argv[++a];
+        } else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            numThreads = atoi(argv[++a]);
+            if (numThreads > SERVER_MAX_THREADS) {
+                numThreads = SERVER_MAX_THREADS;
+            }
+        } else {
+            printf("Usage: %s [-i image [-z] [-D] | -m catalog] [-c cacheMiB] [-b script | -s socket [-t threads]] [-T trace]\n", argv[0]);
+            return 1;
+        }
+    }
+    // Timing every operation costs two clock reads; "stats off" drops even that
+    fsStatsEnable(&sb, true);
+    if (imagePath != NULL) {
+        if (mountImage(&sb, imagePath) != 0) {
+            return 1;
+        }
+    } else {
+        if (strcmp(catalogPath, "-") != 0 && mountCatalog(&sb, catalogPath) != 0) {
+            return 1;
+        }
+        if (cacheMiB > 0) {
+            sb.cache = cacheCreate((size_t)cacheMiB * 1024 * 1024);
+        }
+    }
+    if ((compress && fsSetCompression(&sb, true) != 0) || (dedup && fsSetDedup(&sb, true) != 0)
+            || (tracePath != NULL && fsTraceStart(&sb, tracePath) != 0)) {
+        closeFileSystem(&sb);
+        return 1;
+    }
+
+    if (batchPath != NULL) {
+        FILE *script = strcmp(batchPath, "-") == 0 ? stdin : fopen(batchPath, "r");
+        if (script == NULL) {
+            printf("Failed to open script '%s'.\n", batchPath);
+            closeFileSystem(&sb);
+            return 1;
+        }
+        int failures = runBatch(&sb, script);
+        if (script != stdin) {
+            fclose(script);
+        }
+        closeFileSystem(&sb);
+        return failures == 0 ? 0 : 1;
+    }
+
+    if (socketPath != NULL) {
+        int status = runServer(&sb, socketPath, numThreads);
+        closeFileSystem(&sb);
+        return status == 0 ? 0 : 1;
+    }
+
+    
+    printf("Initialization complete.\n");
+
+    while (true) {
+        printf("\n\nWaiting for user input...\n");
+        sleep(2);
+
+        //variables
+
+        int option;
+
+        char dirName[MAX_PATH_LENGTH], fileName[MAX_FILE_NAME_LENGTH], content[MAX_FILE_CONTENT_LENGTH];
+
+        char srcDir[MAX_PATH_LENGTH], destDir[MAX_PATH_LENGTH], oldFileName[MAX_FILE_NAME_LENGTH], newFileName[MAX_FILE_NAME_LENGTH];
+        printf("           _       _       _____ _ _      ____            _                 \n");
+        printf(" _ __ ___ (_)_ __ (_)     |  ___(_) | ___/ ___| _   _ ___| |_ ___ _ __ ___  \n");
+        printf("| '_ ` _ \\| | '_ \\| |_____| |_  | | |/ _ \\___ \\| | | / __| __/ _ \\ '_ ` _ \\ \n");
+        printf("| | | | | | | | | | |_____|  _| | | |  __/___) | |_| \\__ \\ | | __/ | | | | |\n");
+        printf("|_| |_| |_|_|_| |_|_|     |_|   |_|_|\\___|____/ \\__, |___/\\__\\___|_| |_| |_|\n");
+        printf("                                                |___/\n");
+
+        // Display the command list
+
+        printf("1. ls [Dir]...\t\t\tlist files under directories.\n");
+        printf("2. cd [Dir]\t\t\tchange to [Dir].\n");
+        printf("3. cp [file]...[Dir]\t\tcopy files to [Dir].\n");
+        printf("4. rm [file]...\t\t\tremove files.\n");
+        printf("5. rmdir [Dir]...\t\tremove directories.\n");
+        printf("6. touch [file]...\t\tcreate files.\n");
+        printf("7. mkdir [Dir]...\t\tcreate directories.\n");
+        printf("8. mv [file] [filename]\t\trename the file.\n");
+        printf("9. mvdir [Dir] [directoryname]\trename the directory.\n");
+        printf("10. cat [file]...\t\tread files.\n");
+        printf("11. pwd\t\t\t\tprint the current directory path.\n");
+        printf("12. echo [content] > [file]\twrite content to the file.\n");
+        printf("13. find [Dir] [file/Dir]\tfind specific file or directory.\n");
+        printf("14. cache\t\t\tshow buffer cache statistics.\n");
+        printf("15. cat [file] [offset] [length]\tread part of a file.\n");
+        printf("16. echo [content] >> [file]\tappend content to the file.\n");
+        printf("17. stats\t\t\tshow per-operation statistics.\n");
+        printf("18. snapshot [name]\t\ttake a snapshot of the image.\n");
+        printf("19. snapshots\t\t\tlist the image's snapshots.\n");
+        printf("20. rollback [name]\t\troll the image back to a snapshot.\n");
+        printf("0. Exit\n");
+       
+
+        printf("Enter your option: ");
+        scanf("%d", &option);
+
+        // Debugging print statement
+        printf("Option selected: %d\n", option);
+
+        switch (option) {
+            // Cases for different options
+            case 1:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                listFiles(&sb, dirName);
+                break;
+
+            case 2:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                changeDirectory(&sb, dirName);
+                break;
+
+            case 3:
+                printf("Enter source directory name: ");
+                scanf("%s", srcDir);
+                printf("Enter destination directory name: ");
+                scanf("%s", destDir);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                copyFile(&sb, srcDir, destDir, fileName);
+                break;
+
+            case 4:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                removeFile(&sb, dirName, fileName);
+                break;
+
+            case 5:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                removeDirectory(&sb, dirName);
+                break;
+
+            case 6:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                createFile(&sb, dirName, fileName);
+                break;
+
+            case 7:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                makeDirectory(&sb, dirName);
+                break;
+
+            case 8:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter old file name: ");
+                scanf("%s", oldFileName);
+                printf("Enter new file name: ");
+                scanf("%s", newFileName);
+                renameFile(&sb, dirName, oldFileName, newFileName);
+                break;
+
+            case 9:
+                printf("Enter old directory name: ");
+                scanf("%s", dirName);
+                printf("Enter new directory name: ");
+                scanf("%s", newFileName);
+                renameDirectory(&sb, dirName, newFileName);
+                break;
+
+            case 10:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                readFile(&sb, dirName, fileName);
+                break;
+                
+            case 11:
+                
+                printCurrentDirectoryPath(sb.currentDirectory);
+                break;
+
+            case 12:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                printf("Enter content: ");
+                readContent(content, sizeof(content));
+                echo(&sb, dirName, fileName, content);
+                break;
+
+            case 13:
+                printf("Enter directory name ('*' for all): ");
+                scanf("%s", dirName);
+                printf("Enter file/directory name or pattern: ");
+                scanf("%s", fileName);
+                findFile(&sb, dirName, fileName);
+                break;
+
+            case 14:
+                printCacheStats(&sb);
+                break;
+
+            case 15: {
+                long offset, length;
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                printf("Enter offset: ");
+                scanf("%ld", &offset);
+                printf("Enter length (-1 for the rest of the file): ");
+                scanf("%ld", &length);
+                readFileRange(&sb, dirName, fileName, offset, length);
+                break;
+            }
+
+            case 16:
+                printf("Enter directory name: ");
+                scanf("%s", dirName);
+                printf("Enter file name: ");
+                scanf("%s", fileName);
+                printf("Enter content: ");
+                readContent(content, sizeof(content));
+                appendContent(&sb, dirName, fileName, content);
+                break;
+
+            case 17:
+                printOperationStats(&sb, false);
+                break;
+
+            case 18:
+                printf("Enter snapshot name: ");
+                scanf("%s", fileName);
+                fsSnapshot(&sb, fileName);
+                break;
+
+            case 19:
+                fsListSnapshots(&sb);
+                break;
+
+            case 20:
+                printf("Enter snapshot name: ");
+                scanf("%s", fileName);
+                fsRollback(&sb, fileName);
+                break;
+
+            case 0:
+                printf("Exiting...\n");
+                closeFileSystem(&sb);
+                return 0;
+
+            default:
+                printf("Invalid option!\n");
+                break;
+
+        }
+
+    }
+
+    return 0;
+}
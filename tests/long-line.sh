@@ -0,0 +1,34 @@
+#!/bin/sh
+# Batch mode must reject a script line longer than its 4096-byte buffer as a whole. Cut
+# into pieces, the part after the cut used to run as a command of its own: here the
+# tail of an echo would remove /keep/f.
+#
+# Usage: tests/long-line.sh ./filesystem
+set -e
+fs=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+{
+    echo "mkdir /keep"
+    echo "touch /keep/f"
+    printf 'echo %s' "$(head -c 4090 /dev/zero | tr '\0' a)"
+    echo "rm /keep/f"
+    echo "ls /keep"
+} > script.txt
+
+status=0
+"$fs" -b script.txt > out.txt || status=$?
+
+fail() {
+    echo "FAIL: $1"
+    cat out.txt
+    exit 1
+}
+[ "$status" -eq 1 ] || fail "exit status $status, expected 1"
+grep -qx '\[3\] failed (line too long)' out.txt || fail "line 3 not reported as too long"
+grep -qx -- '- f' out.txt || fail "/keep/f was removed"
+grep -q '^Batch complete: 4 commands, 1 failed' out.txt || fail "wrong summary"
+[ "$(grep -c '^\[' out.txt)" -eq 4 ] || fail "expected one status line per script line"
+echo "PASS"